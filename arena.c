@@ -0,0 +1,137 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 8
+
+void arena_init(Arena* arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->chunk_size = chunk_size;
+    arena->allocated = 0;
+}
+
+// Allocate size bytes; oversized requests get a dedicated chunk
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaChunk* chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + chunk_size);
+        if (!chunk) return NULL;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = arena->head;
+        arena->head = chunk;
+        arena->allocated += chunk_size;
+    }
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+// Copy len bytes of str into the arena as a NUL-terminated string
+char* arena_strndup(Arena* arena, const char* str, size_t len) {
+    char* copy = (char*)arena_alloc(arena, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_free(Arena* arena) {
+    ArenaChunk* chunk = arena->head;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->allocated = 0;
+}
+
+void slab_init(SlabTable* table, size_t record_size) {
+    memset(table->chunks, 0, sizeof(table->chunks));
+    table->record_size = record_size;
+    table->count = 0;
+}
+
+// Map an id to its chunk and offset: ids are numbered so that
+// id + SLAB_FIRST_CHUNK has its highest bit at position chunk + shift
+static void slab_locate(uint32_t id, uint32_t* chunk, uint32_t* offset) {
+    uint64_t n = (uint64_t)id + SLAB_FIRST_CHUNK;
+    #if defined(__GNUC__)
+    uint32_t bit = 63 - (uint32_t)__builtin_clzll(n);
+    #else
+    uint32_t bit = 0;
+    while (n >> (bit + 1)) {
+        bit++;
+    }
+    #endif
+    *chunk = bit - SLAB_FIRST_CHUNK_SHIFT;
+    *offset = (uint32_t)(n - ((uint64_t)1 << bit));
+}
+
+void* slab_get(const SlabTable* table, uint32_t id) {
+    if (id >= table->count) return NULL;
+    uint32_t chunk, offset;
+    slab_locate(id, &chunk, &offset);
+    return (char*)table->chunks[chunk] + (size_t)offset * table->record_size;
+}
+
+// Append a zeroed record and return it, storing its id. Returns NULL if
+// memory runs out.
+void* slab_append(SlabTable* table, uint32_t* id) {
+    uint32_t chunk, offset;
+    slab_locate(table->count, &chunk, &offset);
+    if (chunk >= SLAB_MAX_CHUNKS) return NULL;
+
+    if (!table->chunks[chunk]) {
+        size_t records = (size_t)SLAB_FIRST_CHUNK << chunk;
+        table->chunks[chunk] = calloc(records, table->record_size);
+        if (!table->chunks[chunk]) return NULL;
+    }
+
+    char* record = (char*)table->chunks[chunk] + (size_t)offset * table->record_size;
+    memset(record, 0, table->record_size);
+    *id = table->count++;
+    return record;
+}
+
+// Grow the table to count zeroed records at once. New chunks come from
+// calloc, so records that are never written cost no memory. Returns -1 if
+// memory runs out.
+int slab_extend(SlabTable* table, uint32_t count) {
+    if (count <= table->count) return 0;
+    uint32_t chunk, offset;
+    slab_locate(count - 1, &chunk, &offset);
+    if (chunk >= SLAB_MAX_CHUNKS) return -1;
+
+    /* the chunk being filled may still hold a dropped record */
+    slab_locate(table->count, &chunk, &offset);
+    if (table->chunks[chunk]) {
+        size_t records = ((size_t)SLAB_FIRST_CHUNK << chunk) - offset;
+        if (records > count - table->count) records = count - table->count;
+        memset((char*)table->chunks[chunk] + (size_t)offset * table->record_size, 0, records * table->record_size);
+    }
+    for (uint64_t id = table->count; id < count; ) {
+        slab_locate((uint32_t)id, &chunk, &offset);
+        size_t records = (size_t)SLAB_FIRST_CHUNK << chunk;
+        if (!table->chunks[chunk]) {
+            table->chunks[chunk] = calloc(records, table->record_size);
+            if (!table->chunks[chunk]) return -1;
+        }
+        id += records - offset;
+    }
+    table->count = count;
+    return 0;
+}
+
+void slab_free(SlabTable* table) {
+    for (int i = 0; i < SLAB_MAX_CHUNKS; i++) {
+        free(table->chunks[i]);
+        table->chunks[i] = NULL;
+    }
+    table->count = 0;
+}
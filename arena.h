@@ -0,0 +1,47 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Arena: bump allocator for variable-length data (such as message content)
+// that is released all at once. Allocations are 8-byte aligned.
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* head;   // Chunk currently being filled
+    size_t chunk_size;  // Default size of new chunks
+    size_t allocated;   // Bytes held in all chunks
+} Arena;
+
+void arena_init(Arena* arena, size_t chunk_size);
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strndup(Arena* arena, const char* str, size_t len);
+void arena_free(Arena* arena);
+
+// SlabTable: grow-only table of fixed-size records addressed by dense ids.
+// Chunk k holds SLAB_FIRST_CHUNK << k records, so the table doubles as it
+// grows without ever moving a record: pointers and ids stay valid, and
+// lookups need no lock. Only appends must be serialized by the caller.
+#define SLAB_FIRST_CHUNK_SHIFT 6
+#define SLAB_FIRST_CHUNK (1u << SLAB_FIRST_CHUNK_SHIFT)
+#define SLAB_MAX_CHUNKS 26
+
+typedef struct {
+    void* chunks[SLAB_MAX_CHUNKS];
+    size_t record_size;
+    uint32_t count;
+} SlabTable;
+
+void slab_init(SlabTable* table, size_t record_size);
+void* slab_get(const SlabTable* table, uint32_t id);
+void* slab_append(SlabTable* table, uint32_t* id);
+int slab_extend(SlabTable* table, uint32_t count);
+void slab_free(SlabTable* table);
+
+#endif // ARENA_H
@@ -14,6 +14,8 @@ socket_t client_socket;
 bool is_connected = false;
 char current_username[MAX_USERNAME] = "";
 bool is_logged_in = false;
+ProtocolFormat wire_format = PROTO_TEXT;  // --binary selects compact frames
+static mutex_t send_lock;  // The receive thread also sends (offline acks)
 
 // Initialize client socket
 int init_client(socket_t* client_socket, const char* server_ip) {
@@ -71,9 +73,11 @@ int init_client(socket_t* client_socket, const char* server_ip) {
 // Send command to server
 void send_command(socket_t socket, ProtocolMessage* msg) {
     int len;
-    char* buffer = serialize_protocol_message(msg, &len);
+    char* buffer = encode_protocol_message(msg, wire_format, &len);
     if (buffer) {
-        int sent = send(socket, buffer, len, 0);
+        mutex_lock(&send_lock);
+        int sent = send_all(socket, buffer, len);
+        mutex_unlock(&send_lock);
         if (sent == SOCKET_ERROR) {
             #ifdef _WIN32
             printf("Send failed: %d\n", WSAGetLastError());
@@ -86,24 +90,20 @@ void send_command(socket_t socket, ProtocolMessage* msg) {
     }
 }
 
-// Receive response from server
-void receive_response(socket_t socket) {
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-    
-    int bytes_received = recv(socket, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_received <= 0) {
-        is_connected = false;
-        return;
-    }
-    
-    buffer[bytes_received] = '\0';
-    ProtocolMessage* msg = deserialize_protocol_message(buffer, bytes_received);
-    if (!msg) return;
-    
+// Partial frame carried between reads of the receive thread
+static RecvBuffer pending;
+
+// Show one message from the server and update login state
+static void display_message(ProtocolMessage* msg) {
     switch (msg->cmd) {
         case CMD_RECEIVE_MESSAGE:
-            printf("\n[Message from %s]: %s\n", msg->sender, msg->content);
+            if (strncmp(msg->extra_data, "OFFLINE:", 8) != 0) {
+                printf("\n[Message from %s]: %s\n", msg->sender, msg->content);
+            } else if (msg->recipient[0] != '\0') {
+                printf("\n[Offline message from %s in %s]: %s\n", msg->sender, msg->recipient, msg->content);
+            } else {
+                printf("\n[Offline message from %s]: %s\n", msg->sender, msg->content);
+            }
             printf("> ");
             fflush(stdout);
             break;
@@ -131,16 +131,75 @@ void receive_response(socket_t socket) {
             break;
         case CMD_SEARCH_HISTORY:
             printf("%s\n", msg->content);
+            if (msg->extra_data[0] != '\0') {
+                printf("More results: search again with page token %s\n", msg->extra_data);
+            }
             break;
         case CMD_GET_PINNED:
             printf("%s\n", msg->content);
             break;
+        case CMD_GET_HISTORY:
+            printf("%s", msg->content);
+            if (strncmp(msg->extra_data, "BEFORE:", 7) == 0) {
+                printf("Older messages: fetch again with cursor %s\n", msg->extra_data);
+            } else if (msg->extra_data[0] != '\0') {
+                printf("Newer messages later: fetch with cursor %s\n", msg->extra_data);
+            }
+            break;
         default:
             printf("Response: %s\n", msg->content);
             break;
     }
+}
+
+// Receive response from server; one read may carry several frames
+void receive_response(socket_t socket) {
+    char buffer[RECV_CHUNK_SIZE];
     
-    free(msg);
+    int bytes_received = recv(socket, buffer, RECV_CHUNK_SIZE, 0);
+    if (bytes_received <= 0 || recv_buffer_append(&pending, buffer, bytes_received) < 0) {
+        is_connected = false;
+        return;
+    }
+
+    // Highest offline message sequence shown from this read
+    unsigned long long offline_seq = 0;
+
+    while (pending.end > pending.start) {
+        char* frame = pending.data + pending.start;
+        int frame_len = find_frame_length(frame, pending.end - pending.start);
+        if (frame_len < 0) {
+            printf("Malformed response from server\n");
+            is_connected = false;
+            return;
+        }
+        if (frame_len == 0) break;
+
+        char next = frame[frame_len];
+        frame[frame_len] = '\0';
+        ProtocolMessage* msg = deserialize_protocol_message(frame, frame_len);
+        frame[frame_len] = next;
+        recv_buffer_consume(&pending, frame_len);
+
+        if (msg) {
+            display_message(msg);
+            if (msg->cmd == CMD_RECEIVE_MESSAGE && strncmp(msg->extra_data, "OFFLINE:", 8) == 0) {
+                unsigned long long seq = strtoull(msg->extra_data + 8, NULL, 10);
+                if (seq > offline_seq) offline_seq = seq;
+            }
+            free(msg);
+        }
+    }
+
+    // Acknowledge offline messages once shown so they are not sent again
+    if (offline_seq > 0) {
+        ProtocolMessage ack;
+        memset(&ack, 0, sizeof(ProtocolMessage));
+        ack.cmd = CMD_ACK_OFFLINE;
+        strncpy(ack.sender, current_username, MAX_USERNAME - 1);
+        snprintf(ack.extra_data, sizeof(ack.extra_data), "%llu", offline_seq);
+        send_command(socket, &ack);
+    }
 }
 
 // Receive thread function
@@ -179,7 +238,8 @@ void print_menu() {
     printf("13. Unblock User\n");
     printf("14. Pin Message\n");
     printf("15. Get Pinned Messages\n");
-    printf("16. Disconnect\n");
+    printf("16. Get Group History\n");
+    printf("17. Disconnect\n");
     printf("0. Exit\n");
     printf("Choice: ");
 }
@@ -234,6 +294,7 @@ void handle_user_input(socket_t socket, const char* username) {
                     strncpy(current_username, msg.sender, MAX_USERNAME - 1);
                     msg.cmd = CMD_LOGIN;
                     strncpy(msg.content, password, MAX_CONTENT - 1);
+                    strncpy(msg.extra_data, "ACK_OFFLINE", sizeof(msg.extra_data) - 1);  // We send CMD_ACK_OFFLINE
                     send_command(socket, &msg);
 
                     /* Wait for server response (receive_response runs in separate thread)
@@ -369,6 +430,9 @@ void handle_user_input(socket_t socket, const char* username) {
                     printf("Enter recipient (or group ID, leave empty for all): ");
                     fgets(msg.recipient, sizeof(msg.recipient), stdin);
                     trim_newline(msg.recipient);
+                    printf("Enter page token (leave empty for the newest results): ");
+                    fgets(msg.extra_data, sizeof(msg.extra_data), stdin);
+                    trim_newline(msg.extra_data);
                     msg.cmd = CMD_SEARCH_HISTORY;
                     send_command(socket, &msg);
                     break;
@@ -404,7 +468,7 @@ void handle_user_input(socket_t socket, const char* username) {
                     printf("Enter group ID or recipient: ");
                     fgets(msg.recipient, sizeof(msg.recipient), stdin);
                     trim_newline(msg.recipient);
-                    printf("Enter message ID to pin: ");
+                    printf("Enter message ID to pin (#id from group history): ");
                     fgets(msg.extra_data, sizeof(msg.extra_data), stdin);
                     trim_newline(msg.extra_data);
                     msg.cmd = CMD_PIN_MESSAGE;
@@ -419,7 +483,21 @@ void handle_user_input(socket_t socket, const char* username) {
                     send_command(socket, &msg);
                     break;
                 }
-                case 16: {  // Disconnect
+                case 16: {  // Group History
+                    printf("Enter group ID: ");
+                    fgets(msg.recipient, sizeof(msg.recipient), stdin);
+                    trim_newline(msg.recipient);
+                    printf("Enter cursor (BEFORE:<n> or AFTER:<n>, leave empty for the newest messages): ");
+                    fgets(msg.extra_data, sizeof(msg.extra_data), stdin);
+                    trim_newline(msg.extra_data);
+                    printf("Enter page size (leave empty for 20): ");
+                    fgets(msg.content, sizeof(msg.content), stdin);
+                    trim_newline(msg.content);
+                    msg.cmd = CMD_GET_HISTORY;
+                    send_command(socket, &msg);
+                    break;
+                }
+                case 17: {  // Disconnect
                     msg.cmd = CMD_DISCONNECT;
                     send_command(socket, &msg);
                     is_connected = false;
@@ -446,11 +524,19 @@ void handle_user_input(socket_t socket, const char* username) {
 
 // Main client function
 int main(int argc, char* argv[]) {
-    const char* server_ip = (argc > 1) ? argv[1] : "127.0.0.1";
+    const char* server_ip = "127.0.0.1";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            wire_format = PROTO_BINARY;
+        } else {
+            server_ip = argv[i];
+        }
+    }
     
     if (init_client(&client_socket, server_ip) < 0) {
         return 1;
     }
+    mutex_init(&send_lock);
     
     // Start receive thread
     #ifdef _WIN32
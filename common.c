@@ -1,72 +1,457 @@
 #include "common.h"
+#include "scan.h"
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/uio.h>
+#endif
 
-// Log activity to file
-void log_activity(const char* username, const char* action, const char* details) {
-    FILE* log_file = fopen("activity.log", "a");
-    if (log_file) {
-        time_t now = time(NULL);
-        char* time_str = get_timestamp_string(now);
-        fprintf(log_file, "[%s] User: %s | Action: %s | Details: %s\n", 
-                time_str, username, action, details);
-        fclose(log_file);
-        free(time_str);
+// How long send_all() waits for a full socket buffer to drain
+#define SEND_TIMEOUT_MS 5000
+
+// Frames gathered into one sendmsg() call
+#define SEND_IOV_MAX 64
+
+// Tell binary frames from text ones by their first byte
+ProtocolFormat detect_protocol_format(const char* buffer, int len) {
+    if (len > 0 && (unsigned char)buffer[0] == BINARY_FRAME_MAGIC) {
+        return PROTO_BINARY;
+    }
+    return PROTO_TEXT;
+}
+
+// Number of bytes value takes as a varint
+static int varint_size(uint32_t value) {
+    int size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// Write value as an unsigned LEB128 varint; returns bytes written
+static int put_varint(char* out, uint32_t value) {
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (char)value;
+    return n;
+}
+
+// Read a varint; returns bytes consumed, 0 if more input is needed, -1 if malformed
+static int get_varint(const char* in, int len, uint32_t* value) {
+    uint32_t result = 0;
+    for (int i = 0; i < 5; i++) {
+        if (i >= len) return 0;
+        unsigned char byte = (unsigned char)in[i];
+        result |= (uint32_t)(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
     }
+    return -1;
+}
+
+StrView str_view(const char* s) {
+    StrView view = { s, (int)strlen(s) };
+    return view;
+}
+
+// View the fields of msg, which must outlive the view
+void message_view_of(const ProtocolMessage* msg, MessageView* view) {
+    view->cmd = msg->cmd;
+    view->sender = str_view(msg->sender);
+    view->recipient = str_view(msg->recipient);
+    view->content = str_view(msg->content);
+    view->extra = str_view(msg->extra_data);
+    view->msg_type = msg->msg_type;
+    view->is_pinned = msg->is_pinned;
+}
+
+// A text field cannot hold the '|' that ends it, but one decoded from a
+// binary frame may. Relayed as is, it would end the field early and could
+// start a forged frame, so text frames carry this byte in its place.
+#define TEXT_BAR_STANDIN '/'
+
+// Append len bytes of data at out + *pos as far as size allows, and move
+// *pos on by len. Fields get their '|' replaced.
+static void put_text(char* out, size_t size, size_t* pos, const char* data, int len, bool is_field) {
+    if (*pos + 1 < size) {
+        size_t n = size - 1 - *pos < (size_t)len ? size - 1 - *pos : (size_t)len;
+        char* p = out + *pos;
+        memcpy(p, data, n);
+        char* end = p + n;
+        while (is_field && (p = (char*)memchr(p, '|', (size_t)(end - p))) != NULL) {
+            *p++ = TEXT_BAR_STANDIN;
+        }
+    }
+    *pos += (size_t)len;
+}
+
+// Write the text form of msg into out. Returns its full length, which is
+// size or more if it was cut.
+static int format_text_view(const MessageView* msg, char* out, size_t size) {
+    static const char* const tags[4] = { "|SENDER:", "|RECIPIENT:", "|CONTENT:", "|EXTRA:" };
+    const StrView* fields[4] = { &msg->sender, &msg->recipient, &msg->content, &msg->extra };
+    char number[48];
+
+    size_t pos = 0;
+    int n = snprintf(number, sizeof(number), "CMD:%d", msg->cmd);
+    put_text(out, size, &pos, number, n, false);
+    for (int i = 0; i < 4; i++) {
+        put_text(out, size, &pos, tags[i], (int)strlen(tags[i]), false);
+        put_text(out, size, &pos, fields[i]->data, fields[i]->len, true);
+    }
+    n = snprintf(number, sizeof(number), "|TYPE:%d|PINNED:%d|", msg->msg_type, msg->is_pinned ? 1 : 0);
+    put_text(out, size, &pos, number, n, false);
+    out[pos < size ? pos : size - 1] = '\0';
+    return (int)pos;
 }
 
 // Serialize protocol message to string
 char* serialize_protocol_message(ProtocolMessage* msg, int* len) {
     char* buffer = (char*)malloc(BUFFER_SIZE);
     if (!buffer) return NULL;
-    
-    snprintf(buffer, BUFFER_SIZE, 
-             "CMD:%d|SENDER:%s|RECIPIENT:%s|CONTENT:%s|EXTRA:%s|TYPE:%d|PINNED:%d|",
-             msg->cmd, msg->sender, msg->recipient, msg->content, 
-             msg->extra_data, msg->msg_type, msg->is_pinned ? 1 : 0);
-    
-    *len = strlen(buffer);
+
+    MessageView view;
+    message_view_of(msg, &view);
+    *len = format_text_view(&view, buffer, BUFFER_SIZE);
+    if (*len >= BUFFER_SIZE) *len = BUFFER_SIZE - 1;
     return buffer;
 }
 
-// Deserialize string to protocol message
+// Copy a length-delimited field, truncating to the destination size
+static void copy_field(char* dst, size_t dst_size, const char* src, uint32_t len) {
+    size_t n = len < dst_size - 1 ? len : dst_size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+// Deserialize a text or binary frame to a newly allocated protocol message
 ProtocolMessage* deserialize_protocol_message(char* buffer, int len) {
-    (void)len;  // Suppress unused parameter warning
     ProtocolMessage* msg = (ProtocolMessage*)malloc(sizeof(ProtocolMessage));
     if (!msg) return NULL;
-    
-    memset(msg, 0, sizeof(ProtocolMessage));
-    
-    // Simple parsing
-    char* token = strtok(buffer, "|");
-    while (token) {
-        if (strncmp(token, "CMD:", 4) == 0) {
-            msg->cmd = (CommandType)atoi(token + 4);
-        } else if (strncmp(token, "SENDER:", 7) == 0) {
-            strncpy(msg->sender, token + 7, MAX_USERNAME - 1);
-        } else if (strncmp(token, "RECIPIENT:", 10) == 0) {
-            strncpy(msg->recipient, token + 10, MAX_USERNAME - 1);
-        } else if (strncmp(token, "CONTENT:", 8) == 0) {
-            strncpy(msg->content, token + 8, MAX_CONTENT - 1);
-        } else if (strncmp(token, "EXTRA:", 6) == 0) {
-            strncpy(msg->extra_data, token + 6, 499);
-        } else if (strncmp(token, "TYPE:", 5) == 0) {
-            msg->msg_type = (MessageType)atoi(token + 5);
-        } else if (strncmp(token, "PINNED:", 7) == 0) {
-            msg->is_pinned = atoi(token + 7) == 1;
-        }
-        token = strtok(NULL, "|");
-    }
-    
+
+    if (decode_protocol_message(buffer, len, msg) < 0) {
+        free(msg);
+        return NULL;
+    }
     return msg;
 }
 
-// Get timestamp as string
+// Decode a frame into msg, cutting fields to the sizes of its arrays.
+// Parses in place like parse_message_view(). Returns -1 if malformed.
+int decode_protocol_message(char* buffer, int len, ProtocolMessage* msg) {
+    MessageView view;
+    if (parse_message_view(buffer, len, &view) < 0) return -1;
+
+    memset(msg, 0, sizeof(ProtocolMessage));
+    msg->cmd = view.cmd;
+    copy_field(msg->sender, sizeof(msg->sender), view.sender.data, (uint32_t)view.sender.len);
+    copy_field(msg->recipient, sizeof(msg->recipient), view.recipient.data, (uint32_t)view.recipient.len);
+    copy_field(msg->content, sizeof(msg->content), view.content.data, (uint32_t)view.content.len);
+    copy_field(msg->extra_data, sizeof(msg->extra_data), view.extra.data, (uint32_t)view.extra.len);
+    msg->msg_type = view.msg_type;
+    msg->is_pinned = view.is_pinned;
+    return 0;
+}
+
+// Point a view field at len bytes of the frame and terminate them there.
+// Sender, recipient and extra keep their historical size limits; content
+// is as long as the frame allows.
+static void set_view_field(StrView* field, char* data, int len, int max_len) {
+    if (len > max_len) len = max_len;
+    data[len] = '\0';
+    field->data = data;
+    field->len = len;
+}
+
+#define VIEW_MAX_NAME (MAX_USERNAME - 1)
+#define VIEW_MAX_EXTRA ((int)sizeof(((ProtocolMessage*)0)->extra_data) - 1)
+
+// Delimiters located per scan of a text frame; a frame has 7 fields
+#define TEXT_BARS_PER_SCAN 16
+
+// Parse the token p..stop of a text frame
+static void parse_text_token(MessageView* view, char* p, char* stop) {
+    int token_len = (int)(stop - p);
+    *stop = '\0';
+
+    if (strncmp(p, "CMD:", 4) == 0) {
+        view->cmd = (CommandType)atoi(p + 4);
+    } else if (strncmp(p, "SENDER:", 7) == 0) {
+        set_view_field(&view->sender, p + 7, token_len - 7, VIEW_MAX_NAME);
+    } else if (strncmp(p, "RECIPIENT:", 10) == 0) {
+        set_view_field(&view->recipient, p + 10, token_len - 10, VIEW_MAX_NAME);
+    } else if (strncmp(p, "CONTENT:", 8) == 0) {
+        set_view_field(&view->content, p + 8, token_len - 8, INT32_MAX);
+    } else if (strncmp(p, "EXTRA:", 6) == 0) {
+        set_view_field(&view->extra, p + 6, token_len - 6, VIEW_MAX_EXTRA);
+    } else if (strncmp(p, "TYPE:", 5) == 0) {
+        view->msg_type = (MessageType)atoi(p + 5);
+    } else if (strncmp(p, "PINNED:", 7) == 0) {
+        view->is_pinned = atoi(p + 7) == 1;
+    }
+}
+
+// Split a text frame at every '|', a batch of delimiters per scan
+static int parse_text_view(char* buffer, int len, MessageView* view) {
+    int bars[TEXT_BARS_PER_SCAN];
+    char* p = buffer;
+    char* end = buffer + len;
+    while (p < end) {
+        char* base = p;
+        int found = scan_split(base, (int)(end - base), '|', bars, TEXT_BARS_PER_SCAN);
+        for (int i = 0; i < found; i++) {
+            parse_text_token(view, p, base + bars[i]);
+            p = base + bars[i] + 1;
+        }
+        if (found < TEXT_BARS_PER_SCAN) {
+            if (p < end) parse_text_token(view, p, end);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int parse_binary_view(char* buffer, int len, MessageView* view) {
+    if (len < 1 || (unsigned char)buffer[0] != BINARY_FRAME_MAGIC) return -1;
+
+    uint32_t body_len;
+    int n = get_varint(buffer + 1, len - 1, &body_len);
+    if (n <= 0 || body_len > BINARY_MAX_BODY || len < 1 + n + (int)body_len) return -1;
+
+    char* p = buffer + 1 + n;
+    int remaining = (int)body_len;
+    uint32_t value;
+
+    n = get_varint(p, remaining, &value);
+    if (n <= 0 || remaining - n < 1) return -1;
+    view->cmd = (CommandType)value;
+    p += n;
+    remaining -= n;
+
+    unsigned char flags = (unsigned char)*p++;
+    remaining--;
+
+    /* find every field first: terminating one overwrites the length of the next */
+    StrView* fields[4] = { &view->sender, &view->recipient, &view->content, &view->extra };
+    const int limits[4] = { VIEW_MAX_NAME, VIEW_MAX_NAME, INT32_MAX, VIEW_MAX_EXTRA };
+    char* starts[4] = { NULL, NULL, NULL, NULL };
+    int lengths[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 4; i++) {
+        if (!(flags & (1 << i))) continue;
+        n = get_varint(p, remaining, &value);
+        if (n <= 0 || value > (uint32_t)(remaining - n)) return -1;
+        starts[i] = p + n;
+        lengths[i] = (int)value;
+        p += n + value;
+        remaining -= n + (int)value;
+    }
+
+    if (flags & BIN_HAS_TYPE) {
+        n = get_varint(p, remaining, &value);
+        if (n <= 0) return -1;
+        view->msg_type = (MessageType)value;
+    }
+    view->is_pinned = (flags & BIN_PINNED) != 0;
+
+    /* trailing bytes are ignored so newer peers can append fields */
+    for (int i = 0; i < 4; i++) {
+        if (starts[i]) set_view_field(fields[i], starts[i], lengths[i], limits[i]);
+    }
+    return 0;
+}
+
+// Parse a complete text or binary frame in place. The view's fields point
+// into buffer, which is modified to NUL-terminate them; buffer[len] must be
+// writable. Absent fields are empty strings. Returns -1 if malformed.
+int parse_message_view(char* buffer, int len, MessageView* view) {
+    static const char empty[] = "";
+    StrView none = { empty, 0 };
+    view->cmd = (CommandType)0;
+    view->sender = view->recipient = view->content = view->extra = none;
+    view->msg_type = MSG_TEXT;
+    view->is_pinned = false;
+
+    if (detect_protocol_format(buffer, len) == PROTO_BINARY) {
+        return parse_binary_view(buffer, len, view);
+    }
+    return parse_text_view(buffer, len, view);
+}
+
+// Body length and presence flags of msg as a binary frame
+static uint32_t binary_body_length(const MessageView* msg, unsigned char* flags_out) {
+    const StrView* fields[4] = { &msg->sender, &msg->recipient, &msg->content, &msg->extra };
+    unsigned char flags = 0;
+    uint32_t body_len = varint_size((uint32_t)msg->cmd) + 1;
+
+    for (int i = 0; i < 4; i++) {
+        if (fields[i]->len > 0) {
+            flags |= (unsigned char)(1 << i);  // BIN_HAS_SENDER .. BIN_HAS_EXTRA
+            body_len += varint_size((uint32_t)fields[i]->len) + (uint32_t)fields[i]->len;
+        }
+    }
+    if (msg->msg_type != MSG_TEXT) {
+        flags |= BIN_HAS_TYPE;
+        body_len += varint_size((uint32_t)msg->msg_type);
+    }
+    if (msg->is_pinned) {
+        flags |= BIN_PINNED;
+    }
+    *flags_out = flags;
+    return body_len;
+}
+
+// Encode msg as a binary frame into out. Returns the frame length, or -1 if
+// it does not fit in capacity bytes.
+int encode_binary_view(const MessageView* msg, char* out, int capacity) {
+    const StrView* fields[4] = { &msg->sender, &msg->recipient, &msg->content, &msg->extra };
+    unsigned char flags;
+    uint32_t body_len = binary_body_length(msg, &flags);
+
+    if (1 + varint_size(body_len) + (int64_t)body_len > capacity) {
+        return -1;
+    }
+
+    int n = 0;
+    out[n++] = (char)BINARY_FRAME_MAGIC;
+    n += put_varint(out + n, body_len);
+    n += put_varint(out + n, (uint32_t)msg->cmd);
+    out[n++] = (char)flags;
+    for (int i = 0; i < 4; i++) {
+        if (fields[i]->len > 0) {
+            n += put_varint(out + n, (uint32_t)fields[i]->len);
+            memcpy(out + n, fields[i]->data, (size_t)fields[i]->len);
+            n += fields[i]->len;
+        }
+    }
+    if (flags & BIN_HAS_TYPE) {
+        n += put_varint(out + n, (uint32_t)msg->msg_type);
+    }
+    return n;
+}
+
+int encode_binary_message(const ProtocolMessage* msg, char* out, int capacity) {
+    MessageView view;
+    message_view_of(msg, &view);
+    return encode_binary_view(&view, out, capacity);
+}
+
+// Encode msg in the requested wire format into a newly allocated buffer
+char* encode_protocol_message(const ProtocolMessage* msg, ProtocolFormat format, int* len) {
+    if (format == PROTO_TEXT) {
+        return serialize_protocol_message((ProtocolMessage*)msg, len);
+    }
+
+    char* buffer = (char*)malloc(BUFFER_SIZE);
+    if (!buffer) return NULL;
+    *len = encode_binary_message(msg, buffer, BUFFER_SIZE);
+    if (*len < 0) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+// Length of the complete frame at the start of buffer. Returns 0 if more
+// bytes are needed and -1 if the data can never form a valid frame.
+// Text frames end with the PINNED field that serialize_protocol_message()
+// always writes last.
+int find_frame_length(const char* buffer, int len) {
+    if (len <= 0) return 0;
+
+    if (detect_protocol_format(buffer, len) == PROTO_BINARY) {
+        uint32_t body_len;
+        int n = get_varint(buffer + 1, len - 1, &body_len);
+        if (n <= 0) return n;
+        if (body_len > BINARY_MAX_BODY) return -1;
+        int frame_len = 1 + n + (int)body_len;
+        return len >= frame_len ? frame_len : 0;
+    }
+
+    for (int i = 0; i + 7 <= len; i++) {
+        int found = scan_find(buffer + i, len - i, "PINNED:", 7);
+        if (found < 0) break;
+        i += found;
+        if (i > 0 && buffer[i - 1] != '|') {
+            continue;
+        }
+        int j = i + 7;
+        while (j < len && buffer[j] >= '0' && buffer[j] <= '9') {
+            j++;
+        }
+        if (j == len) break;  // terminator not received yet
+        if (buffer[j] == '|') return j + 1;
+    }
+    return len > MAX_FRAME_SIZE ? -1 : 0;
+}
+
+// Buffer len more bytes. Returns -1 if memory runs out.
+int recv_buffer_append(RecvBuffer* rb, const char* data, int len) {
+    int pending = rb->end - rb->start;
+    if (rb->start > 0) {
+        memmove(rb->data, rb->data + rb->start, pending);
+        rb->start = 0;
+        rb->end = pending;
+    }
+
+    /* one spare byte lets callers NUL-terminate the last frame in place */
+    int needed = pending + len + 1;
+    if (needed > rb->capacity) {
+        int capacity = rb->capacity > 0 ? rb->capacity * 2 : 1024;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char* data_new = (char*)realloc(rb->data, capacity);
+        if (!data_new) return -1;
+        rb->data = data_new;
+        rb->capacity = capacity;
+    }
+
+    memcpy(rb->data + rb->end, data, len);
+    rb->end += len;
+    return 0;
+}
+
+// Drop len bytes from the front; releases the storage once nothing is pending
+void recv_buffer_consume(RecvBuffer* rb, int len) {
+    rb->start += len;
+    if (rb->start >= rb->end) {
+        recv_buffer_free(rb);
+    }
+}
+
+void recv_buffer_free(RecvBuffer* rb) {
+    free(rb->data);
+    rb->data = NULL;
+    rb->capacity = 0;
+    rb->start = 0;
+    rb->end = 0;
+}
+
+// Get timestamp as a newly allocated string
 char* get_timestamp_string(time_t t) {
     char* str = (char*)malloc(50);
-    struct tm* timeinfo = localtime(&t);
-    strftime(str, 50, "%Y-%m-%d %H:%M:%S", timeinfo);
+    if (!str) return NULL;
+    format_time(t, str, 50);
     return str;
 }
 
+// Format a timestamp as local "YYYY-MM-DD HH:MM:SS" into out
+void format_time(time_t t, char* out, size_t size) {
+    struct tm timeinfo;
+    #ifdef _WIN32
+    localtime_s(&timeinfo, &t);
+    #else
+    localtime_r(&t, &timeinfo);
+    #endif
+    strftime(out, size, "%Y-%m-%d %H:%M:%S", &timeinfo);
+}
+
 // Remove newline from string
 void trim_newline(char* str) {
     int len = strlen(str);
@@ -75,3 +460,291 @@ void trim_newline(char* str) {
     }
 }
 
+// Send the whole buffer, retrying on partial writes. Nonblocking sockets
+// (epoll mode) wait for writability instead of failing on EAGAIN.
+int send_all(socket_t socket, const char* buffer, int len) {
+    int total = 0;
+    while (total < len) {
+        int sent = send(socket, buffer + total, len - total, 0);
+        if (sent == SOCKET_ERROR) {
+            #ifdef _WIN32
+            return SOCKET_ERROR;
+            #else
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = socket, .events = POLLOUT };
+                if (poll(&pfd, 1, SEND_TIMEOUT_MS) <= 0) {
+                    errno = ETIMEDOUT;
+                    return SOCKET_ERROR;
+                }
+                continue;
+            }
+            return SOCKET_ERROR;
+            #endif
+        }
+        total += sent;
+    }
+    return total;
+}
+
+// Write as much of frames (skipping the first offset bytes of frames[0])
+// as the socket takes without waiting, gathering up to SEND_IOV_MAX frames
+// per system call. Returns the number of bytes written (0 when the socket
+// buffer is full) or SOCKET_ERROR. Windows sockets stay blocking, so there
+// everything is written.
+int send_frames_nonblocking(socket_t socket, Frame* const* frames, int count, int offset) {
+    int total = 0;
+    #ifdef _WIN32
+    for (int i = 0; i < count; i++) {
+        if (send_all(socket, frames[i]->data + offset, frames[i]->len - offset) == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+        total += frames[i]->len - offset;
+        offset = 0;
+    }
+    #else
+    while (count > 0) {
+        struct iovec iov[SEND_IOV_MAX];
+        int n = count < SEND_IOV_MAX ? count : SEND_IOV_MAX;
+        size_t batch = 0;
+        for (int i = 0; i < n; i++) {
+            int skip = i == 0 ? offset : 0;
+            iov[i].iov_base = frames[i]->data + skip;
+            iov[i].iov_len = (size_t)(frames[i]->len - skip);
+            batch += iov[i].iov_len;
+        }
+
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = iov;
+        header.msg_iovlen = (size_t)n;
+        ssize_t sent = sendmsg(socket, &header, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return SOCKET_ERROR;
+        }
+
+        total += (int)sent;
+        if ((size_t)sent < batch) break;
+        frames += n;
+        count -= n;
+        offset = 0;
+    }
+    #endif
+    return total;
+}
+
+// Released frames are kept in a cache on each thread for its next
+// encodes, so steady traffic does not go through the allocator. Frames
+// come in two sizes; most replies and chat lines fit the small one. The
+// rare frame larger than BUFFER_SIZE is allocated to size and not cached.
+#define FRAME_SMALL_BYTES 512
+#define FRAME_CACHE_MAX 64    // Frames of each size kept per thread
+
+typedef struct {
+    Frame* frames[FRAME_CACHE_MAX];
+    int count;
+} FrameCache;
+
+static THREAD_LOCAL FrameCache frame_caches[2];  // Small, then BUFFER_SIZE
+
+static FrameCache* frame_cache_for(int capacity) {
+    return &frame_caches[capacity > FRAME_SMALL_BYTES ? 1 : 0];
+}
+
+static Frame* frame_alloc(int size) {
+    int capacity = size;
+    if (size <= BUFFER_SIZE) {
+        capacity = size > FRAME_SMALL_BYTES ? BUFFER_SIZE : FRAME_SMALL_BYTES;
+        FrameCache* cache = frame_cache_for(capacity);
+        if (cache->count > 0) {
+            return cache->frames[--cache->count];
+        }
+    }
+    Frame* frame = (Frame*)malloc(sizeof(Frame) + (size_t)capacity);
+    if (frame) frame->capacity = capacity;
+    return frame;
+}
+
+static int decimal_length(int value) {
+    int len = value < 0 ? 2 : 1;
+    while (value <= -10 || value >= 10) {
+        value /= 10;
+        len++;
+    }
+    return len;
+}
+
+// Encode msg once, straight into a shared, immutable frame with one
+// reference. The fields are copied once, from wherever the view points.
+Frame* frame_encode_view(const MessageView* msg, ProtocolFormat format) {
+    MessageView fitted;
+    int len;
+    if (format == PROTO_TEXT) {
+        len = (int)strlen("CMD:|SENDER:|RECIPIENT:|CONTENT:|EXTRA:|TYPE:|PINNED:0|") +
+              decimal_length((int)msg->cmd) + decimal_length((int)msg->msg_type) +
+              msg->sender.len + msg->recipient.len + msg->content.len + msg->extra.len;
+        if (len > MAX_FRAME_SIZE) {
+            /* peers give up on a text frame with no end in MAX_FRAME_SIZE
+               bytes, and a relay adds a sender to content that filled the
+               request, so cut the content to fit */
+            fitted = *msg;
+            if (len - MAX_FRAME_SIZE > fitted.content.len) return NULL;
+            fitted.content.len -= len - MAX_FRAME_SIZE;
+            msg = &fitted;
+            len = MAX_FRAME_SIZE;
+        }
+    } else {
+        unsigned char flags;
+        uint32_t body_len = binary_body_length(msg, &flags);
+        if (body_len > BINARY_MAX_BODY) {
+            /* peers reject larger bodies, so cut the content to fit */
+            fitted = *msg;
+            int excess = (int)(body_len - BINARY_MAX_BODY);
+            if (excess > fitted.content.len) return NULL;
+            fitted.content.len -= excess;
+            msg = &fitted;
+            body_len = binary_body_length(msg, &flags);
+        }
+        len = 1 + varint_size(body_len) + (int)body_len;
+    }
+
+    Frame* frame = frame_alloc(len + 1);  // format_text_view() also writes a terminator
+    if (!frame) return NULL;
+    if (format == PROTO_TEXT) {
+        format_text_view(msg, frame->data, (size_t)len + 1);
+    } else {
+        encode_binary_view(msg, frame->data, len);
+    }
+    atomic_init(&frame->refcount, 1);
+    frame->len = len;
+    return frame;
+}
+
+Frame* frame_encode(const ProtocolMessage* msg, ProtocolFormat format) {
+    MessageView view;
+    message_view_of(msg, &view);
+    return frame_encode_view(&view, format);
+}
+
+void frame_retain(Frame* frame) {
+    atomic_fetch_add(&frame->refcount, 1);
+}
+
+void frame_release(Frame* frame) {
+    if (atomic_fetch_sub(&frame->refcount, 1) == 1) {
+        FrameCache* cache = frame_cache_for(frame->capacity);
+        if (frame->capacity <= BUFFER_SIZE && cache->count < FRAME_CACHE_MAX) {
+            cache->frames[cache->count++] = frame;
+        } else {
+            free(frame);
+        }
+    }
+}
+
+// Free the calling thread's cached frames. Threads that exit call this
+// first.
+void frame_cache_flush(void) {
+    for (int c = 0; c < 2; c++) {
+        while (frame_caches[c].count > 0) {
+            free(frame_caches[c].frames[--frame_caches[c].count]);
+        }
+    }
+}
+
+// Wait on cond for at most timeout_ms. Returns 0 when signalled; spurious
+// wakeups and timeouts are not told apart, so callers recheck their state.
+int cond_timedwait_ms(cond_t* cond, mutex_t* mutex, int timeout_ms) {
+    #ifdef _WIN32
+    return SleepConditionVariableCS(cond, mutex, (DWORD)timeout_ms) ? 0 : -1;
+    #else
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(cond, mutex, &deadline) == 0 ? 0 : -1;
+    #endif
+}
+
+// CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320)
+static const uint32_t crc_table[256] = {
+    0x00000000u, 0x77073096u, 0xEE0E612Cu, 0x990951BAu, 0x076DC419u, 0x706AF48Fu,
+    0xE963A535u, 0x9E6495A3u, 0x0EDB8832u, 0x79DCB8A4u, 0xE0D5E91Eu, 0x97D2D988u,
+    0x09B64C2Bu, 0x7EB17CBDu, 0xE7B82D07u, 0x90BF1D91u, 0x1DB71064u, 0x6AB020F2u,
+    0xF3B97148u, 0x84BE41DEu, 0x1ADAD47Du, 0x6DDDE4EBu, 0xF4D4B551u, 0x83D385C7u,
+    0x136C9856u, 0x646BA8C0u, 0xFD62F97Au, 0x8A65C9ECu, 0x14015C4Fu, 0x63066CD9u,
+    0xFA0F3D63u, 0x8D080DF5u, 0x3B6E20C8u, 0x4C69105Eu, 0xD56041E4u, 0xA2677172u,
+    0x3C03E4D1u, 0x4B04D447u, 0xD20D85FDu, 0xA50AB56Bu, 0x35B5A8FAu, 0x42B2986Cu,
+    0xDBBBC9D6u, 0xACBCF940u, 0x32D86CE3u, 0x45DF5C75u, 0xDCD60DCFu, 0xABD13D59u,
+    0x26D930ACu, 0x51DE003Au, 0xC8D75180u, 0xBFD06116u, 0x21B4F4B5u, 0x56B3C423u,
+    0xCFBA9599u, 0xB8BDA50Fu, 0x2802B89Eu, 0x5F058808u, 0xC60CD9B2u, 0xB10BE924u,
+    0x2F6F7C87u, 0x58684C11u, 0xC1611DABu, 0xB6662D3Du, 0x76DC4190u, 0x01DB7106u,
+    0x98D220BCu, 0xEFD5102Au, 0x71B18589u, 0x06B6B51Fu, 0x9FBFE4A5u, 0xE8B8D433u,
+    0x7807C9A2u, 0x0F00F934u, 0x9609A88Eu, 0xE10E9818u, 0x7F6A0DBBu, 0x086D3D2Du,
+    0x91646C97u, 0xE6635C01u, 0x6B6B51F4u, 0x1C6C6162u, 0x856530D8u, 0xF262004Eu,
+    0x6C0695EDu, 0x1B01A57Bu, 0x8208F4C1u, 0xF50FC457u, 0x65B0D9C6u, 0x12B7E950u,
+    0x8BBEB8EAu, 0xFCB9887Cu, 0x62DD1DDFu, 0x15DA2D49u, 0x8CD37CF3u, 0xFBD44C65u,
+    0x4DB26158u, 0x3AB551CEu, 0xA3BC0074u, 0xD4BB30E2u, 0x4ADFA541u, 0x3DD895D7u,
+    0xA4D1C46Du, 0xD3D6F4FBu, 0x4369E96Au, 0x346ED9FCu, 0xAD678846u, 0xDA60B8D0u,
+    0x44042D73u, 0x33031DE5u, 0xAA0A4C5Fu, 0xDD0D7CC9u, 0x5005713Cu, 0x270241AAu,
+    0xBE0B1010u, 0xC90C2086u, 0x5768B525u, 0x206F85B3u, 0xB966D409u, 0xCE61E49Fu,
+    0x5EDEF90Eu, 0x29D9C998u, 0xB0D09822u, 0xC7D7A8B4u, 0x59B33D17u, 0x2EB40D81u,
+    0xB7BD5C3Bu, 0xC0BA6CADu, 0xEDB88320u, 0x9ABFB3B6u, 0x03B6E20Cu, 0x74B1D29Au,
+    0xEAD54739u, 0x9DD277AFu, 0x04DB2615u, 0x73DC1683u, 0xE3630B12u, 0x94643B84u,
+    0x0D6D6A3Eu, 0x7A6A5AA8u, 0xE40ECF0Bu, 0x9309FF9Du, 0x0A00AE27u, 0x7D079EB1u,
+    0xF00F9344u, 0x8708A3D2u, 0x1E01F268u, 0x6906C2FEu, 0xF762575Du, 0x806567CBu,
+    0x196C3671u, 0x6E6B06E7u, 0xFED41B76u, 0x89D32BE0u, 0x10DA7A5Au, 0x67DD4ACCu,
+    0xF9B9DF6Fu, 0x8EBEEFF9u, 0x17B7BE43u, 0x60B08ED5u, 0xD6D6A3E8u, 0xA1D1937Eu,
+    0x38D8C2C4u, 0x4FDFF252u, 0xD1BB67F1u, 0xA6BC5767u, 0x3FB506DDu, 0x48B2364Bu,
+    0xD80D2BDAu, 0xAF0A1B4Cu, 0x36034AF6u, 0x41047A60u, 0xDF60EFC3u, 0xA867DF55u,
+    0x316E8EEFu, 0x4669BE79u, 0xCB61B38Cu, 0xBC66831Au, 0x256FD2A0u, 0x5268E236u,
+    0xCC0C7795u, 0xBB0B4703u, 0x220216B9u, 0x5505262Fu, 0xC5BA3BBEu, 0xB2BD0B28u,
+    0x2BB45A92u, 0x5CB36A04u, 0xC2D7FFA7u, 0xB5D0CF31u, 0x2CD99E8Bu, 0x5BDEAE1Du,
+    0x9B64C2B0u, 0xEC63F226u, 0x756AA39Cu, 0x026D930Au, 0x9C0906A9u, 0xEB0E363Fu,
+    0x72076785u, 0x05005713u, 0x95BF4A82u, 0xE2B87A14u, 0x7BB12BAEu, 0x0CB61B38u,
+    0x92D28E9Bu, 0xE5D5BE0Du, 0x7CDCEFB7u, 0x0BDBDF21u, 0x86D3D2D4u, 0xF1D4E242u,
+    0x68DDB3F8u, 0x1FDA836Eu, 0x81BE16CDu, 0xF6B9265Bu, 0x6FB077E1u, 0x18B74777u,
+    0x88085AE6u, 0xFF0F6A70u, 0x66063BCAu, 0x11010B5Cu, 0x8F659EFFu, 0xF862AE69u,
+    0x616BFFD3u, 0x166CCF45u, 0xA00AE278u, 0xD70DD2EEu, 0x4E048354u, 0x3903B3C2u,
+    0xA7672661u, 0xD06016F7u, 0x4969474Du, 0x3E6E77DBu, 0xAED16A4Au, 0xD9D65ADCu,
+    0x40DF0B66u, 0x37D83BF0u, 0xA9BCAE53u, 0xDEBB9EC5u, 0x47B2CF7Fu, 0x30B5FFE9u,
+    0xBDBDF21Cu, 0xCABAC28Au, 0x53B39330u, 0x24B4A3A6u, 0xBAD03605u, 0xCDD70693u,
+    0x54DE5729u, 0x23D967BFu, 0xB3667A2Eu, 0xC4614AB8u, 0x5D681B02u, 0x2A6F2B94u,
+    0xB40BBE37u, 0xC30C8EA1u, 0x5A05DF1Bu, 0x2D02EF8Du
+};
+
+// Checksum data; pass the previous result to continue over more data
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Little-endian integers in on-disk records
+void put_le32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+void put_le64(unsigned char* p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+uint32_t get_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t get_le64(const unsigned char* p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
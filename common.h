@@ -1,12 +1,22 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+// Expose POSIX/GNU extensions (epoll, accept4, usleep) under -std=c11
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "arena.h"
+#include "idset.h"
+#include "msgid.h"
 
 #ifdef _WIN32
     #ifndef WIN32_LEAN_AND_MEAN
@@ -24,10 +34,32 @@
     #define SOCKET_ERROR (-1)
     #endif
     typedef SOCKET socket_t;
+    #define strtok_r strtok_s
+    // Threading primitives
+    typedef CRITICAL_SECTION mutex_t;
+    typedef CONDITION_VARIABLE cond_t;
+    #define mutex_init(m) InitializeCriticalSection(m)
+    #define mutex_destroy(m) DeleteCriticalSection(m)
+    #define mutex_lock(m) EnterCriticalSection(m)
+    #define mutex_unlock(m) LeaveCriticalSection(m)
+    #define mutex_trylock(m) (TryEnterCriticalSection(m) != 0)
+    #define cond_init(c) InitializeConditionVariable(c)
+    #define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+    #define cond_signal(c) WakeConditionVariable(c)
+    #define cond_broadcast(c) WakeAllConditionVariable(c)
+    typedef SRWLOCK rwlock_t;
+    #define rwlock_init(l) InitializeSRWLock(l)
+    #define rwlock_rdlock(l) AcquireSRWLockShared(l)
+    #define rwlock_rdunlock(l) ReleaseSRWLockShared(l)
+    #define rwlock_wrlock(l) AcquireSRWLockExclusive(l)
+    #define rwlock_wrunlock(l) ReleaseSRWLockExclusive(l)
+    #define rwlock_tryrdlock(l) (TryAcquireSRWLockShared(l) != 0)
+    #define rwlock_trywrlock(l) (TryAcquireSRWLockExclusive(l) != 0)
 #else
     // Linux/Unix Socket API libraries
     #include <sys/socket.h>   // Main socket library
     #include <netinet/in.h>    // Internet address family
+    #include <netinet/tcp.h>   // TCP_NODELAY
     #include <arpa/inet.h>     // IP address conversion functions
     #include <unistd.h>        // POSIX operating system API
     #include <pthread.h>       // POSIX threads
@@ -37,6 +69,33 @@
     #define close_socket close
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR -1
+    // Threading primitives
+    typedef pthread_mutex_t mutex_t;
+    typedef pthread_cond_t cond_t;
+    #define mutex_init(m) pthread_mutex_init(m, NULL)
+    #define mutex_destroy(m) pthread_mutex_destroy(m)
+    #define mutex_lock(m) pthread_mutex_lock(m)
+    #define mutex_unlock(m) pthread_mutex_unlock(m)
+    #define mutex_trylock(m) (pthread_mutex_trylock(m) == 0)
+    #define cond_init(c) pthread_cond_init(c, NULL)
+    #define cond_wait(c, m) pthread_cond_wait(c, m)
+    #define cond_signal(c) pthread_cond_signal(c)
+    #define cond_broadcast(c) pthread_cond_broadcast(c)
+    typedef pthread_rwlock_t rwlock_t;
+    #define rwlock_init(l) pthread_rwlock_init(l, NULL)
+    #define rwlock_rdlock(l) pthread_rwlock_rdlock(l)
+    #define rwlock_rdunlock(l) pthread_rwlock_unlock(l)
+    #define rwlock_wrlock(l) pthread_rwlock_wrlock(l)
+    #define rwlock_wrunlock(l) pthread_rwlock_unlock(l)
+    #define rwlock_tryrdlock(l) (pthread_rwlock_tryrdlock(l) == 0)
+    #define rwlock_trywrlock(l) (pthread_rwlock_trywrlock(l) == 0)
+#endif
+
+// Per-thread variables
+#ifdef _MSC_VER
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL _Thread_local
 #endif
 
 #define MAX_USERNAME 50
@@ -44,12 +103,36 @@
 #define MAX_CONTENT 2048
 #define MAX_GROUP_NAME 100
 #define MAX_GROUP_ID 50
-#define MAX_FRIENDS 100
 #define MAX_GROUPS 50
-#define MAX_MEMBERS 100
 #define PORT 8080
 #define BUFFER_SIZE 4096
 
+// Wire formats. Text frames are the original pipe-delimited strings, which
+// always start with "CMD:". Binary frames start with BINARY_FRAME_MAGIC, then
+// a varint body length, a varint command, a presence bitmask and only the
+// fields that are set (each as varint length + bytes).
+typedef enum {
+    PROTO_TEXT = 0,
+    PROTO_BINARY = 1,
+    PROTO_FORMAT_COUNT
+} ProtocolFormat;
+
+#define BINARY_FRAME_MAGIC 0xC7
+#define BINARY_MAX_BODY BUFFER_SIZE
+
+// Largest frame accepted from a peer (binary header plus body, or text)
+#define MAX_FRAME_SIZE (BINARY_MAX_BODY + 8)
+// Bytes read from a socket per recv() call
+#define RECV_CHUNK_SIZE 16384
+
+// Presence bits in a binary frame
+#define BIN_HAS_SENDER    0x01
+#define BIN_HAS_RECIPIENT 0x02
+#define BIN_HAS_CONTENT   0x04
+#define BIN_HAS_EXTRA     0x08
+#define BIN_HAS_TYPE      0x10
+#define BIN_PINNED        0x20
+
 // Message types
 typedef enum {
     MSG_TEXT = 0,
@@ -64,6 +147,7 @@ typedef enum {
     CMD_LOGOUT = 2,
     CMD_GET_FRIENDS = 3,
     CMD_ADD_FRIEND = 18,
+    CMD_ACK_OFFLINE = 19,
     CMD_SEND_MESSAGE = 4,
     CMD_RECEIVE_MESSAGE = 5,
     CMD_DISCONNECT = 6,
@@ -78,43 +162,74 @@ typedef enum {
     CMD_UNBLOCK_USER = 15,
     CMD_PIN_MESSAGE = 16,
     CMD_GET_PINNED = 17,
+    CMD_GET_HISTORY = 20,
     CMD_ERROR = 99,
     CMD_SUCCESS = 100
 } CommandType;
 
+// Users are referred to by their position in the server's user table
+// (User.id). Relationships store these ids rather than copies of the
+// username, which is looked up from the id only when it is shown.
+typedef uint32_t UserId;
+
 // Message structure
 typedef struct {
-    char id[100];
-    char sender[MAX_USERNAME];
-    char content[MAX_CONTENT];
+    uint64_t id;              // Assigned by the message store; see msgid.h
+    UserId sender;
+    char* content;            // Variable length, owned by the store holding the message
     MessageType type;
     time_t timestamp;
     bool is_pinned;
 } Message;
 
+// A group's most recent messages, kept in memory so recent history is
+// served without touching the message store. Slots are reused in place,
+// and each keeps its content buffer for the next message it holds.
+typedef struct {
+    Message message;
+    size_t content_capacity;  // Bytes allocated for message.content
+} HistorySlot;
+
+typedef struct {
+    HistorySlot* slots;       // capacity slots, allocated with the first message
+    int capacity;
+    int start;                // Oldest message
+    int count;
+    bool complete;            // Every message of the group is in the ring
+    MsgIdIndex index;         // Message id -> slot, for lookups by id
+} MessageHistory;
+
+typedef struct {
+    uint64_t id;
+    char* content;            // In the group's pinned_arena
+} PinnedMessage;
+
+struct Connection;
+
 // User structure
 typedef struct {
-    char username[MAX_USERNAME];
-    char password[MAX_USERNAME];
+    UserId id;                // Stable position in the server's user table
+    const char* username;     // In the directory image or the server's name arena;
+    const char* password;     // never changed or freed
     bool is_online;
-    socket_t socket;
-    char blocked_users[MAX_FRIENDS][MAX_USERNAME];
-    int blocked_count;
-    char friends[MAX_FRIENDS][MAX_USERNAME];
-    int friend_count;
+    struct Connection* conn;  // Live connection while online (server only)
+    IdSet blocked;            // UserIds this user has blocked
+    IdSet friends;            // UserIds of friends
 } User;
 
 // Group structure
 typedef struct {
+    int id;                   // Stable position in the server's group table
     char group_id[MAX_GROUP_ID];
     char name[MAX_GROUP_NAME];
-    char creator[MAX_USERNAME];
-    char members[MAX_MEMBERS][MAX_USERNAME];
-    int member_count;
-    char admins[MAX_MEMBERS][MAX_USERNAME];
-    int admin_count;
-    Message messages[1000];
-    int message_count;
+    UserId creator;
+    IdSet members;            // UserIds, the creator included
+    IdSet admins;             // UserIds allowed to manage the group
+    MessageHistory history;   // Recent messages, ordered by id
+    PinnedMessage* pinned;    // In pin order
+    int pinned_count;
+    int pinned_capacity;
+    Arena pinned_arena;       // Holds the pinned content
     time_t created_at;
 } Group;
 
@@ -129,12 +244,79 @@ typedef struct {
     bool is_pinned;
 } ProtocolMessage;
 
+// A run of bytes inside a buffer owned by someone else
+typedef struct {
+    const char* data;
+    int len;
+} StrView;
+
+// A frame parsed in place by parse_message_view(). Each field points into
+// the received frame, where parsing NUL-terminated it, so fields are also C
+// strings. Nothing is copied: content is as long as the frame carries
+// rather than capped at MAX_CONTENT. Sender and recipient are cut to
+// MAX_USERNAME - 1 bytes and extra to the size of
+// ProtocolMessage.extra_data, as when decoding into a ProtocolMessage.
+typedef struct {
+    CommandType cmd;
+    StrView sender;
+    StrView recipient;
+    StrView content;
+    StrView extra;
+    MessageType msg_type;
+    bool is_pinned;
+} MessageView;
+
+// Bytes read from a stream socket that do not yet form a complete frame.
+// The storage is only allocated while a partial frame is pending, so idle
+// connections carry no buffer.
+typedef struct {
+    char* data;
+    int capacity;
+    int start;  // First unconsumed byte
+    int end;    // One past the last buffered byte
+} RecvBuffer;
+
+// An encoded frame, shared by every connection it is sent to. It is never
+// modified after encoding. When the last reference goes it returns to the
+// releasing thread's frame cache, or is freed if that cache is full.
+typedef struct {
+    atomic_int refcount;
+    int len;
+    int capacity;             // Bytes allocated for data
+    char data[];
+} Frame;
+
 // Function declarations
-void log_activity(const char* username, const char* action, const char* details);
 char* serialize_protocol_message(ProtocolMessage* msg, int* len);
 ProtocolMessage* deserialize_protocol_message(char* buffer, int len);
+int decode_protocol_message(char* buffer, int len, ProtocolMessage* msg);
+ProtocolFormat detect_protocol_format(const char* buffer, int len);
+int encode_binary_message(const ProtocolMessage* msg, char* out, int capacity);
+int encode_binary_view(const MessageView* msg, char* out, int capacity);
+StrView str_view(const char* s);
+void message_view_of(const ProtocolMessage* msg, MessageView* view);
+int parse_message_view(char* buffer, int len, MessageView* view);
+char* encode_protocol_message(const ProtocolMessage* msg, ProtocolFormat format, int* len);
+int find_frame_length(const char* buffer, int len);
+int recv_buffer_append(RecvBuffer* rb, const char* data, int len);
+void recv_buffer_consume(RecvBuffer* rb, int len);
+void recv_buffer_free(RecvBuffer* rb);
 char* get_timestamp_string(time_t t);
+void format_time(time_t t, char* out, size_t size);
 void trim_newline(char* str);
+int send_all(socket_t socket, const char* buffer, int len);
+int send_frames_nonblocking(socket_t socket, Frame* const* frames, int count, int offset);
+Frame* frame_encode(const ProtocolMessage* msg, ProtocolFormat format);
+Frame* frame_encode_view(const MessageView* msg, ProtocolFormat format);
+void frame_retain(Frame* frame);
+void frame_release(Frame* frame);
+void frame_cache_flush(void);
+int cond_timedwait_ms(cond_t* cond, mutex_t* mutex, int timeout_ms);
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len);
+void put_le32(unsigned char* p, uint32_t v);
+void put_le64(unsigned char* p, uint64_t v);
+uint32_t get_le32(const unsigned char* p);
+uint64_t get_le64(const unsigned char* p);
 
 #endif // COMMON_H
 
@@ -0,0 +1,148 @@
+#include "dirmap.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define DIRMAP_MAGIC 0x4D524944u  // "DIRM" on disk
+#define DIRMAP_HEADER_SIZE 32
+// Read back natively; any other value means the slots need re-indexing
+#define DIRMAP_BYTE_ORDER 0x01020304u
+
+// Layout: a header (little-endian)
+//   u32 magic  u32 crc32 (of the rest of the header)  u32 count
+//   u32 capacity  u32 account size  u32 byte order mark  u64 unused
+// then count DirAccount entries and capacity IndexSlot entries in the
+// writer's byte order. Only the header is checked when the image is
+// mapped: reading the rest would undo the point of mapping it. The file is
+// synced before it replaces the previous image, so it is never partial.
+
+static uint64_t image_size(uint32_t count, uint32_t capacity) {
+    return DIRMAP_HEADER_SIZE + (uint64_t)count * sizeof(DirAccount) + (uint64_t)capacity * sizeof(IndexSlot);
+}
+
+// Point map at the parts of an image loaded or mapped at base
+static int parse_image(DirMap* map, unsigned char* base, size_t size) {
+    if (size < DIRMAP_HEADER_SIZE || get_le32(base) != DIRMAP_MAGIC ||
+        crc32_update(0, base + 8, DIRMAP_HEADER_SIZE - 8) != get_le32(base + 4)) {
+        return -1;
+    }
+    uint32_t count = get_le32(base + 8);
+    uint32_t capacity = get_le32(base + 12);
+    if (get_le32(base + 16) != sizeof(DirAccount) || capacity < 16 || (capacity & (capacity - 1)) != 0 ||
+        count >= capacity || image_size(count, capacity) != size) {
+        return -1;
+    }
+
+    uint32_t byte_order;
+    memcpy(&byte_order, base + 20, sizeof(byte_order));
+    map->accounts = (const DirAccount*)(base + DIRMAP_HEADER_SIZE);
+    map->count = count;
+    map->slots = byte_order == DIRMAP_BYTE_ORDER
+        ? (IndexSlot*)(base + DIRMAP_HEADER_SIZE + (size_t)count * sizeof(DirAccount))
+        : NULL;
+    map->capacity = capacity;
+    map->base = base;
+    map->size = size;
+    return 0;
+}
+
+int dirmap_open(DirMap* map, const char* path) {
+    memset(map, 0, sizeof(DirMap));
+    #ifdef _WIN32
+    /* Windows cannot replace a mapped file, so the image is read instead */
+    FILE* file = fopen(path, "rb");
+    if (!file) return -1;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) size = ftell(file);
+    unsigned char* base = size > 0 ? (unsigned char*)malloc((size_t)size) : NULL;
+    bool ok = base && fseek(file, 0, SEEK_SET) == 0 && fread(base, 1, (size_t)size, file) == (size_t)size;
+    fclose(file);
+    if (ok && parse_image(map, base, (size_t)size) == 0) return 0;
+    free(base);
+    #else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        /* private and writable: the user index adopts the slots in place */
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    if (parse_image(map, (unsigned char*)base, (size_t)st.st_size) == 0) return 0;
+    munmap(base, (size_t)st.st_size);
+    #endif
+    printf("Directory image %s is damaged\n", path);
+    return -1;
+}
+
+static int sync_file(FILE* file) {
+    if (fflush(file) != 0) return -1;
+    #ifdef _WIN32
+    return _commit(_fileno(file));
+    #else
+    return fsync(fileno(file));
+    #endif
+}
+
+int dirmap_write(const char* path, uint32_t count, DirAccountFn account_of, void* ctx) {
+    // Built with the server's own index code, so it can adopt the slots;
+    // it is only inserted into, so it needs no way to read keys back
+    HashIndex index;
+    if (hash_index_init(&index, (uint32_t)((uint64_t)count * 10 / 7 + 1), NULL, NULL) < 0) return -1;
+
+    char tmp_path[320];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "wb");
+    if (!file) {
+        hash_index_free(&index);
+        return -1;
+    }
+
+    unsigned char header[DIRMAP_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    for (uint32_t id = 0; ok && id < count; id++) {
+        const char* username;
+        const char* password;
+        account_of(ctx, id, &username, &password);
+        DirAccount account;
+        memset(&account, 0, sizeof(account));
+        strncpy(account.username, username, MAX_USERNAME - 1);
+        strncpy(account.password, password, MAX_USERNAME - 1);
+        ok = hash_index_insert(&index, account.username, (int32_t)id) == 0 &&
+             fwrite(&account, sizeof(account), 1, file) == 1;
+    }
+    ok = ok && fwrite(index.slots, sizeof(IndexSlot), index.capacity, file) == index.capacity;
+
+    if (ok) {
+        uint32_t byte_order = DIRMAP_BYTE_ORDER;
+        put_le32(header, DIRMAP_MAGIC);
+        put_le32(header + 8, count);
+        put_le32(header + 12, index.capacity);
+        put_le32(header + 16, sizeof(DirAccount));
+        memcpy(header + 20, &byte_order, sizeof(byte_order));
+        put_le32(header + 4, crc32_update(0, header + 8, DIRMAP_HEADER_SIZE - 8));
+        ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    }
+    hash_index_free(&index);
+    ok = sync_file(file) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+        #ifdef _WIN32
+        remove(path);
+        #endif
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
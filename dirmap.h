@@ -0,0 +1,46 @@
+#ifndef DIRMAP_H
+#define DIRMAP_H
+
+#include "common.h"
+#include "hash_index.h"
+
+// Directory image: the names and passwords of the user table plus a
+// ready-made user index, in a file the server maps at startup instead of
+// reading it. Users keep pointing into the mapping and the index starts out
+// as the mapped slot table, so startup neither copies nor hashes accounts,
+// and pages of accounts nobody touches stay shared with the page cache.
+// The mapping is copy-on-write: new index entries dirty only their own
+// pages, never the file.
+//
+// The state store's compactor writes a new image (state.directory) before
+// each snapshot. Users are never removed or renamed, so an image holds a
+// prefix of the user table and a newer image extends an older one.
+
+#define DIRMAP_FILE "state.directory"
+
+typedef struct {
+    char username[MAX_USERNAME];
+    char password[MAX_USERNAME];
+} DirAccount;
+
+typedef struct {
+    const DirAccount* accounts;  // Indexed by user id
+    uint32_t count;
+    IndexSlot* slots;            // Index of the accounts by username; NULL
+                                 // if written with another byte order
+    uint32_t capacity;
+    void* base;
+    size_t size;
+} DirMap;
+
+// Names the user with the given id, for dirmap_write()
+typedef void (*DirAccountFn)(void* ctx, uint32_t id, const char** username, const char** password);
+
+// Map the image at path for the rest of the process. Returns -1 if there
+// is none or it is damaged.
+int dirmap_open(DirMap* map, const char* path);
+
+// Replace the image at path with one of users [0, count)
+int dirmap_write(const char* path, uint32_t count, DirAccountFn account_of, void* ctx);
+
+#endif // DIRMAP_H
@@ -0,0 +1,118 @@
+#include "hash_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Grow once the table is 70% full to keep probe sequences short
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 10
+
+// FNV-1a
+uint32_t hash_string(const char* key) {
+    uint32_t hash = 2166136261u;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t round_up_pow2(uint32_t n) {
+    uint32_t capacity = 16;
+    while (capacity < n) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+static IndexSlot* alloc_slots(uint32_t capacity) {
+    IndexSlot* slots = (IndexSlot*)malloc(capacity * sizeof(IndexSlot));
+    if (!slots) return NULL;
+    for (uint32_t i = 0; i < capacity; i++) {
+        slots[i].hash = 0;
+        slots[i].id = INDEX_EMPTY;
+    }
+    return slots;
+}
+
+int hash_index_init(HashIndex* index, uint32_t capacity, IndexKeyFn key_of, void* ctx) {
+    index->capacity = round_up_pow2(capacity);
+    index->count = 0;
+    index->key_of = key_of;
+    index->ctx = ctx;
+    index->owns_slots = true;
+    index->slots = alloc_slots(index->capacity);
+    return index->slots ? 0 : -1;
+}
+
+void hash_index_free(HashIndex* index) {
+    if (index->owns_slots) free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+// Return the id stored under key, or INDEX_EMPTY
+int32_t hash_index_find(const HashIndex* index, const char* key) {
+    uint32_t hash = hash_string(key);
+    uint32_t mask = index->capacity - 1;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        const IndexSlot* slot = &index->slots[i];
+        if (slot->id == INDEX_EMPTY) {
+            return INDEX_EMPTY;
+        }
+        if (slot->hash == hash && strcmp(index->key_of(index->ctx, slot->id), key) == 0) {
+            return slot->id;
+        }
+    }
+}
+
+// Place an entry whose key is known to be absent
+static void place(IndexSlot* slots, uint32_t capacity, uint32_t hash, int32_t id) {
+    uint32_t mask = capacity - 1;
+    uint32_t i = hash & mask;
+    while (slots[i].id != INDEX_EMPTY) {
+        i = (i + 1) & mask;
+    }
+    slots[i].hash = hash;
+    slots[i].id = id;
+}
+
+static int grow(HashIndex* index) {
+    uint32_t capacity = index->capacity * 2;
+    IndexSlot* slots = alloc_slots(capacity);
+    if (!slots) return -1;
+
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (index->slots[i].id != INDEX_EMPTY) {
+            place(slots, capacity, index->slots[i].hash, index->slots[i].id);
+        }
+    }
+    if (index->owns_slots) free(index->slots);
+    index->slots = slots;
+    index->capacity = capacity;
+    index->owns_slots = true;
+    return 0;
+}
+
+// Add key -> id. The caller guarantees key is not present yet.
+// Returns -1 if the table could not grow.
+int hash_index_insert(HashIndex* index, const char* key, int32_t id) {
+    if ((index->count + 1) * MAX_LOAD_DEN > index->capacity * MAX_LOAD_NUM && grow(index) < 0) {
+        return -1;
+    }
+    place(index->slots, index->capacity, hash_string(key), id);
+    index->count++;
+    return 0;
+}
+
+// Use a table of count entries built elsewhere, such as one mapped from a
+// file, in place of the current one. The index writes to it but never
+// frees it; the first growth moves the entries to a table of its own.
+void hash_index_adopt(HashIndex* index, IndexSlot* slots, uint32_t capacity, uint32_t count) {
+    if (index->owns_slots) free(index->slots);
+    index->slots = slots;
+    index->capacity = capacity;
+    index->count = count;
+    index->owns_slots = false;
+}
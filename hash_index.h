@@ -0,0 +1,38 @@
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Open-addressing (linear probing) index from a string key to a stable
+// integer id, such as a user's position in the user table. Keys are not
+// copied: the owner hands them back through key_of, and each slot caches
+// the full hash so a probe only compares strings on a likely match.
+// Entries are never removed.
+
+typedef const char* (*IndexKeyFn)(void* ctx, int32_t id);
+
+typedef struct {
+    uint32_t hash;
+    int32_t id;      // INDEX_EMPTY when the slot is free
+} IndexSlot;
+
+typedef struct {
+    IndexSlot* slots;
+    uint32_t capacity;  // Always a power of two
+    uint32_t count;
+    IndexKeyFn key_of;
+    void* ctx;
+    bool owns_slots;    // False for an adopted table, which is never freed
+} HashIndex;
+
+#define INDEX_EMPTY (-1)
+
+uint32_t hash_string(const char* key);
+int hash_index_init(HashIndex* index, uint32_t capacity, IndexKeyFn key_of, void* ctx);
+void hash_index_free(HashIndex* index);
+int32_t hash_index_find(const HashIndex* index, const char* key);
+int hash_index_insert(HashIndex* index, const char* key, int32_t id);
+void hash_index_adopt(HashIndex* index, IndexSlot* slots, uint32_t capacity, uint32_t count);
+
+#endif // HASH_INDEX_H
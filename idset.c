@@ -0,0 +1,152 @@
+#include "idset.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Hash tables grow once they are half full, so misses end quickly
+#define MAX_LOAD_NUM 1
+#define MAX_LOAD_DEN 2
+
+// Mix the bits so runs of sequential ids spread over the table
+static uint32_t slot_of(uint32_t id, uint32_t mask) {
+    id ^= id >> 16;
+    id *= 0x45d9f3bu;
+    id ^= id >> 16;
+    return id & mask;
+}
+
+void idset_init(IdSet* set) {
+    set->ids = NULL;
+    set->count = 0;
+    set->capacity = 0;
+    set->hashed = false;
+}
+
+void idset_free(IdSet* set) {
+    free(set->ids);
+    idset_init(set);
+}
+
+// Index of the first sorted id not below id
+static uint32_t lower_bound(const IdSet* set, uint32_t id) {
+    uint32_t low = 0, high = set->count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (set->ids[mid] < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Slot holding id, or the free slot where it would go
+static uint32_t find_slot(const IdSet* set, uint32_t id) {
+    uint32_t mask = set->capacity - 1;
+    uint32_t i = slot_of(id, mask);
+    while (set->ids[i] != id && set->ids[i] != IDSET_EMPTY) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+bool idset_contains(const IdSet* set, uint32_t id) {
+    if (set->hashed) {
+        return set->ids[find_slot(set, id)] == id;
+    }
+    uint32_t i = lower_bound(set, id);
+    return i < set->count && set->ids[i] == id;
+}
+
+// Move every id into a fresh hash table of the given capacity
+static int rehash(IdSet* set, uint32_t capacity) {
+    uint32_t* slots = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    if (!slots) return -1;
+    memset(slots, 0xff, capacity * sizeof(uint32_t));
+
+    IdSet table = { slots, set->count, capacity, true };
+    if (set->hashed) {
+        for (uint32_t i = 0; i < set->capacity; i++) {
+            if (set->ids[i] != IDSET_EMPTY) slots[find_slot(&table, set->ids[i])] = set->ids[i];
+        }
+    } else {
+        for (uint32_t i = 0; i < set->count; i++) {
+            slots[find_slot(&table, set->ids[i])] = set->ids[i];
+        }
+    }
+    free(set->ids);
+    *set = table;
+    return 0;
+}
+
+int idset_add(IdSet* set, uint32_t id) {
+    if (set->hashed) {
+        if ((set->count + 1) * MAX_LOAD_DEN > set->capacity * MAX_LOAD_NUM &&
+            rehash(set, set->capacity * 2) < 0) {
+            return -1;
+        }
+        uint32_t i = find_slot(set, id);
+        if (set->ids[i] == id) return 0;
+        set->ids[i] = id;
+        set->count++;
+        return 1;
+    }
+
+    uint32_t i = lower_bound(set, id);
+    if (i < set->count && set->ids[i] == id) return 0;
+
+    if (set->count == IDSET_SORTED_MAX) {
+        if (rehash(set, IDSET_SORTED_MAX * 4) < 0) return -1;
+        return idset_add(set, id);
+    }
+    if (set->count == set->capacity) {
+        uint32_t capacity = set->capacity ? set->capacity * 2 : 4;
+        uint32_t* ids = (uint32_t*)realloc(set->ids, capacity * sizeof(uint32_t));
+        if (!ids) return -1;
+        set->ids = ids;
+        set->capacity = capacity;
+    }
+    memmove(&set->ids[i + 1], &set->ids[i], (set->count - i) * sizeof(uint32_t));
+    set->ids[i] = id;
+    set->count++;
+    return 1;
+}
+
+bool idset_remove(IdSet* set, uint32_t id) {
+    if (!set->hashed) {
+        uint32_t i = lower_bound(set, id);
+        if (i == set->count || set->ids[i] != id) return false;
+        memmove(&set->ids[i], &set->ids[i + 1], (set->count - i - 1) * sizeof(uint32_t));
+        set->count--;
+        return true;
+    }
+
+    uint32_t mask = set->capacity - 1;
+    uint32_t hole = find_slot(set, id);
+    if (set->ids[hole] != id) return false;
+
+    /* backward-shift deletion: pull later entries of the probe run into the
+       hole when their home slot allows it, so no tombstones are needed */
+    for (uint32_t i = (hole + 1) & mask; set->ids[i] != IDSET_EMPTY; i = (i + 1) & mask) {
+        uint32_t home = slot_of(set->ids[i], mask);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            set->ids[hole] = set->ids[i];
+            hole = i;
+        }
+    }
+    set->ids[hole] = IDSET_EMPTY;
+    set->count--;
+    return true;
+}
+
+uint32_t idset_copy(const IdSet* set, uint32_t* out) {
+    if (!set->hashed) {
+        if (set->count) memcpy(out, set->ids, set->count * sizeof(uint32_t));
+        return set->count;
+    }
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < set->capacity; i++) {
+        if (set->ids[i] != IDSET_EMPTY) out[n++] = set->ids[i];
+    }
+    return n;
+}
@@ -0,0 +1,38 @@
+#ifndef IDSET_H
+#define IDSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Set of 32-bit ids, such as a user's friends or a group's members. Small
+// sets are a sorted array searched by bisection. A set that grows past
+// IDSET_SORTED_MAX ids turns into an open-addressing hash table, so lookups
+// stay constant time for groups with tens of thousands of members. Sets
+// only ever grow their storage. A zeroed IdSet is a valid empty set.
+
+#define IDSET_SORTED_MAX 64
+#define IDSET_EMPTY UINT32_MAX   // Free hash slot; never a valid id
+
+typedef struct {
+    uint32_t* ids;       // Sorted ids, or hash slots once hashed
+    uint32_t count;
+    uint32_t capacity;   // Length of ids; a power of two once hashed
+    bool hashed;
+} IdSet;
+
+void idset_init(IdSet* set);
+void idset_free(IdSet* set);
+bool idset_contains(const IdSet* set, uint32_t id);
+
+// Returns 1 if id was added, 0 if it was already present and -1 if out of
+// memory
+int idset_add(IdSet* set, uint32_t id);
+
+// Returns false if id was not in the set
+bool idset_remove(IdSet* set, uint32_t id);
+
+// Copy the ids, in no particular order, to out, which must have room for
+// set->count of them. Returns the number copied.
+uint32_t idset_copy(const IdSet* set, uint32_t* out);
+
+#endif // IDSET_H
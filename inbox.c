@@ -0,0 +1,366 @@
+#include "inbox.h"
+
+#define INBOX_MAGIC 0x58424E49u  // "INBX" on disk
+#define INBOX_HEADER_SIZE 36
+#define INBOX_RECORD_MAX (INBOX_HEADER_SIZE + MAX_USERNAME)
+// Log records allowed beyond twice the live ones before compacting
+#define INBOX_COMPACT_SLACK 1024
+
+// Record kinds
+#define INBOX_RECORD_ENTRY 1     // Queue a message for a recipient
+#define INBOX_RECORD_ACK 2       // Drop the recipient's entries up to seq
+
+// Record layout (little-endian):
+//   u32 magic  u32 crc32 (of the rest)  u8 kind  u8 name_len  u16 unused
+//   u32 segment  u32 offset  u64 seq  u64 msg_id  name bytes
+
+static const char* queue_key(void* ctx, int32_t id) {
+    Inbox* inbox = (Inbox*)ctx;
+    return ((InboxQueue*)slab_get(&inbox->queues, (uint32_t)id))->username;
+}
+
+// Caller holds lock (or is still opening the inbox)
+static InboxQueue* get_queue(Inbox* inbox, const char* username, bool create) {
+    int32_t id = hash_index_find(&inbox->queue_index, username);
+    if (id != INDEX_EMPTY) {
+        return (InboxQueue*)slab_get(&inbox->queues, (uint32_t)id);
+    }
+    if (!create) return NULL;
+
+    uint32_t new_id;
+    InboxQueue* queue = (InboxQueue*)slab_append(&inbox->queues, &new_id);
+    if (!queue) return NULL;
+    strncpy(queue->username, username, MAX_USERNAME - 1);
+    queue->next_seq = 1;
+    if (hash_index_insert(&inbox->queue_index, queue->username, (int32_t)new_id) < 0) {
+        return NULL;
+    }
+    return queue;
+}
+
+static int queue_push(InboxQueue* queue, const InboxEntry* entry) {
+    if (queue->head + queue->count == queue->capacity) {
+        if (queue->head > 0) {
+            memmove(queue->entries, queue->entries + queue->head, queue->count * sizeof(InboxEntry));
+            queue->head = 0;
+        } else {
+            uint32_t capacity = queue->capacity ? queue->capacity * 2 : 8;
+            InboxEntry* entries = (InboxEntry*)realloc(queue->entries, capacity * sizeof(InboxEntry));
+            if (!entries) return -1;
+            queue->entries = entries;
+            queue->capacity = capacity;
+        }
+    }
+    queue->entries[queue->head + queue->count++] = *entry;
+    if (entry->seq >= queue->next_seq) {
+        queue->next_seq = entry->seq + 1;
+    }
+    return 0;
+}
+
+static void queue_ack(InboxQueue* queue, uint64_t seq) {
+    while (queue->count > 0 && queue->entries[queue->head].seq <= seq) {
+        queue->head++;
+        queue->count--;
+    }
+    if (queue->count == 0) {
+        queue->head = 0;
+    }
+    if (seq >= queue->next_seq) {
+        queue->next_seq = seq + 1;
+    }
+}
+
+static size_t encode_record(unsigned char* out, uint8_t kind, const char* username, const InboxEntry* entry) {
+    size_t name_len = strnlen(username, MAX_USERNAME - 1);
+    memset(out, 0, INBOX_HEADER_SIZE);
+    put_le32(out, INBOX_MAGIC);
+    out[8] = kind;
+    out[9] = (unsigned char)name_len;
+    put_le32(out + 12, entry->location.segment);
+    put_le32(out + 16, entry->location.offset);
+    put_le64(out + 20, entry->seq);
+    put_le64(out + 28, entry->msg_id);
+    memcpy(out + INBOX_HEADER_SIZE, username, name_len);
+    size_t len = INBOX_HEADER_SIZE + name_len;
+    put_le32(out + 4, crc32_update(0, out + 8, len - 8));
+    return len;
+}
+
+// Add a record to the staging buffer. Caller holds lock.
+static int stage_record(Inbox* inbox, uint8_t kind, const char* username, const InboxEntry* entry) {
+    if (inbox->staged_len + INBOX_RECORD_MAX > inbox->staged_capacity) {
+        size_t capacity = inbox->staged_capacity ? inbox->staged_capacity * 2 : 4096;
+        char* staged = (char*)realloc(inbox->staged, capacity);
+        if (!staged) return -1;
+        inbox->staged = staged;
+        inbox->staged_capacity = capacity;
+    }
+    inbox->staged_len += encode_record((unsigned char*)inbox->staged + inbox->staged_len, kind, username, entry);
+    inbox->log_records++;
+    return 0;
+}
+
+// Apply the log to the in-memory queues. Returns the number of valid
+// records read and sets torn when the file ends in a damaged record.
+static long replay(Inbox* inbox, bool* torn) {
+    *torn = false;
+    FILE* file = fopen(inbox->path, "rb");
+    if (!file) return 0;
+
+    unsigned char record[INBOX_RECORD_MAX];
+    long records = 0;
+    size_t n;
+
+    while ((n = fread(record, 1, INBOX_HEADER_SIZE, file)) == INBOX_HEADER_SIZE) {
+        size_t name_len = record[9];
+        if (get_le32(record) != INBOX_MAGIC || name_len >= MAX_USERNAME ||
+            fread(record + INBOX_HEADER_SIZE, 1, name_len, file) != name_len ||
+            crc32_update(0, record + 8, INBOX_HEADER_SIZE - 8 + name_len) != get_le32(record + 4)) {
+            *torn = true;
+            break;
+        }
+
+        char username[MAX_USERNAME];
+        memcpy(username, record + INBOX_HEADER_SIZE, name_len);
+        username[name_len] = '\0';
+
+        InboxEntry entry;
+        entry.location.segment = get_le32(record + 12);
+        entry.location.offset = get_le32(record + 16);
+        entry.seq = get_le64(record + 20);
+        entry.msg_id = get_le64(record + 28);
+
+        InboxQueue* queue = get_queue(inbox, username, true);
+        if (!queue) break;
+        if (record[8] == INBOX_RECORD_ENTRY) {
+            /* a record written again after a compaction already took it in */
+            if (entry.seq >= queue->next_seq && queue_push(queue, &entry) < 0) break;
+        } else if (record[8] == INBOX_RECORD_ACK) {
+            queue_ack(queue, entry.seq);
+        }
+        records++;
+    }
+    if (n > 0 && n < INBOX_HEADER_SIZE) {
+        *torn = true;
+    }
+
+    fclose(file);
+    return records;
+}
+
+static bool compaction_due(const Inbox* inbox) {
+    return inbox->log_records > 2 * (inbox->pending + (long)inbox->queues.count) + INBOX_COMPACT_SLACK;
+}
+
+// Encode the pending entries, plus one acknowledgement per queue so
+// sequence numbers keep increasing across restarts, into a malloc'd
+// buffer. Caller holds lock (or is still opening the inbox).
+static char* encode_pending(Inbox* inbox, size_t* len_out, long* records_out) {
+    size_t capacity = ((size_t)inbox->pending + inbox->queues.count + 1) * INBOX_RECORD_MAX;
+    char* image = (char*)malloc(capacity);
+    if (!image) return NULL;
+
+    size_t len = 0;
+    long records = 0;
+    for (uint32_t i = 0; i < inbox->queues.count; i++) {
+        InboxQueue* queue = (InboxQueue*)slab_get(&inbox->queues, i);
+        InboxEntry mark;
+        memset(&mark, 0, sizeof(mark));
+        mark.seq = (queue->count > 0 ? queue->entries[queue->head].seq : queue->next_seq) - 1;
+        if (mark.seq > 0) {
+            len += encode_record((unsigned char*)image + len, INBOX_RECORD_ACK, queue->username, &mark);
+            records++;
+        }
+        for (uint32_t k = 0; k < queue->count; k++) {
+            len += encode_record((unsigned char*)image + len, INBOX_RECORD_ENTRY, queue->username,
+                                 &queue->entries[queue->head + k]);
+            records++;
+        }
+    }
+    *len_out = len;
+    *records_out = records;
+    return image;
+}
+
+// Replace the log with the pending entries. Caller holds io_lock (or is
+// still opening the inbox). Records staged meanwhile go to the new log;
+// replay skips entries it already has, so repeating some is harmless.
+static int compact(Inbox* inbox) {
+    mutex_lock(&inbox->lock);
+    size_t len;
+    long records;
+    char* image = encode_pending(inbox, &len, &records);
+    long staged_records = inbox->log_records;
+    mutex_unlock(&inbox->lock);
+    if (!image) return -1;
+
+    char tmp_path[320];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", inbox->path);
+    FILE* file = fopen(tmp_path, "wb");
+    if (!file) {
+        free(image);
+        return -1;
+    }
+    bool ok = fwrite(image, 1, len, file) == len;
+    free(image);
+    if (fclose(file) != 0 || !ok) {
+        remove(tmp_path);
+        return -1;
+    }
+
+    if (inbox->file) {
+        fclose(inbox->file);
+        inbox->file = NULL;
+    }
+    #ifdef _WIN32
+    remove(inbox->path);
+    #endif
+    int rc = rename(tmp_path, inbox->path);
+    if (rc != 0) remove(tmp_path);
+    if (rc == 0) {
+        mutex_lock(&inbox->lock);
+        /* records staged since the image was taken are still to come */
+        inbox->log_records = records + (inbox->log_records - staged_records);
+        mutex_unlock(&inbox->lock);
+    }
+    return rc;
+}
+
+int inbox_open(Inbox* inbox, const char* path) {
+    memset(inbox, 0, sizeof(Inbox));
+    snprintf(inbox->path, sizeof(inbox->path), "%s", path);
+    mutex_init(&inbox->lock);
+    mutex_init(&inbox->io_lock);
+    slab_init(&inbox->queues, sizeof(InboxQueue));
+    if (hash_index_init(&inbox->queue_index, 1024, queue_key, inbox) < 0) {
+        return -1;
+    }
+
+    bool torn;
+    inbox->log_records = replay(inbox, &torn);
+    for (uint32_t i = 0; i < inbox->queues.count; i++) {
+        inbox->pending += ((InboxQueue*)slab_get(&inbox->queues, i))->count;
+    }
+    if ((torn || compaction_due(inbox)) && compact(inbox) < 0) {
+        printf("Failed to compact offline inbox %s\n", inbox->path);
+        return -1;
+    }
+
+    inbox->file = fopen(inbox->path, "ab");
+    if (!inbox->file) {
+        printf("Failed to open offline inbox %s: %s\n", inbox->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void inbox_close(Inbox* inbox) {
+    inbox_flush(inbox);
+    /* under io_lock, so a flush racing with shutdown finds no file */
+    mutex_lock(&inbox->io_lock);
+    if (inbox->file) {
+        fclose(inbox->file);
+        inbox->file = NULL;
+    }
+    mutex_unlock(&inbox->io_lock);
+}
+
+// Drop the queue's entries up to and including seq and log it. Caller
+// holds lock.
+static void drop_entries(Inbox* inbox, InboxQueue* queue, uint64_t seq) {
+    InboxEntry mark;
+    memset(&mark, 0, sizeof(mark));
+    mark.seq = seq;
+    uint32_t before = queue->count;
+    queue_ack(queue, seq);
+    inbox->pending -= (long)(before - queue->count);
+    stage_record(inbox, INBOX_RECORD_ACK, queue->username, &mark);
+}
+
+// Queue a stored message for an offline recipient, dropping the oldest
+// entry of a full queue. The log record is written by the next
+// inbox_flush().
+int inbox_add(Inbox* inbox, const char* username, uint64_t msg_id, MsgLocation location) {
+    int rc = -1;
+    mutex_lock(&inbox->lock);
+    InboxQueue* queue = get_queue(inbox, username, true);
+    if (queue) {
+        if (queue->count >= INBOX_MAX_PENDING) {
+            drop_entries(inbox, queue, queue->entries[queue->head].seq);
+        }
+        InboxEntry entry = { queue->next_seq, msg_id, location };
+        if (queue_push(queue, &entry) == 0) {
+            inbox->pending++;
+            rc = stage_record(inbox, INBOX_RECORD_ENTRY, username, &entry);
+        }
+    }
+    mutex_unlock(&inbox->lock);
+    return rc;
+}
+
+// Copy the recipient's pending entries, oldest first, into a malloc'd
+// array. Returns the count (0 with *entries NULL when there are none).
+int inbox_pending(Inbox* inbox, const char* username, InboxEntry** entries) {
+    int count = 0;
+    *entries = NULL;
+
+    mutex_lock(&inbox->lock);
+    InboxQueue* queue = get_queue(inbox, username, false);
+    if (queue && queue->count > 0) {
+        *entries = (InboxEntry*)malloc(queue->count * sizeof(InboxEntry));
+        if (*entries) {
+            memcpy(*entries, queue->entries + queue->head, queue->count * sizeof(InboxEntry));
+            count = (int)queue->count;
+        }
+    }
+    mutex_unlock(&inbox->lock);
+    return count;
+}
+
+// Drop the recipient's entries up to and including seq
+void inbox_ack(Inbox* inbox, const char* username, uint64_t seq) {
+    mutex_lock(&inbox->lock);
+    InboxQueue* queue = get_queue(inbox, username, false);
+    if (queue && queue->count > 0 && queue->entries[queue->head].seq <= seq) {
+        drop_entries(inbox, queue, seq);
+    }
+    mutex_unlock(&inbox->lock);
+}
+
+// Write staged log records, and compact the log once it is mostly
+// dropped entries. Call after state locks are released.
+void inbox_flush(Inbox* inbox) {
+    mutex_lock(&inbox->io_lock);
+
+    mutex_lock(&inbox->lock);
+    char* batch = inbox->staged;
+    size_t batch_len = inbox->staged_len;
+    size_t batch_capacity = inbox->staged_capacity;
+    inbox->staged = inbox->spare;
+    inbox->staged_capacity = inbox->spare_capacity;
+    inbox->staged_len = 0;
+    mutex_unlock(&inbox->lock);
+
+    if (batch_len > 0 && inbox->file) {
+        if (fwrite(batch, 1, batch_len, inbox->file) != batch_len || fflush(inbox->file) != 0) {
+            printf("Failed to write offline inbox: %s\n", strerror(errno));
+        }
+    }
+    inbox->spare = batch;
+    inbox->spare_capacity = batch_capacity;
+
+    mutex_lock(&inbox->lock);
+    bool due = compaction_due(inbox);
+    mutex_unlock(&inbox->lock);
+    if (due && inbox->file) {
+        if (compact(inbox) < 0) {
+            printf("Failed to compact offline inbox %s\n", inbox->path);
+        }
+        if (!inbox->file) {
+            inbox->file = fopen(inbox->path, "ab");
+        }
+    }
+
+    mutex_unlock(&inbox->io_lock);
+}
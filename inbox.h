@@ -0,0 +1,58 @@
+#ifndef INBOX_H
+#define INBOX_H
+
+#include "common.h"
+#include "hash_index.h"
+#include "msgstore.h"
+
+// Offline inbox: per-recipient queues of stored messages that have not
+// been delivered yet. Entries point into the message store rather than
+// copying messages. Every change is appended to a small log file (an
+// entry or an "acknowledged up to" mark per record, each with a CRC-32).
+// The log is replayed at startup and compacted whenever it holds mostly
+// dropped entries. Entries carry a per-recipient sequence number, and the
+// client acknowledges everything up to a sequence number once it has shown
+// the messages. A queue holds at most INBOX_MAX_PENDING entries; beyond
+// that the oldest are dropped.
+
+#define INBOX_MAX_PENDING 1000
+
+typedef struct {
+    uint64_t seq;
+    uint64_t msg_id;
+    MsgLocation location;
+} InboxEntry;
+
+typedef struct {
+    char username[MAX_USERNAME];
+    uint64_t next_seq;
+    InboxEntry* entries;     // Pending entries are entries[head .. head + count)
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+} InboxQueue;
+
+typedef struct {
+    mutex_t lock;            // Queues and the staged log records (a leaf)
+    mutex_t io_lock;         // Log file writes; taken before lock
+    SlabTable queues;        // InboxQueue by queue id
+    HashIndex queue_index;   // username -> queue id
+    char path[300];
+    FILE* file;
+    char* staged;            // Log records not yet written
+    size_t staged_len;
+    size_t staged_capacity;
+    char* spare;             // Buffer being written by inbox_flush()
+    size_t spare_capacity;
+    long log_records;        // Records in the log, staged ones included
+    long pending;            // Entries in all queues
+} Inbox;
+
+int inbox_open(Inbox* inbox, const char* path);
+void inbox_close(Inbox* inbox);
+int inbox_add(Inbox* inbox, const char* username, uint64_t msg_id, MsgLocation location);
+int inbox_pending(Inbox* inbox, const char* username, InboxEntry** entries);
+void inbox_ack(Inbox* inbox, const char* username, uint64_t seq);
+void inbox_flush(Inbox* inbox);
+
+#endif // INBOX_H
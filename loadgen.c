@@ -0,0 +1,582 @@
+#include "common.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Headless load generator: simulated users register, log in, make friends
+// and join groups, then drive a mix of commands against a running server.
+// Every message carries the time it was sent, so the receiving user
+// measures end-to-end delivery latency. Results are printed to stdout as
+// JSON; progress goes to stderr.
+
+#define LG_PASSWORD "bench"
+#define LG_MAX_USERS 10000
+#define LG_RESPONSE_TIMEOUT_MS 10000
+#define LG_RECV_TIMEOUT_MS 100
+#define LG_QUIET_MS 500          // Drain ends after this long without frames
+#define LG_SEARCH_WORDS 16       // Distinct searchable words in messages
+
+typedef enum {
+    OP_SEND = 0,      // CMD_SEND_MESSAGE to a friend
+    OP_GROUP = 1,     // CMD_GROUP_MESSAGE to the user's group
+    OP_SEARCH = 2,    // CMD_SEARCH_HISTORY
+    OP_FRIENDS = 3,   // CMD_GET_FRIENDS
+    OP_COUNT = 4
+} OpKind;
+
+static const char* op_names[OP_COUNT] = { "send", "group", "search", "friends" };
+
+// Latencies in microseconds
+typedef struct {
+    uint32_t* values;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+typedef struct {
+    const char* host;
+    int users;
+    int duration_s;
+    int rate;                // Ops per second per user, 0 = closed loop
+    int group_size;
+    int message_size;
+    int mix[OP_COUNT];
+    ProtocolFormat format;
+    char prefix[24];
+} LoadConfig;
+
+typedef struct {
+    int index;
+    char username[MAX_USERNAME];
+    char friend_name[MAX_USERNAME];
+    char group_id[MAX_USERNAME];
+    int group_members;
+    socket_t socket;
+    RecvBuffer pending;
+    uint32_t rng;
+    Samples ops[OP_COUNT];
+    Samples direct;          // 1-1 delivery latency
+    Samples group;           // Group delivery latency
+    long expected;           // Deliveries this user's sends should cause
+    long errors;
+} SimUser;
+
+static LoadConfig config;
+static SimUser* sim_users;
+
+// Phase barrier shared by all user threads
+static mutex_t phase_lock;
+static cond_t phase_cond;
+static int phase_arrived;
+static int phase_generation;
+
+static int64_t now_us(void) {
+    #ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (int64_t)(counter.QuadPart * 1000000 / frequency.QuadPart);
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    #endif
+}
+
+static void sleep_us(int64_t us) {
+    if (us <= 0) return;
+    #ifdef _WIN32
+    Sleep((DWORD)((us + 999) / 1000));
+    #else
+    usleep((useconds_t)us);
+    #endif
+}
+
+static uint32_t next_random(SimUser* user) {
+    /* xorshift32 */
+    uint32_t x = user->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    user->rng = x;
+    return x;
+}
+
+static void samples_add(Samples* samples, int64_t us) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        uint32_t* values = (uint32_t*)realloc(samples->values, capacity * sizeof(uint32_t));
+        if (!values) return;
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = us < 0 ? 0 : (uint32_t)(us > UINT32_MAX ? UINT32_MAX : us);
+}
+
+static void samples_merge(Samples* into, const Samples* from) {
+    for (size_t i = 0; i < from->count; i++) {
+        samples_add(into, from->values[i]);
+    }
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted samples, per_mille = 500 for p50
+static uint32_t percentile(const Samples* samples, int per_mille) {
+    if (samples->count == 0) return 0;
+    size_t rank = (samples->count * (size_t)per_mille + 999) / 1000;
+    if (rank == 0) rank = 1;
+    return samples->values[rank - 1];
+}
+
+// Wait until every user thread reaches the same point
+static void phase_barrier(void) {
+    mutex_lock(&phase_lock);
+    int generation = phase_generation;
+    if (++phase_arrived == config.users) {
+        phase_arrived = 0;
+        phase_generation++;
+        cond_broadcast(&phase_cond);
+    } else {
+        while (generation == phase_generation) {
+            cond_wait(&phase_cond, &phase_lock);
+        }
+    }
+    mutex_unlock(&phase_lock);
+}
+
+static socket_t connect_to_server(const char* host) {
+    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0 ||
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        close_socket(sock);
+        return INVALID_SOCKET;
+    }
+
+    #ifdef _WIN32
+    DWORD timeout = LG_RECV_TIMEOUT_MS;
+    #else
+    struct timeval timeout = { 0, LG_RECV_TIMEOUT_MS * 1000 };
+    #endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    /* requests are small and latency-bound */
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+    return sock;
+}
+
+static int send_request(SimUser* user, CommandType cmd, const char* recipient, const char* content,
+                        const char* extra) {
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(ProtocolMessage));
+    msg.cmd = cmd;
+    strncpy(msg.sender, user->username, MAX_USERNAME - 1);
+    strncpy(msg.recipient, recipient, MAX_USERNAME - 1);
+    strncpy(msg.content, content, MAX_CONTENT - 1);
+    strncpy(msg.extra_data, extra, sizeof(msg.extra_data) - 1);
+
+    int len;
+    char* buffer = encode_protocol_message(&msg, config.format, &len);
+    if (!buffer) return -1;
+    int sent = send_all(user->socket, buffer, len);
+    free(buffer);
+    return sent == SOCKET_ERROR ? -1 : 0;
+}
+
+// Record the latency of a message delivered to this user
+static void handle_delivery(SimUser* user, const ProtocolMessage* msg, int64_t received) {
+    long long sent;
+    if (sscanf(msg->content, "LG %lld", &sent) != 1) return;
+    samples_add(msg->recipient[0] != '\0' ? &user->group : &user->direct, received - sent);
+}
+
+// Read frames, recording deliveries, until a response arrives (stored in
+// response) or, without a response to wait for, until the connection has
+// been quiet for LG_QUIET_MS. Returns -1 on timeout or disconnect.
+static int read_frames(SimUser* user, ProtocolMessage* response) {
+    int64_t deadline = now_us() + (int64_t)(response ? LG_RESPONSE_TIMEOUT_MS : LG_QUIET_MS) * 1000;
+    char chunk[RECV_CHUNK_SIZE];
+
+    while (1) {
+        RecvBuffer* pending = &user->pending;
+        while (pending->end > pending->start) {
+            char* frame = pending->data + pending->start;
+            int frame_len = find_frame_length(frame, pending->end - pending->start);
+            if (frame_len < 0) return -1;
+            if (frame_len == 0) break;
+
+            char next = frame[frame_len];
+            frame[frame_len] = '\0';
+            ProtocolMessage* msg = deserialize_protocol_message(frame, frame_len);
+            frame[frame_len] = next;
+            recv_buffer_consume(pending, frame_len);
+            if (!msg) continue;
+
+            if (msg->cmd == CMD_RECEIVE_MESSAGE) {
+                handle_delivery(user, msg, now_us());
+                if (!response) deadline = now_us() + (int64_t)LG_QUIET_MS * 1000;
+                free(msg);
+            } else if (response) {
+                *response = *msg;
+                free(msg);
+                return 0;
+            } else {
+                free(msg);
+            }
+        }
+
+        if (now_us() >= deadline) return response ? -1 : 0;
+
+        int received = recv(user->socket, chunk, sizeof(chunk), 0);
+        if (received == 0) return -1;
+        if (received < 0) {
+            #ifdef _WIN32
+            if (WSAGetLastError() == WSAETIMEDOUT) continue;
+            #else
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            #endif
+            return -1;
+        }
+        if (recv_buffer_append(pending, chunk, received) < 0) return -1;
+    }
+}
+
+// Send one request and wait for its response. Returns the response
+// command, or -1 if none arrived.
+static int request(SimUser* user, CommandType cmd, const char* recipient, const char* content,
+                   const char* extra, ProtocolMessage* response) {
+    if (send_request(user, cmd, recipient, content, extra) < 0) return -1;
+    if (read_frames(user, response) < 0) return -1;
+    return response->cmd;
+}
+
+// Register, log in, befriend the next user and set up groups of
+// group_size users, each created by its first member
+static bool setup_user(SimUser* user) {
+    ProtocolMessage response;
+    user->socket = connect_to_server(config.host);
+    if (user->socket == INVALID_SOCKET) {
+        fprintf(stderr, "%s: connect failed\n", user->username);
+        return false;
+    }
+
+    /* registering an existing name fails harmlessly; login decides */
+    request(user, CMD_REGISTER, "", LG_PASSWORD, "", &response);
+    if (request(user, CMD_LOGIN, "", LG_PASSWORD, "", &response) != CMD_SUCCESS) {
+        fprintf(stderr, "%s: login failed\n", user->username);
+        close_socket(user->socket);
+        return false;
+    }
+    phase_barrier();
+
+    if (config.users > 1) {
+        request(user, CMD_ADD_FRIEND, user->friend_name, "", "", &response);
+    }
+
+    int first = user->index - user->index % config.group_size;
+    if (user->index == first) {
+        if (request(user, CMD_CREATE_GROUP, "", "bench", "", &response) == CMD_SUCCESS) {
+            const char* id = strstr(response.content, ": ");
+            if (id) strncpy(user->group_id, id + 2, MAX_USERNAME - 1);
+        }
+        for (int i = first + 1; i < first + config.group_size && i < config.users; i++) {
+            request(user, CMD_ADD_TO_GROUP, sim_users[i].username, "", user->group_id, &response);
+        }
+    }
+    phase_barrier();
+
+    /* every member learns the id from the creator once groups exist */
+    strncpy(user->group_id, sim_users[first].group_id, MAX_USERNAME - 1);
+    user->group_members = config.users - first < config.group_size ? config.users - first : config.group_size;
+    return true;
+}
+
+static OpKind pick_op(SimUser* user) {
+    int total = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += config.mix[i];
+    int roll = (int)(next_random(user) % (uint32_t)total);
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (roll < config.mix[i]) return (OpKind)i;
+        roll -= config.mix[i];
+    }
+    return OP_SEND;
+}
+
+static void run_op(SimUser* user, OpKind op) {
+    char content[MAX_CONTENT];
+    char keyword[32];
+    ProtocolMessage response;
+    int word = (int)(next_random(user) % LG_SEARCH_WORDS);
+    int64_t start = now_us();
+    int result = -1;
+
+    switch (op) {
+        case OP_SEND:
+        case OP_GROUP: {
+            int len = snprintf(content, sizeof(content), "LG %lld bench word%d ", (long long)start, word);
+            while (len < config.message_size && len < MAX_CONTENT - 1) {
+                content[len++] = 'x';
+            }
+            content[len] = '\0';
+            if (op == OP_SEND) {
+                result = request(user, CMD_SEND_MESSAGE, user->friend_name, content, "", &response);
+                if (result == CMD_SUCCESS) user->expected++;
+            } else {
+                result = request(user, CMD_GROUP_MESSAGE, user->group_id, content, "", &response);
+                if (result == CMD_SUCCESS) user->expected += user->group_members - 1;
+            }
+            break;
+        }
+        case OP_SEARCH:
+            snprintf(keyword, sizeof(keyword), "bench word%d", word);
+            result = request(user, CMD_SEARCH_HISTORY, "", keyword, "", &response);
+            break;
+        case OP_FRIENDS:
+            result = request(user, CMD_GET_FRIENDS, "", "", "", &response);
+            break;
+        default:
+            break;
+    }
+
+    if (result < 0 || result == CMD_ERROR) {
+        user->errors++;
+    } else {
+        samples_add(&user->ops[op], now_us() - start);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI user_main(LPVOID arg) {
+#else
+static void* user_main(void* arg) {
+#endif
+    SimUser* user = (SimUser*)arg;
+    bool ready = setup_user(user);
+    if (!ready) {
+        /* keep the barriers balanced for everyone else */
+        phase_barrier();
+        phase_barrier();
+    }
+    phase_barrier();
+
+    if (ready) {
+        int64_t end = now_us() + (int64_t)config.duration_s * 1000000;
+        int64_t interval = config.rate > 0 ? 1000000 / config.rate : 0;
+        /* spread open-loop users over the first interval */
+        int64_t due = now_us() + (interval > 0 ? (int64_t)(next_random(user) % (uint32_t)interval) : 0);
+
+        while (now_us() < end) {
+            if (interval > 0) {
+                sleep_us(due - now_us());
+                due += interval;
+            }
+            run_op(user, pick_op(user));
+        }
+    }
+    phase_barrier();
+
+    /* collect deliveries still in flight */
+    if (ready) {
+        read_frames(user, NULL);
+        close_socket(user->socket);
+    }
+    #ifdef _WIN32
+    return 0;
+    #else
+    return NULL;
+    #endif
+}
+
+static void print_latency(const char* name, Samples* samples, double elapsed, bool last) {
+    qsort(samples->values, samples->count, sizeof(uint32_t), compare_u32);
+    printf("    \"%s\": {\"count\": %zu, \"per_sec\": %.1f, \"latency_us\": "
+           "{\"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}}%s\n",
+           name, samples->count, elapsed > 0 ? (double)samples->count / elapsed : 0.0,
+           percentile(samples, 500), percentile(samples, 990), percentile(samples, 999),
+           samples->count ? samples->values[samples->count - 1] : 0, last ? "" : ",");
+}
+
+// Parse "send=70,group=10,search=10,friends=10"
+static bool parse_mix(const char* text) {
+    char copy[128];
+    char* save;
+    strncpy(copy, text, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    memset(config.mix, 0, sizeof(config.mix));
+
+    for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char* eq = strchr(item, '=');
+        if (!eq) return false;
+        *eq = '\0';
+        int i = 0;
+        while (i < OP_COUNT && strcmp(item, op_names[i]) != 0) i++;
+        if (i == OP_COUNT) return false;
+        config.mix[i] = atoi(eq + 1);
+    }
+    int total = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += config.mix[i] > 0 ? config.mix[i] : 0;
+    return total > 0;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--host=IP] [--users=N] [--duration=SECONDS] [--rate=OPS_PER_USER_PER_SEC]\n"
+            "          [--mix=send=70,group=10,search=10,friends=10] [--group-size=N]\n"
+            "          [--size=BYTES] [--prefix=NAME] [--binary]\n",
+            program);
+}
+
+int main(int argc, char* argv[]) {
+    config.host = "127.0.0.1";
+    config.users = 50;
+    config.duration_s = 10;
+    config.rate = 0;
+    config.group_size = 10;
+    config.message_size = 64;
+    config.format = PROTO_TEXT;
+    parse_mix("send=70,group=10,search=10,friends=10");
+    snprintf(config.prefix, sizeof(config.prefix), "lg%ld", (long)(time(NULL) % 100000));
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--host=", 7) == 0) {
+            config.host = arg + 7;
+        } else if (strncmp(arg, "--users=", 8) == 0) {
+            config.users = atoi(arg + 8);
+        } else if (strncmp(arg, "--duration=", 11) == 0) {
+            config.duration_s = atoi(arg + 11);
+        } else if (strncmp(arg, "--rate=", 7) == 0) {
+            config.rate = atoi(arg + 7);
+        } else if (strncmp(arg, "--group-size=", 13) == 0) {
+            config.group_size = atoi(arg + 13);
+        } else if (strncmp(arg, "--size=", 7) == 0) {
+            config.message_size = atoi(arg + 7);
+        } else if (strncmp(arg, "--prefix=", 9) == 0) {
+            snprintf(config.prefix, sizeof(config.prefix), "%s", arg + 9);
+        } else if (strncmp(arg, "--mix=", 6) == 0) {
+            if (!parse_mix(arg + 6)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(arg, "--binary") == 0) {
+            config.format = PROTO_BINARY;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.users < 1 || config.users > LG_MAX_USERS || config.duration_s < 1 ||
+        config.group_size < 2 || config.rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    #ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return 1;
+    }
+    #endif
+
+    sim_users = (SimUser*)calloc((size_t)config.users, sizeof(SimUser));
+    if (!sim_users) return 1;
+    for (int i = 0; i < config.users; i++) {
+        SimUser* user = &sim_users[i];
+        user->index = i;
+        user->rng = 2654435761u * (uint32_t)(i + 1);
+        snprintf(user->username, MAX_USERNAME, "%s_%d", config.prefix, i);
+        snprintf(user->friend_name, MAX_USERNAME, "%s_%d", config.prefix, (i + 1) % config.users);
+    }
+    mutex_init(&phase_lock);
+    cond_init(&phase_cond);
+
+    fprintf(stderr, "Running %d users for %d s against %s\n", config.users, config.duration_s, config.host);
+    int64_t start = now_us();
+
+    #ifdef _WIN32
+    HANDLE* threads = (HANDLE*)calloc((size_t)config.users, sizeof(HANDLE));
+    #else
+    pthread_t* threads = (pthread_t*)calloc((size_t)config.users, sizeof(pthread_t));
+    #endif
+    if (!threads) return 1;
+    for (int i = 0; i < config.users; i++) {
+        #ifdef _WIN32
+        threads[i] = CreateThread(NULL, 0, user_main, &sim_users[i], 0, NULL);
+        bool started = threads[i] != NULL;
+        #else
+        bool started = pthread_create(&threads[i], NULL, user_main, &sim_users[i]) == 0;
+        #endif
+        if (!started) {
+            fprintf(stderr, "Failed to start user thread %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < config.users; i++) {
+        #ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+        #else
+        pthread_join(threads[i], NULL);
+        #endif
+    }
+    double elapsed = (double)(now_us() - start) / 1e6;
+
+    Samples ops[OP_COUNT];
+    Samples direct, group;
+    memset(ops, 0, sizeof(ops));
+    memset(&direct, 0, sizeof(direct));
+    memset(&group, 0, sizeof(group));
+    long expected = 0, errors = 0;
+    for (int i = 0; i < config.users; i++) {
+        for (int k = 0; k < OP_COUNT; k++) samples_merge(&ops[k], &sim_users[i].ops[k]);
+        samples_merge(&direct, &sim_users[i].direct);
+        samples_merge(&group, &sim_users[i].group);
+        expected += sim_users[i].expected;
+        errors += sim_users[i].errors;
+    }
+
+    size_t total_ops = 0;
+    for (int k = 0; k < OP_COUNT; k++) total_ops += ops[k].count;
+    double run_time = (double)config.duration_s;
+
+    printf("{\n");
+    printf("  \"config\": {\"users\": %d, \"duration_s\": %d, \"rate\": %d, \"group_size\": %d, "
+           "\"message_size\": %d, \"format\": \"%s\", \"mix\": {\"send\": %d, \"group\": %d, "
+           "\"search\": %d, \"friends\": %d}},\n",
+           config.users, config.duration_s, config.rate, config.group_size, config.message_size,
+           config.format == PROTO_BINARY ? "binary" : "text",
+           config.mix[OP_SEND], config.mix[OP_GROUP], config.mix[OP_SEARCH], config.mix[OP_FRIENDS]);
+    printf("  \"elapsed_s\": %.3f,\n", elapsed);
+    printf("  \"throughput_ops_per_sec\": %.1f,\n", (double)total_ops / run_time);
+    printf("  \"ops\": {\n");
+    for (int k = 0; k < OP_COUNT; k++) {
+        print_latency(op_names[k], &ops[k], run_time, k == OP_COUNT - 1);
+    }
+    printf("  },\n");
+    printf("  \"delivery\": {\n");
+    print_latency("direct", &direct, run_time, false);
+    print_latency("group", &group, run_time, true);
+    printf("  },\n");
+    printf("  \"deliveries_expected\": %ld,\n", expected);
+    printf("  \"deliveries_received\": %zu,\n", direct.count + group.count);
+    printf("  \"errors\": %ld\n", errors);
+    printf("}\n");
+
+    #ifdef _WIN32
+    WSACleanup();
+    #endif
+    return 0;
+}
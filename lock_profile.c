@@ -0,0 +1,145 @@
+#include "lock_profile.h"
+
+#ifdef LOCK_PROFILE
+
+#include <stdatomic.h>
+
+// Locks one thread can hold at once; deeper nesting is not timed
+#define HELD_LOCKS_MAX 8
+// Rows printed per table by lock_profile_dump()
+#define DUMP_ROWS 15
+
+typedef struct {
+    atomic_ullong acquisitions;
+    atomic_ullong contended;
+    atomic_ullong wait_ns;
+    atomic_ullong max_wait_ns;
+    atomic_ullong hold_ns;
+    atomic_ullong max_hold_ns;
+} LockStats;
+
+typedef struct {
+    const void* lock_id;
+    LockStats* stats;
+    uint64_t acquired_at;
+} HeldLock;
+
+static const char* class_names[LOCK_CLASSES] = {
+    "account", "directory_read", "directory_write", "user_stripe", "group_stripe", "send"
+};
+
+static LockStats lock_stats[LOCK_CLASSES][METRICS_COMMAND_SLOTS];
+
+static THREAD_LOCAL int current_command = -1;
+static THREAD_LOCAL HeldLock held_locks[HELD_LOCKS_MAX];
+static THREAD_LOCAL int held_count;
+
+static void update_max(atomic_ullong* max, uint64_t value) {
+    unsigned long long seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen &&
+           !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void lock_profile_set_command(int cmd) {
+    current_command = cmd;
+}
+
+void lock_profile_acquired(const void* lock_id, LockClass lock_class, bool contended, uint64_t wait_ns) {
+    LockStats* stats = &lock_stats[lock_class][metrics_command_slot(current_command)];
+    atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+    if (contended) {
+        atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->wait_ns, wait_ns, memory_order_relaxed);
+        update_max(&stats->max_wait_ns, wait_ns);
+    }
+
+    if (held_count < HELD_LOCKS_MAX) {
+        HeldLock* held = &held_locks[held_count++];
+        held->lock_id = lock_id;
+        held->stats = stats;
+        held->acquired_at = metrics_now_ns();
+    }
+}
+
+void lock_profile_released(const void* lock_id) {
+    /* locks are usually released in reverse order, so search from the top */
+    for (int i = held_count - 1; i >= 0; i--) {
+        if (held_locks[i].lock_id != lock_id) continue;
+
+        uint64_t hold_ns = metrics_now_ns() - held_locks[i].acquired_at;
+        LockStats* stats = held_locks[i].stats;
+        atomic_fetch_add_explicit(&stats->hold_ns, hold_ns, memory_order_relaxed);
+        update_max(&stats->max_hold_ns, hold_ns);
+
+        memmove(&held_locks[i], &held_locks[i + 1], (size_t)(held_count - i - 1) * sizeof(HeldLock));
+        held_count--;
+        return;
+    }
+}
+
+typedef struct {
+    int lock_class;
+    int slot;
+    unsigned long long acquisitions;
+    unsigned long long contended;
+    unsigned long long wait_ns;
+    unsigned long long max_wait_ns;
+    unsigned long long hold_ns;
+    unsigned long long max_hold_ns;
+} DumpRow;
+
+static int compare_hold(const void* a, const void* b) {
+    unsigned long long x = ((const DumpRow*)a)->hold_ns, y = ((const DumpRow*)b)->hold_ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compare_wait(const void* a, const void* b) {
+    unsigned long long x = ((const DumpRow*)a)->wait_ns, y = ((const DumpRow*)b)->wait_ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void print_rows(const char* title, DumpRow* rows, int count) {
+    printf("%s\n", title);
+    printf("  %-16s %-18s %12s %10s %12s %12s %12s %12s %12s\n", "lock", "command", "acquired", "contended",
+           "wait ms", "avg wait us", "max wait us", "hold ms", "max hold us");
+    for (int i = 0; i < count && i < DUMP_ROWS; i++) {
+        DumpRow* row = &rows[i];
+        printf("  %-16s %-18s %12llu %9.1f%% %12.3f %12.2f %12.1f %12.3f %12.1f\n",
+               class_names[row->lock_class], row->slot == METRICS_COMMAND_SLOTS - 1 ? "-" : metrics_command_name(row->slot),
+               row->acquisitions, 100.0 * (double)row->contended / (double)row->acquisitions,
+               (double)row->wait_ns / 1e6,
+               row->contended ? (double)row->wait_ns / (double)row->contended / 1e3 : 0.0,
+               (double)row->max_wait_ns / 1e3, (double)row->hold_ns / 1e6, (double)row->max_hold_ns / 1e3);
+    }
+}
+
+void lock_profile_dump(void) {
+    DumpRow rows[LOCK_CLASSES * METRICS_COMMAND_SLOTS];
+    int count = 0;
+    for (int c = 0; c < LOCK_CLASSES; c++) {
+        for (int slot = 0; slot < METRICS_COMMAND_SLOTS; slot++) {
+            LockStats* stats = &lock_stats[c][slot];
+            DumpRow row;
+            row.acquisitions = atomic_load_explicit(&stats->acquisitions, memory_order_relaxed);
+            if (row.acquisitions == 0) continue;
+            row.lock_class = c;
+            row.slot = slot;
+            row.contended = atomic_load_explicit(&stats->contended, memory_order_relaxed);
+            row.wait_ns = atomic_load_explicit(&stats->wait_ns, memory_order_relaxed);
+            row.max_wait_ns = atomic_load_explicit(&stats->max_wait_ns, memory_order_relaxed);
+            row.hold_ns = atomic_load_explicit(&stats->hold_ns, memory_order_relaxed);
+            row.max_hold_ns = atomic_load_explicit(&stats->max_hold_ns, memory_order_relaxed);
+            rows[count++] = row;
+        }
+    }
+
+    printf("Lock profile (since start; command \"-\" is outside any command)\n");
+    qsort(rows, (size_t)count, sizeof(DumpRow), compare_hold);
+    print_rows("Most time held:", rows, count);
+    qsort(rows, (size_t)count, sizeof(DumpRow), compare_wait);
+    print_rows("Most time waited:", rows, count);
+    fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+#include "metrics.h"
+
+// Lock profiling, compiled in with -DLOCK_PROFILE (make LOCK_PROFILE=1).
+// Every acquisition of a server lock records whether it was contended,
+// how long the thread waited and how long it held the lock, against the
+// lock's class and the command the thread was executing. The totals are
+// printed, worst first, by lock_profile_dump() (SIGUSR1 on POSIX).
+// Without LOCK_PROFILE the hooks compile to nothing.
+
+typedef enum {
+    LOCK_ACCOUNT = 0,          // ServerState.account_lock
+    LOCK_DIRECTORY_READ = 1,   // ServerState.directory_lock, shared
+    LOCK_DIRECTORY_WRITE = 2,  // ServerState.directory_lock, exclusive
+    LOCK_USER_STRIPE = 3,      // ServerState.user_locks[]
+    LOCK_GROUP_STRIPE = 4,     // ServerState.group_locks[]
+    LOCK_SEND = 5,             // Connection.send_lock
+    LOCK_CLASSES = 6
+} LockClass;
+
+#ifdef LOCK_PROFILE
+
+// Take a lock: try_lock is tried first and lock only runs if that fails,
+// so an uncontended acquisition costs no clock reads. lock_id identifies
+// the lock instance for the matching PROFILE_UNLOCK.
+#define PROFILE_LOCK(lock_id, lock_class, try_lock, lock) do {          \
+        uint64_t wait_ns_ = 0;                                          \
+        bool contended_ = !(try_lock);                                  \
+        if (contended_) {                                               \
+            uint64_t start_ = metrics_now_ns();                         \
+            lock;                                                       \
+            wait_ns_ = metrics_now_ns() - start_;                       \
+        }                                                               \
+        lock_profile_acquired((lock_id), (lock_class), contended_, wait_ns_); \
+    } while (0)
+
+#define PROFILE_UNLOCK(lock_id) lock_profile_released(lock_id)
+
+void lock_profile_acquired(const void* lock_id, LockClass lock_class, bool contended, uint64_t wait_ns);
+void lock_profile_released(const void* lock_id);
+
+// Attribute the calling thread's lock use to cmd, or to nothing with -1
+void lock_profile_set_command(int cmd);
+
+// Print the lock classes and commands with the most hold and wait time
+void lock_profile_dump(void);
+
+#else
+
+#define lock_profile_set_command(cmd) ((void)0)
+#define lock_profile_dump() ((void)0)
+
+#endif
+
+#endif // LOCK_PROFILE_H
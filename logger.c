@@ -0,0 +1,344 @@
+#include "logger.h"
+#include <stdatomic.h>
+
+#define LOG_DEFAULT_PATH "activity.log"
+
+// Queue capacity (a power of two) and the text space of each record.
+// username, action and details are packed back to back, NUL-terminated;
+// details longer than the remaining space are truncated.
+#define LOG_QUEUE_SIZE 4096
+#define LOG_QUEUE_MASK (LOG_QUEUE_SIZE - 1)
+#define LOG_RECORD_TEXT 480
+
+// Bounded multi-producer queue after Dmitry Vyukov's design: each slot's
+// sequence number says whether it is free for the producer at position
+// pos (sequence == pos) or holds a record for the consumer (pos + 1).
+// Producers claim positions with a CAS; the writer thread is the only
+// consumer, so it needs no atomics on its own position.
+typedef struct {
+    atomic_size_t sequence;
+    time_t timestamp;
+    char text[LOG_RECORD_TEXT];
+} LogRecord;
+
+static LogRecord records[LOG_QUEUE_SIZE];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;
+
+static LogConfig log_config;
+static atomic_bool writer_running;
+static atomic_bool writer_stopping;
+static atomic_int active_producers;  // log_activity() calls that saw the writer running
+static atomic_ullong dropped_records;
+
+#ifdef _WIN32
+static HANDLE writer_thread;
+#else
+static pthread_t writer_thread;
+#endif
+
+// State below is only touched by the writer thread
+static FILE* log_file;
+static long file_bytes;
+static time_t file_opened_at;
+static unsigned long long reported_drops;
+static time_t cached_second = (time_t)-1;
+static char cached_timestamp[32];
+
+void log_config_defaults(LogConfig* config) {
+    config->path = LOG_DEFAULT_PATH;
+    config->max_file_bytes = 64L * 1024 * 1024;
+    config->max_file_age_seconds = 24 * 60 * 60;
+    config->keep_files = 5;
+    config->flush_interval_ms = 50;
+    config->overflow = LOG_OVERFLOW_DROP;
+}
+
+static void sleep_ms(int ms) {
+    #ifdef _WIN32
+    Sleep(ms);
+    #else
+    usleep(ms * 1000);
+    #endif
+}
+
+// Copy a string into dst, keeping room for its terminator. Returns the
+// number of bytes used, terminator included.
+static size_t pack_field(char* dst, size_t space, const char* src) {
+    size_t len = strlen(src);
+    if (len >= space) {
+        len = space - 1;
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return len + 1;
+}
+
+static bool enqueue(const char* username, const char* action, const char* details) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    LogRecord* record;
+
+    while (1) {
+        record = &records[pos & LOG_QUEUE_MASK];
+        size_t seq = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;  // Full: the writer has not released this slot yet
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    record->timestamp = time(NULL);
+    size_t used = pack_field(record->text, LOG_RECORD_TEXT / 4, username);
+    used += pack_field(record->text + used, LOG_RECORD_TEXT / 4, action);
+    pack_field(record->text + used, LOG_RECORD_TEXT - used, details);
+
+    atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+// Next published record, or NULL if the queue is empty (writer only)
+static LogRecord* peek_record(void) {
+    LogRecord* record = &records[dequeue_pos & LOG_QUEUE_MASK];
+    size_t seq = atomic_load_explicit(&record->sequence, memory_order_acquire);
+    return seq == dequeue_pos + 1 ? record : NULL;
+}
+
+static void release_record(LogRecord* record) {
+    atomic_store_explicit(&record->sequence, dequeue_pos + LOG_QUEUE_SIZE, memory_order_release);
+    dequeue_pos++;
+}
+
+// Formatting the time is the expensive part of a line; records arrive in
+// bursts from the same second, so reuse the last result
+static const char* format_timestamp(time_t t) {
+    if (t != cached_second) {
+        struct tm timeinfo;
+        #ifdef _WIN32
+        localtime_s(&timeinfo, &t);
+        #else
+        localtime_r(&t, &timeinfo);
+        #endif
+        strftime(cached_timestamp, sizeof(cached_timestamp), "%Y-%m-%d %H:%M:%S", &timeinfo);
+        cached_second = t;
+    }
+    return cached_timestamp;
+}
+
+static void write_line(time_t t, const char* username, const char* action, const char* details) {
+    int written = fprintf(log_file, "[%s] User: %s | Action: %s | Details: %s\n",
+                          format_timestamp(t), username, action, details);
+    if (written > 0) {
+        file_bytes += written;
+    }
+}
+
+static bool open_log_file(void) {
+    log_file = fopen(log_config.path, "a");
+    if (!log_file) {
+        printf("Failed to open %s: %s\n", log_config.path, strerror(errno));
+        return false;
+    }
+    setvbuf(log_file, NULL, _IOFBF, 64 * 1024);
+    fseek(log_file, 0, SEEK_END);
+    file_bytes = ftell(log_file);
+    file_opened_at = time(NULL);
+    return true;
+}
+
+// Shift path.1 .. path.N-1 up by one, move the current file to path.1
+// and start a new one. The oldest file falls off the end.
+static void rotate_log_file(void) {
+    char from[512], to[512];
+
+    fclose(log_file);
+    log_file = NULL;
+
+    if (log_config.keep_files > 0) {
+        snprintf(to, sizeof(to), "%s.%d", log_config.path, log_config.keep_files);
+        remove(to);
+        for (int i = log_config.keep_files - 1; i >= 1; i--) {
+            snprintf(from, sizeof(from), "%s.%d", log_config.path, i);
+            snprintf(to, sizeof(to), "%s.%d", log_config.path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", log_config.path);
+        rename(log_config.path, to);
+    } else {
+        remove(log_config.path);
+    }
+
+    open_log_file();
+}
+
+static void maybe_rotate(void) {
+    bool too_big = log_config.max_file_bytes > 0 && file_bytes >= log_config.max_file_bytes;
+    bool too_old = log_config.max_file_age_seconds > 0 &&
+                   time(NULL) - file_opened_at >= log_config.max_file_age_seconds;
+    if (too_big || too_old) {
+        rotate_log_file();
+    }
+}
+
+// Write every queued record, then flush the batch with a single fflush.
+// Returns the number of records taken off the queue.
+static int drain_queue(void) {
+    int count = 0;
+    LogRecord* record;
+
+    while ((record = peek_record()) != NULL) {
+        if (log_file) {
+            const char* username = record->text;
+            const char* action = username + strlen(username) + 1;
+            const char* details = action + strlen(action) + 1;
+            write_line(record->timestamp, username, action, details);
+        }
+        release_record(record);
+        count++;
+    }
+
+    unsigned long long dropped = atomic_load(&dropped_records);
+    if (dropped != reported_drops && log_file) {
+        char details[64];
+        snprintf(details, sizeof(details), "%llu records dropped (queue full)",
+                 dropped - reported_drops);
+        write_line(time(NULL), "-", "LOG_OVERFLOW", details);
+        reported_drops = dropped;
+        count++;
+    }
+
+    if (count > 0 && log_file) {
+        fflush(log_file);
+    }
+    return count;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI writer_main(LPVOID arg) {
+#else
+static void* writer_main(void* arg) {
+#endif
+    (void)arg;
+
+    while (!atomic_load(&writer_stopping)) {
+        if (log_file) {
+            maybe_rotate();
+        } else {
+            open_log_file();  // Retry a file that could not be opened
+        }
+        if (drain_queue() == 0) {
+            sleep_ms(log_config.flush_interval_ms);
+        }
+    }
+
+    drain_queue();
+    if (log_file) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    return 0;
+}
+
+int log_writer_start(const LogConfig* config) {
+    if (atomic_load(&writer_running)) return 0;
+
+    log_config = *config;
+    if (!log_config.path) {
+        log_config.path = LOG_DEFAULT_PATH;
+    }
+    if (log_config.flush_interval_ms <= 0) {
+        log_config.flush_interval_ms = 1;
+    }
+
+    for (size_t i = 0; i < LOG_QUEUE_SIZE; i++) {
+        atomic_init(&records[i].sequence, i);
+    }
+    atomic_store(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    atomic_store(&dropped_records, 0);
+    reported_drops = 0;
+    atomic_store(&writer_stopping, false);
+
+    open_log_file();
+
+    #ifdef _WIN32
+    writer_thread = CreateThread(NULL, 0, writer_main, NULL, 0, NULL);
+    if (writer_thread == NULL) {
+    #else
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+    #endif
+        printf("Failed to start log writer, logging synchronously\n");
+        if (log_file) {
+            fclose(log_file);
+            log_file = NULL;
+        }
+        return -1;
+    }
+
+    atomic_store(&writer_running, true);
+    return 0;
+}
+
+// Write out everything still queued and stop the writer. Later calls to
+// log_activity() write synchronously.
+void log_writer_stop(void) {
+    if (!atomic_exchange(&writer_running, false)) return;
+
+    // A producer that saw the writer running may still be enqueueing; its
+    // record must be in the queue before the writer's final drain
+    while (atomic_load(&active_producers) > 0) {
+        sleep_ms(1);
+    }
+    atomic_store(&writer_stopping, true);
+    #ifdef _WIN32
+    WaitForSingleObject(writer_thread, INFINITE);
+    CloseHandle(writer_thread);
+    #else
+    pthread_join(writer_thread, NULL);
+    #endif
+}
+
+unsigned long long log_dropped_count(void) {
+    return atomic_load(&dropped_records);
+}
+
+// Synchronous path used while no writer thread is running
+static void log_activity_direct(const char* username, const char* action, const char* details) {
+    FILE* file = fopen(log_config.path ? log_config.path : LOG_DEFAULT_PATH, "a");
+    if (file) {
+        char time_str[32];
+        format_time(time(NULL), time_str, sizeof(time_str));
+        fprintf(file, "[%s] User: %s | Action: %s | Details: %s\n", time_str, username, action, details);
+        fclose(file);
+    }
+}
+
+// Log activity to file
+void log_activity(const char* username, const char* action, const char* details) {
+    // Registered before the check, so log_writer_stop() waits for us
+    atomic_fetch_add(&active_producers, 1);
+    if (!atomic_load(&writer_running)) {
+        atomic_fetch_sub(&active_producers, 1);
+        log_activity_direct(username, action, details);
+        return;
+    }
+
+    while (!enqueue(username, action, details)) {
+        if (log_config.overflow == LOG_OVERFLOW_DROP) {
+            atomic_fetch_add_explicit(&dropped_records, 1, memory_order_relaxed);
+            break;
+        }
+        if (!atomic_load(&writer_running)) {
+            log_activity_direct(username, action, details);
+            break;
+        }
+        sleep_ms(1);
+    }
+    atomic_fetch_sub(&active_producers, 1);
+}
@@ -0,0 +1,34 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include "common.h"
+
+// Activity log. log_activity() only copies the record into a bounded
+// lock-free queue; a single writer thread formats the queued records,
+// appends them to a file it keeps open, flushes once per batch and rotates
+// the file by size and age. Until log_writer_start() is called,
+// log_activity() writes synchronously.
+
+// What log_activity() does when the queue is full
+typedef enum {
+    LOG_OVERFLOW_DROP = 0,  // Discard the record and count it (never blocks)
+    LOG_OVERFLOW_BLOCK = 1  // Wait for the writer to free a slot
+} LogOverflowPolicy;
+
+typedef struct {
+    const char* path;
+    long max_file_bytes;       // Rotate once the file grows past this (0 = never)
+    int max_file_age_seconds;  // Rotate once the file is this old (0 = never)
+    int keep_files;            // Rotated files kept as path.1 .. path.N
+    int flush_interval_ms;     // How long the writer sleeps when idle
+    LogOverflowPolicy overflow;
+} LogConfig;
+
+void log_config_defaults(LogConfig* config);
+int log_writer_start(const LogConfig* config);
+void log_writer_stop(void);
+unsigned long long log_dropped_count(void);
+
+void log_activity(const char* username, const char* action, const char* details);
+
+#endif // LOGGER_H
@@ -0,0 +1,442 @@
+#include "metrics.h"
+#include "logger.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+
+// Latency histograms use log-linear buckets over whole microseconds: two
+// buckets per power of two (upper bounds 1, 2, 3, 4, 6, 8, 12, 16 ... us),
+// up to 2^26 us (67 s), plus one overflow bucket. That keeps every
+// bucket within 50% of its values at any scale.
+#define HISTOGRAM_MAX_BITS 26
+#define HISTOGRAM_BUCKETS (2 + 2 * (HISTOGRAM_MAX_BITS - 1))
+
+typedef struct {
+    atomic_ullong buckets[HISTOGRAM_BUCKETS + 1];  // Last one is overflow
+    atomic_ullong sum_ns;
+} Histogram;
+
+// Histograms kept for each command
+enum {
+    TIMER_COMMAND = 0,
+    TIMER_LOCK = 1,
+    TIMER_SEND = 2,
+    TIMER_COUNT = 3
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} timer_info[TIMER_COUNT] = {
+    { "chat_command_duration_seconds", "Time to execute a command, from decode to return" },
+    { "chat_command_lock_seconds", "Time a command held server state locks" },
+    { "chat_command_send_seconds", "Time a command spent queueing and writing frames" }
+};
+
+static atomic_bool enabled;
+static Histogram command_timers[METRICS_COMMAND_SLOTS][TIMER_COUNT];
+static Histogram queue_wait;
+static atomic_ullong connections_accepted;
+static atomic_llong connections_open;
+static atomic_ullong bytes_received;
+static atomic_ullong bytes_sent;
+static atomic_llong outbound_bytes;
+static atomic_llong outbound_backlogged;
+static atomic_ullong slow_consumer_disconnects;
+static atomic_ullong slow_consumer_drops;
+
+// Running totals for the calling thread, sampled around each command
+typedef struct {
+    int lock_depth;
+    uint64_t locked_at;
+    uint64_t lock_ns;
+    uint64_t send_ns;
+} ThreadTotals;
+
+static THREAD_LOCAL ThreadTotals thread_totals;
+
+static socket_t admin_socket = INVALID_SOCKET;
+
+uint64_t metrics_now_ns(void) {
+    #ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    #endif
+}
+
+static int bucket_index(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    if (us < 2) return (int)us;
+
+    /* us lies in [2^(bits-1), 2^bits); the next bit down picks the half */
+    int bits = 2;
+    while (bits < HISTOGRAM_MAX_BITS && (us >> bits) != 0) {
+        bits++;
+    }
+    if ((us >> bits) != 0) return HISTOGRAM_BUCKETS;
+    return 2 + 2 * (bits - 2) + (int)((us >> (bits - 2)) & 1);
+}
+
+// Upper bound of a bucket in microseconds
+static uint64_t bucket_bound_us(int index) {
+    if (index < 2) return (uint64_t)index + 1;
+    int bits = 2 + (index - 2) / 2;
+    return (index - 2) % 2 ? (uint64_t)1 << bits : (uint64_t)3 << (bits - 2);
+}
+
+static void histogram_record(Histogram* histogram, uint64_t ns) {
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_ns, ns, memory_order_relaxed);
+}
+
+void metrics_command_begin(CommandTiming* timing) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) return;
+    timing->start_ns = metrics_now_ns();
+    timing->lock_ns = thread_totals.lock_ns;
+    timing->send_ns = thread_totals.send_ns;
+}
+
+void metrics_command_end(const CommandTiming* timing, CommandType cmd) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) return;
+    Histogram* timers = command_timers[metrics_command_slot((int)cmd)];
+    histogram_record(&timers[TIMER_COMMAND], metrics_now_ns() - timing->start_ns);
+    histogram_record(&timers[TIMER_LOCK], thread_totals.lock_ns - timing->lock_ns);
+    histogram_record(&timers[TIMER_SEND], thread_totals.send_ns - timing->send_ns);
+}
+
+void metrics_lock_acquired(void) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) return;
+    if (thread_totals.lock_depth++ == 0) {
+        thread_totals.locked_at = metrics_now_ns();
+    }
+}
+
+void metrics_lock_released(void) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) return;
+    /* a lock taken before metrics were enabled was not counted */
+    if (thread_totals.lock_depth > 0 && --thread_totals.lock_depth == 0) {
+        thread_totals.lock_ns += metrics_now_ns() - thread_totals.locked_at;
+    }
+}
+
+uint64_t metrics_timestamp(void) {
+    return atomic_load_explicit(&enabled, memory_order_relaxed) ? metrics_now_ns() : 0;
+}
+
+void metrics_send_done(uint64_t started) {
+    if (started != 0) {
+        thread_totals.send_ns += metrics_now_ns() - started;
+    }
+}
+
+void metrics_queue_wait(uint64_t queued_at) {
+    if (queued_at != 0) {
+        histogram_record(&queue_wait, metrics_now_ns() - queued_at);
+    }
+}
+
+void metrics_connection_opened(void) {
+    atomic_fetch_add_explicit(&connections_accepted, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&connections_open, 1, memory_order_relaxed);
+}
+
+void metrics_connection_closed(void) {
+    atomic_fetch_sub_explicit(&connections_open, 1, memory_order_relaxed);
+}
+
+void metrics_bytes_in(long bytes) {
+    atomic_fetch_add_explicit(&bytes_received, (unsigned long long)bytes, memory_order_relaxed);
+}
+
+void metrics_bytes_out(long bytes) {
+    atomic_fetch_add_explicit(&bytes_sent, (unsigned long long)bytes, memory_order_relaxed);
+}
+
+void metrics_outbound_queued(long bytes_delta, int backlogged_delta) {
+    if (bytes_delta != 0) {
+        atomic_fetch_add_explicit(&outbound_bytes, bytes_delta, memory_order_relaxed);
+    }
+    if (backlogged_delta != 0) {
+        atomic_fetch_add_explicit(&outbound_backlogged, backlogged_delta, memory_order_relaxed);
+    }
+}
+
+void metrics_slow_consumer(bool disconnected) {
+    atomic_fetch_add_explicit(disconnected ? &slow_consumer_disconnects : &slow_consumer_drops, 1,
+                              memory_order_relaxed);
+}
+
+int metrics_command_slot(int cmd) {
+    return cmd >= 0 && cmd < METRICS_COMMAND_SLOTS - 1 ? cmd : METRICS_COMMAND_SLOTS - 1;
+}
+
+const char* metrics_command_name(int slot) {
+    switch (slot) {
+        case CMD_LOGIN: return "login";
+        case CMD_REGISTER: return "register";
+        case CMD_LOGOUT: return "logout";
+        case CMD_GET_FRIENDS: return "get_friends";
+        case CMD_ADD_FRIEND: return "add_friend";
+        case CMD_ACK_OFFLINE: return "ack_offline";
+        case CMD_SEND_MESSAGE: return "send_message";
+        case CMD_RECEIVE_MESSAGE: return "receive_message";
+        case CMD_DISCONNECT: return "disconnect";
+        case CMD_CREATE_GROUP: return "create_group";
+        case CMD_ADD_TO_GROUP: return "add_to_group";
+        case CMD_REMOVE_FROM_GROUP: return "remove_from_group";
+        case CMD_LEAVE_GROUP: return "leave_group";
+        case CMD_GROUP_MESSAGE: return "group_message";
+        case CMD_SEARCH_HISTORY: return "search_history";
+        case CMD_SET_GROUP_NAME: return "set_group_name";
+        case CMD_BLOCK_USER: return "block_user";
+        case CMD_UNBLOCK_USER: return "unblock_user";
+        case CMD_PIN_MESSAGE: return "pin_message";
+        case CMD_GET_PINNED: return "get_pinned";
+        case CMD_GET_HISTORY: return "get_history";
+        default: return "other";
+    }
+}
+
+// Growable output buffer for metrics_render()
+typedef struct {
+    char* data;
+    int len;
+    int capacity;
+    bool failed;
+} TextBuffer;
+
+static void text_append(TextBuffer* text, const char* format, ...) {
+    if (text->failed) return;
+    while (1) {
+        va_list args;
+        va_start(args, format);
+        int needed = vsnprintf(text->data + text->len, (size_t)(text->capacity - text->len), format, args);
+        va_end(args);
+        if (needed < 0) {
+            text->failed = true;
+            return;
+        }
+        if (text->len + needed < text->capacity) {
+            text->len += needed;
+            return;
+        }
+
+        int capacity = text->capacity * 2 + needed;
+        char* data = (char*)realloc(text->data, (size_t)capacity);
+        if (!data) {
+            text->failed = true;
+            return;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+// Write one histogram's series; labels is empty or `name="value",`
+static void render_histogram(TextBuffer* text, const char* name, const char* labels, Histogram* histogram) {
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        text_append(text, "%s_bucket{%sle=\"%.6f\"} %llu\n", name, labels,
+                    (double)bucket_bound_us(i) / 1e6, cumulative);
+    }
+    cumulative += atomic_load_explicit(&histogram->buckets[HISTOGRAM_BUCKETS], memory_order_relaxed);
+    text_append(text, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels, cumulative);
+
+    /* the sum and count series carry the labels without the trailing comma */
+    char series_labels[64] = "";
+    int labels_len = (int)strlen(labels);
+    if (labels_len > 0) {
+        snprintf(series_labels, sizeof(series_labels), "{%.*s}", labels_len - 1, labels);
+    }
+    double sum = (double)atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed) / 1e9;
+    text_append(text, "%s_sum%s %.9f\n", name, series_labels, sum);
+    text_append(text, "%s_count%s %llu\n", name, series_labels, cumulative);
+}
+
+static unsigned long long histogram_count(Histogram* histogram) {
+    unsigned long long count = 0;
+    for (int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+        count += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    }
+    return count;
+}
+
+static void render_counter(TextBuffer* text, const char* name, const char* type, const char* help,
+                           long long value) {
+    text_append(text, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help, name, type, name, value);
+}
+
+int metrics_render(char** text_out) {
+    TextBuffer text = { NULL, 0, 0, false };
+    text.capacity = 64 * 1024;
+    text.data = (char*)malloc((size_t)text.capacity);
+    if (!text.data) return -1;
+    text.data[0] = '\0';
+
+    /* commands that were never run are left out */
+    unsigned long long counts[METRICS_COMMAND_SLOTS];
+    for (int slot = 0; slot < METRICS_COMMAND_SLOTS; slot++) {
+        counts[slot] = histogram_count(&command_timers[slot][TIMER_COMMAND]);
+    }
+
+    text_append(&text, "# HELP chat_commands_total Commands executed\n# TYPE chat_commands_total counter\n");
+    for (int slot = 0; slot < METRICS_COMMAND_SLOTS; slot++) {
+        if (counts[slot] == 0) continue;
+        text_append(&text, "chat_commands_total{command=\"%s\"} %llu\n", metrics_command_name(slot), counts[slot]);
+    }
+
+    for (int timer = 0; timer < TIMER_COUNT; timer++) {
+        text_append(&text, "# HELP %s %s\n# TYPE %s histogram\n", timer_info[timer].name, timer_info[timer].help,
+                    timer_info[timer].name);
+        for (int slot = 0; slot < METRICS_COMMAND_SLOTS; slot++) {
+            if (counts[slot] == 0) continue;
+            char labels[64];
+            snprintf(labels, sizeof(labels), "command=\"%s\",", metrics_command_name(slot));
+            render_histogram(&text, timer_info[timer].name, labels, &command_timers[slot][timer]);
+        }
+    }
+
+    text_append(&text, "# HELP chat_queue_wait_seconds Time a readable connection waited for a worker (epoll mode)\n"
+                       "# TYPE chat_queue_wait_seconds histogram\n");
+    render_histogram(&text, "chat_queue_wait_seconds", "", &queue_wait);
+
+    render_counter(&text, "chat_connections_accepted_total", "counter", "Connections accepted",
+                   (long long)atomic_load(&connections_accepted));
+    render_counter(&text, "chat_connections_open", "gauge", "Connections currently open",
+                   atomic_load(&connections_open));
+    render_counter(&text, "chat_received_bytes_total", "counter", "Bytes read from clients",
+                   (long long)atomic_load(&bytes_received));
+    render_counter(&text, "chat_sent_bytes_total", "counter", "Bytes written to clients",
+                   (long long)atomic_load(&bytes_sent));
+    render_counter(&text, "chat_outbound_queued_bytes", "gauge", "Bytes waiting in outbound queues",
+                   atomic_load(&outbound_bytes));
+    render_counter(&text, "chat_outbound_backlogged_connections", "gauge",
+                   "Connections with output waiting for the outbound writer", atomic_load(&outbound_backlogged));
+    render_counter(&text, "chat_slow_consumer_disconnects_total", "counter",
+                   "Connections cut off for overflowing their outbound queue",
+                   (long long)atomic_load(&slow_consumer_disconnects));
+    render_counter(&text, "chat_slow_consumer_dropped_frames_total", "counter",
+                   "Frames dropped for slow consumers (--slow-consumer=drop)",
+                   (long long)atomic_load(&slow_consumer_drops));
+    render_counter(&text, "chat_log_dropped_records_total", "counter", "Activity log records dropped (queue full)",
+                   (long long)log_dropped_count());
+
+    if (text.failed) {
+        free(text.data);
+        return -1;
+    }
+    *text_out = text.data;
+    return text.len;
+}
+
+// Answer one HTTP request on an accepted admin connection
+static void serve_request(socket_t client) {
+    char request[1024];
+    int len = recv(client, request, sizeof(request) - 1, 0);
+    if (len <= 0) return;
+    request[len] = '\0';
+
+    char header[160];
+    char* body = NULL;
+    int body_len = -1;
+    const char* status;
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        body_len = metrics_render(&body);
+        status = "500 Internal Server Error";
+    } else if (strncmp(request, "GET ", 4) == 0) {
+        status = "404 Not Found";
+    } else {
+        status = "400 Bad Request";
+    }
+
+    if (body_len < 0) {
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+        send_all(client, header, header_len);
+        return;
+    }
+
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %d\r\nConnection: close\r\n\r\n", body_len);
+    if (send_all(client, header, header_len) != SOCKET_ERROR) {
+        send_all(client, body, body_len);
+    }
+    free(body);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI admin_main(LPVOID arg) {
+#else
+static void* admin_main(void* arg) {
+#endif
+    (void)arg;
+    while (1) {
+        socket_t client = accept(admin_socket, NULL, NULL);
+        if (client == INVALID_SOCKET) continue;
+
+        /* one request per connection; a silent client cannot stall scrapes for long */
+        #ifdef _WIN32
+        DWORD timeout = 2000;
+        #else
+        struct timeval timeout = { 2, 0 };
+        #endif
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        serve_request(client);
+        close_socket(client);
+    }
+    return 0;
+}
+
+int metrics_server_start(int port) {
+    admin_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (admin_socket == INVALID_SOCKET) {
+        printf("Metrics socket creation failed\n");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(admin_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+
+    /* admin only: reachable from this host, not from clients */
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)port);
+
+    if (bind(admin_socket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(admin_socket, 16) == SOCKET_ERROR) {
+        printf("Failed to open metrics port %d\n", port);
+        close_socket(admin_socket);
+        return -1;
+    }
+
+    #ifdef _WIN32
+    HANDLE thread = CreateThread(NULL, 0, admin_main, NULL, 0, NULL);
+    if (thread == NULL) {
+    #else
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, admin_main, NULL) != 0) {
+    #endif
+        printf("Failed to start metrics server\n");
+        close_socket(admin_socket);
+        return -1;
+    }
+    #ifdef _WIN32
+    CloseHandle(thread);
+    #else
+    pthread_detach(thread);
+    #endif
+
+    atomic_store(&enabled, true);
+    printf("Serving metrics on http://127.0.0.1:%d/metrics\n", port);
+    return 0;
+}
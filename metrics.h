@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+
+// Server metrics: per-command counters and latency histograms, connection,
+// traffic and outbound queue figures, served in the Prometheus text format
+// on a local admin port. Recording only updates relaxed atomics and
+// thread-local totals. Counters are always kept; timings (and the clock
+// reads they need) only once metrics_server_start() has been called.
+
+// Commands are tracked by CommandType value below this; others share one slot
+#define METRICS_COMMAND_SLOTS 32
+
+// Slot a command is counted in, and the label of a slot
+int metrics_command_slot(int cmd);
+const char* metrics_command_name(int slot);
+
+// Per-thread lock and send totals when a command started
+typedef struct {
+    uint64_t start_ns;
+    uint64_t lock_ns;
+    uint64_t send_ns;
+} CommandTiming;
+
+// Monotonic clock in nanoseconds
+uint64_t metrics_now_ns(void);
+
+// Start of a timed interval: the clock, or 0 while timings are off
+uint64_t metrics_timestamp(void);
+
+// Bracket one command. The command's duration, the time the thread held
+// state locks and the time it spent in connection_send() are recorded
+// against cmd.
+void metrics_command_begin(CommandTiming* timing);
+void metrics_command_end(const CommandTiming* timing, CommandType cmd);
+
+// Called just after taking and just before releasing a state lock; nested
+// locks count once
+void metrics_lock_acquired(void);
+void metrics_lock_released(void);
+
+// Intervals started with metrics_timestamp(): time in connection_send()
+// (counted against the running command) and time a ready connection
+// waited for a worker
+void metrics_send_done(uint64_t started);
+void metrics_queue_wait(uint64_t queued_at);
+
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+void metrics_bytes_in(long bytes);
+void metrics_bytes_out(long bytes);
+void metrics_outbound_queued(long bytes_delta, int backlogged_delta);
+void metrics_slow_consumer(bool disconnected);
+
+// Format every metric into a malloc'd, NUL-terminated string. Returns its
+// length, or -1 if out of memory.
+int metrics_render(char** text);
+
+// Serve GET /metrics on 127.0.0.1:port from a background thread and start
+// recording. Returns -1 if the port cannot be opened.
+int metrics_server_start(int port);
+
+#endif // METRICS_H
@@ -0,0 +1,718 @@
+#include "server.h"
+#include "msgstore.h"
+#include "logger.h"
+#include "scan.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define rmdir _rmdir
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+// Microbenchmarks for the per-request hot paths: the protocol codec in
+// common.c, the directory, block/friend and search lookups in server.c
+// (linked in built with -DCHAT_NO_MAIN) and whole requests run through
+// process_frame(). Each benchmark is calibrated to
+// run for about BENCH_TARGET_MS and reports ns/op and heap allocations per
+// op. Allocations are counted by wrapping malloc/calloc/realloc at link
+// time (-Wl,--wrap, GNU toolchains only); elsewhere they are reported as -1.
+
+#define BENCH_TARGET_MS 200
+#define BENCH_DATA_DIR "microbench.data"
+#define HISTORY_USERS 1000
+#define HISTORY_GROUPS 10
+#define HISTORY_GROUP_SIZE 100
+#define HISTORY_MESSAGES 200000
+#define VOCABULARY_SIZE 2000
+
+#ifdef MICROBENCH_COUNT_ALLOCS
+static atomic_long allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+static long allocation_count(void) {
+    return atomic_load(&allocations);
+}
+#else
+static long allocation_count(void) {
+    return -1;
+}
+#endif
+
+typedef void (*BenchFn)(void* ctx, long iterations);
+
+static const char* name_filter;
+static bool json_output;
+static int results_printed;
+static uint32_t rng_state = 2463534242u;
+
+// Stops the optimizer from discarding benchmarked results
+static volatile uintptr_t sink;
+
+static int64_t now_ns(void) {
+    #ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (int64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    #endif
+}
+
+static uint32_t next_random(void) {
+    /* xorshift32 */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static bool selected(const char* name) {
+    return !name_filter || strstr(name, name_filter) != NULL;
+}
+
+// Calibrate the iteration count to about BENCH_TARGET_MS, then time it
+static void run_bench(const char* name, BenchFn fn, void* ctx) {
+    if (!selected(name)) return;
+
+    long iterations = 1;
+    int64_t elapsed;
+    while (1) {
+        int64_t start = now_ns();
+        fn(ctx, iterations);
+        elapsed = now_ns() - start;
+        if (elapsed >= (int64_t)BENCH_TARGET_MS * 1000000 / 10 || iterations >= (1L << 30)) break;
+        iterations *= 2;
+    }
+    if (elapsed > 0) {
+        double scale = (double)BENCH_TARGET_MS * 1e6 / (double)elapsed;
+        iterations = (long)((double)iterations * scale) + 1;
+    }
+
+    long allocs_before = allocation_count();
+    int64_t start = now_ns();
+    fn(ctx, iterations);
+    elapsed = now_ns() - start;
+    long allocs = allocation_count() - allocs_before;
+
+    double ns_per_op = (double)elapsed / (double)iterations;
+    double allocs_per_op = allocs_before < 0 ? -1.0 : (double)allocs / (double)iterations;
+    if (json_output) {
+        printf("%s  {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}",
+               results_printed ? ",\n" : "", name, iterations, ns_per_op, allocs_per_op);
+    } else {
+        printf("%-32s %12ld %12.1f %12.2f\n", name, iterations, ns_per_op, allocs_per_op);
+    }
+    results_printed++;
+    fflush(stdout);
+}
+
+// --- Protocol codec ---
+
+typedef struct {
+    ProtocolMessage msg;
+    char text_frame[BUFFER_SIZE];
+    int text_len;
+    char binary_frame[BUFFER_SIZE];
+    int binary_len;
+} CodecContext;
+
+static void bench_serialize_text(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    for (long i = 0; i < iterations; i++) {
+        int len;
+        char* frame = serialize_protocol_message(&codec->msg, &len);
+        sink += (uintptr_t)len;
+        free(frame);
+    }
+}
+
+static void bench_encode_binary(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    for (long i = 0; i < iterations; i++) {
+        int len;
+        char* frame = encode_protocol_message(&codec->msg, PROTO_BINARY, &len);
+        sink += (uintptr_t)len;
+        free(frame);
+    }
+}
+
+static void bench_frame_encode_text(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    for (long i = 0; i < iterations; i++) {
+        Frame* frame = frame_encode(&codec->msg, PROTO_TEXT);
+        sink += (uintptr_t)frame->len;
+        frame_release(frame);
+    }
+}
+
+/* frames are parsed in place, so every decode benchmark works on a fresh
+   copy of the frame */
+
+static void bench_deserialize_text(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    char frame[BUFFER_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(frame, codec->text_frame, (size_t)codec->text_len + 1);
+        ProtocolMessage* msg = deserialize_protocol_message(frame, codec->text_len);
+        sink += (uintptr_t)msg->cmd;
+        free(msg);
+    }
+}
+
+static void bench_decode_text(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    char frame[BUFFER_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(frame, codec->text_frame, (size_t)codec->text_len + 1);
+        ProtocolMessage msg;
+        decode_protocol_message(frame, codec->text_len, &msg);
+        sink += (uintptr_t)msg.cmd;
+    }
+}
+
+static void bench_parse_view_text(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    char frame[BUFFER_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(frame, codec->text_frame, (size_t)codec->text_len + 1);
+        MessageView view;
+        parse_message_view(frame, codec->text_len, &view);
+        sink += (uintptr_t)view.content.len;
+    }
+}
+
+static void bench_deserialize_binary(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    char frame[BUFFER_SIZE + 1];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(frame, codec->binary_frame, (size_t)codec->binary_len);
+        ProtocolMessage* msg = deserialize_protocol_message(frame, codec->binary_len);
+        sink += (uintptr_t)msg->cmd;
+        free(msg);
+    }
+}
+
+static void bench_parse_view_binary(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    char frame[BUFFER_SIZE + 1];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(frame, codec->binary_frame, (size_t)codec->binary_len);
+        MessageView view;
+        parse_message_view(frame, codec->binary_len, &view);
+        sink += (uintptr_t)view.content.len;
+    }
+}
+
+// A binary request relayed to a text peer: parse it in place, then encode
+// the view as text, as the server does for mixed-protocol conversations
+static void bench_relay_binary_to_text(void* ctx, long iterations) {
+    CodecContext* codec = (CodecContext*)ctx;
+    char frame[BUFFER_SIZE + 1];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(frame, codec->binary_frame, (size_t)codec->binary_len);
+        MessageView view;
+        parse_message_view(frame, codec->binary_len, &view);
+        Frame* relayed = frame_encode_view(&view, PROTO_TEXT);
+        sink += (uintptr_t)relayed->len;
+        frame_release(relayed);
+    }
+}
+
+// Content that would forge a second frame if relayed to a text peer as is
+#define FORGED_FRAME_CONTENT "hi|PINNED:0|CMD:5|SENDER:admin|RECIPIENT:|CONTENT:reset your password|" \
+                             "EXTRA:|TYPE:0|PINNED:0|"
+
+// Relay msg from a binary client to a text one and check that exactly one
+// frame arrives, with msg's sender and content. Returns -1 if not.
+static int check_binary_to_text_relay(const ProtocolMessage* msg) {
+    char frame[BUFFER_SIZE + 1];
+    int len = encode_binary_message(msg, frame, BUFFER_SIZE);
+    MessageView view;
+    if (len < 0 || parse_message_view(frame, len, &view) < 0) return -1;
+    Frame* relayed = frame_encode_view(&view, PROTO_TEXT);
+    if (!relayed) return -1;
+
+    char text[BUFFER_SIZE + 1];
+    int text_len = relayed->len;
+    memcpy(text, relayed->data, (size_t)text_len);
+    frame_release(relayed);
+    ProtocolMessage received;
+    if (find_frame_length(text, text_len) != text_len || decode_protocol_message(text, text_len, &received) < 0) {
+        return -1;
+    }
+    bool same = received.cmd == msg->cmd && strcmp(received.sender, msg->sender) == 0 &&
+                strlen(received.content) == strlen(msg->content);
+    return same ? 0 : -1;
+}
+
+static int codec_benchmarks(void) {
+    CodecContext codec;
+    memset(&codec, 0, sizeof(codec));
+    codec.msg.cmd = CMD_SEND_MESSAGE;
+    strcpy(codec.msg.sender, "alice_anderson");
+    strcpy(codec.msg.recipient, "bob_brown");
+    /* a typical chat line of about 200 bytes */
+    snprintf(codec.msg.content, MAX_CONTENT, "%s",
+             "Hey Bob, are we still on for the design review tomorrow at 10? I pushed the latest "
+             "changes to the branch last night, the search paging should work now. Let me know "
+             "if the new layout looks OK on your end!");
+    codec.msg.msg_type = MSG_TEXT;
+
+    int len;
+    char* text = serialize_protocol_message(&codec.msg, &len);
+    memcpy(codec.text_frame, text, (size_t)len + 1);
+    codec.text_len = len;
+    free(text);
+    codec.binary_len = encode_binary_message(&codec.msg, codec.binary_frame, sizeof(codec.binary_frame));
+
+    ProtocolMessage forged = codec.msg;
+    strcpy(forged.content, FORGED_FRAME_CONTENT);
+    if (check_binary_to_text_relay(&codec.msg) < 0 || check_binary_to_text_relay(&forged) < 0) {
+        fprintf(stderr, "A binary message relayed as text does not arrive as one frame\n");
+        return -1;
+    }
+
+    run_bench("codec/serialize_text", bench_serialize_text, &codec);
+    run_bench("codec/encode_binary", bench_encode_binary, &codec);
+    run_bench("codec/frame_encode_text", bench_frame_encode_text, &codec);
+    run_bench("codec/deserialize_text", bench_deserialize_text, &codec);
+    run_bench("codec/decode_text", bench_decode_text, &codec);
+    run_bench("codec/parse_view_text", bench_parse_view_text, &codec);
+    run_bench("codec/deserialize_binary", bench_deserialize_binary, &codec);
+    run_bench("codec/parse_view_binary", bench_parse_view_binary, &codec);
+    run_bench("codec/relay_binary_to_text", bench_relay_binary_to_text, &codec);
+    return 0;
+}
+
+// --- Byte scanning ---
+
+typedef struct {
+    char frame[BUFFER_SIZE];
+    int len;
+} ScanContext;
+
+static void bench_scan_split(void* ctx, long iterations) {
+    ScanContext* scan = (ScanContext*)ctx;
+    int bars[16];
+    for (long i = 0; i < iterations; i++) {
+        sink += (uintptr_t)scan_split(scan->frame, scan->len, '|', bars, 16);
+    }
+}
+
+static void bench_scan_frame_end(void* ctx, long iterations) {
+    ScanContext* scan = (ScanContext*)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += (uintptr_t)find_frame_length(scan->frame, scan->len);
+    }
+}
+
+// Each scanner at every level this CPU supports, over a text frame with
+// 2 KB of content
+static void scan_benchmarks(void) {
+    ScanContext scan;
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.cmd = CMD_SEND_MESSAGE;
+    strcpy(msg.sender, "alice_anderson");
+    strcpy(msg.recipient, "bob_brown");
+    for (int i = 0; i < MAX_CONTENT - 1; i++) {
+        msg.content[i] = (char)(i % 7 == 6 ? ' ' : 'a' + i % 26);
+    }
+    int len;
+    char* text = serialize_protocol_message(&msg, &len);
+    memcpy(scan.frame, text, (size_t)len);
+    scan.len = len;
+    free(text);
+
+    ScanLevel best = scan_set_level(SCAN_AVX2);
+    for (int level = SCAN_SCALAR; level <= (int)best; level++) {
+        char name[64];
+        scan_set_level((ScanLevel)level);
+        snprintf(name, sizeof(name), "scan/split_%s", scan_level_name((ScanLevel)level));
+        run_bench(name, bench_scan_split, &scan);
+        snprintf(name, sizeof(name), "scan/frame_end_%s", scan_level_name((ScanLevel)level));
+        run_bench(name, bench_scan_frame_end, &scan);
+    }
+    scan_set_level(best);
+}
+
+// --- Directory lookups ---
+
+typedef struct {
+    ServerState* state;
+    int user_count;
+    char (*names)[MAX_USERNAME];
+    User* user;
+    User* other;
+} LookupContext;
+
+static void free_state(ServerState* state) {
+    for (uint32_t i = 0; i < state->users.count; i++) {
+        User* user = (User*)slab_get(&state->users, i);
+        idset_free(&user->friends);
+        idset_free(&user->blocked);
+    }
+    for (uint32_t i = 0; i < state->groups.count; i++) {
+        Group* group = (Group*)slab_get(&state->groups, i);
+        idset_free(&group->members);
+        idset_free(&group->admins);
+        for (int h = 0; group->history.slots && h < group->history.capacity; h++) {
+            free(group->history.slots[h].message.content);
+        }
+        free(group->history.slots);
+        msgid_index_free(&group->history.index);
+        free(group->pinned);
+        arena_free(&group->pinned_arena);
+    }
+    slab_free(&state->users);
+    slab_free(&state->groups);
+    hash_index_free(&state->user_index);
+    hash_index_free(&state->group_index);
+    arena_free(&state->user_names);
+}
+
+static void fill_users(ServerState* state, char (*names)[MAX_USERNAME], int count) {
+    for (int i = 0; i < count; i++) {
+        snprintf(names[i], MAX_USERNAME, "user_%07d", i);
+        add_user(state, names[i], "password");
+    }
+}
+
+static void bench_find_user_hit(void* ctx, long iterations) {
+    LookupContext* lookup = (LookupContext*)ctx;
+    for (long i = 0; i < iterations; i++) {
+        User* user = find_user(lookup->state, lookup->names[next_random() % (uint32_t)lookup->user_count]);
+        sink += (uintptr_t)user;
+    }
+}
+
+static void bench_find_user_miss(void* ctx, long iterations) {
+    LookupContext* lookup = (LookupContext*)ctx;
+    char name[MAX_USERNAME];
+    for (long i = 0; i < iterations; i++) {
+        snprintf(name, sizeof(name), "nobody_%07u", next_random() % 10000000u);
+        sink += (uintptr_t)find_user(lookup->state, name);
+    }
+}
+
+static void bench_is_blocked(void* ctx, long iterations) {
+    LookupContext* lookup = (LookupContext*)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += (uintptr_t)is_blocked(lookup->user, lookup->other);
+    }
+}
+
+static void bench_are_friends(void* ctx, long iterations) {
+    LookupContext* lookup = (LookupContext*)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += (uintptr_t)are_friends(lookup->user, lookup->other);
+    }
+}
+
+static void lookup_benchmarks(void) {
+    static const int sizes[] = { 1000, 10000, 100000 };
+    char (*names)[MAX_USERNAME] = malloc(sizeof(*names) * 100000);
+    if (!names) return;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char hit_name[64], miss_name[64];
+        snprintf(hit_name, sizeof(hit_name), "find_user/%dk_hit", sizes[s] / 1000);
+        snprintf(miss_name, sizeof(miss_name), "find_user/%dk_miss", sizes[s] / 1000);
+        if (!selected(hit_name) && !selected(miss_name)) continue;
+
+        ServerState state;
+        init_server_state(&state);
+        fill_users(&state, names, sizes[s]);
+        LookupContext lookup = { &state, sizes[s], names, NULL, NULL };
+        run_bench(hit_name, bench_find_user_hit, &lookup);
+        run_bench(miss_name, bench_find_user_miss, &lookup);
+        free_state(&state);
+    }
+
+    /* block and friend lists small enough to stay sorted, and large enough
+       to be hashed, probing a user who is not on them */
+    static const int list_sizes[] = { 50, 10000 };
+    for (size_t s = 0; s < sizeof(list_sizes) / sizeof(list_sizes[0]); s++) {
+        int size = list_sizes[s];
+        char blocked_name[64], friends_name[64];
+        snprintf(blocked_name, sizeof(blocked_name), size < 1000 ? "is_blocked/%d_miss" : "is_blocked/%dk_miss",
+                 size < 1000 ? size : size / 1000);
+        snprintf(friends_name, sizeof(friends_name), size < 1000 ? "are_friends/%d_miss" : "are_friends/%dk_miss",
+                 size < 1000 ? size : size / 1000);
+        if (!selected(blocked_name) && !selected(friends_name)) continue;
+
+        ServerState state;
+        init_server_state(&state);
+        fill_users(&state, names, size + 2);
+        User* user = find_user(&state, names[0]);
+        for (int i = 1; i <= size; i++) {
+            User* friend_user = find_user(&state, names[i]);
+            add_friend(user, friend_user);
+            idset_add(&user->blocked, friend_user->id);
+        }
+        LookupContext lookup = { &state, size + 2, names, user, find_user(&state, names[size + 1]) };
+        run_bench(blocked_name, bench_is_blocked, &lookup);
+        run_bench(friends_name, bench_are_friends, &lookup);
+        free_state(&state);
+    }
+    free(names);
+}
+
+// --- History search ---
+
+typedef struct {
+    ServerState* state;
+    const char* keyword;
+    const char* username;
+    const char* recipient;
+} SearchContext;
+
+static void bench_search(void* ctx, long iterations) {
+    SearchContext* search = (SearchContext*)ctx;
+    for (long i = 0; i < iterations; i++) {
+        int count;
+        uint32_t next_cursor;
+        char** results = search_messages(search->state, search->keyword, search->username, search->recipient,
+                                         0, &count, &next_cursor);
+        for (int r = 0; r < count; r++) {
+            free(results[r]);
+        }
+        free(results);
+        sink += (uintptr_t)count;
+    }
+}
+
+// Delete the benchmark's message store
+static void remove_data_dir(void) {
+    char path[300];
+    for (unsigned segment = 1; ; segment++) {
+        snprintf(path, sizeof(path), "%s/%08u.wal", BENCH_DATA_DIR, segment);
+        if (remove(path) != 0) break;
+    }
+    snprintf(path, sizeof(path), "%s/inbox.log", BENCH_DATA_DIR);
+    remove(path);
+    snprintf(path, sizeof(path), "%s/activity.log", BENCH_DATA_DIR);
+    remove(path);
+    rmdir(BENCH_DATA_DIR);
+}
+
+// Open the message store in a fresh BENCH_DATA_DIR, once per run
+static bool open_bench_storage(void) {
+    static int opened = -1;
+    if (opened < 0) {
+        remove_data_dir();
+        MsgStoreConfig config;
+        msgstore_config_defaults(&config);
+        config.dir = BENCH_DATA_DIR;
+        config.durability = MSGSTORE_DURABILITY_NONE;
+        opened = open_storage(&config) == 0;
+    }
+    return opened == 1;
+}
+
+static void search_benchmarks(void) {
+    if (!selected("search/")) return;
+    if (!open_bench_storage()) return;
+
+    ServerState state;
+    init_server_state(&state);
+    char (*names)[MAX_USERNAME] = malloc(sizeof(*names) * HISTORY_USERS);
+    char (*groups)[MAX_GROUP_ID] = malloc(sizeof(*groups) * HISTORY_GROUPS);
+    if (!names || !groups) return;
+    fill_users(&state, names, HISTORY_USERS);
+
+    /* groups of HISTORY_GROUP_SIZE consecutive users; user 0 is in group 0 */
+    for (int g = 0; g < HISTORY_GROUPS; g++) {
+        Group* group = create_group(&state, "bench", find_user(&state, names[g * HISTORY_GROUP_SIZE]), groups[g]);
+        for (int m = 1; m < HISTORY_GROUP_SIZE; m++) {
+            User* member = find_user(&state, names[(g * HISTORY_GROUP_SIZE + m) % HISTORY_USERS]);
+            idset_add(&group->members, member->id);
+        }
+    }
+
+    /* word i appears with probability about 1 / (i + 1), like real text */
+    char content[MAX_CONTENT];
+    int64_t start = now_ns();
+    for (int i = 0; i < HISTORY_MESSAGES; i++) {
+        int words = 8 + (int)(next_random() % 12);
+        int len = 0;
+        for (int w = 0; w < words && len < MAX_CONTENT - 16; w++) {
+            uint32_t rank = next_random() % VOCABULARY_SIZE;
+            rank = rank * (next_random() % VOCABULARY_SIZE) / VOCABULARY_SIZE;
+            len += snprintf(content + len, MAX_CONTENT - len, "%sw%u", w ? " " : "", rank);
+        }
+
+        const char* sender = names[next_random() % HISTORY_USERS];
+        uint64_t id;
+        MsgLocation location;
+        if (i % 5 == 0) {
+            save_message(sender, groups[next_random() % HISTORY_GROUPS], content, MSG_TEXT, true, &id, &location);
+        } else {
+            save_message(sender, names[next_random() % HISTORY_USERS], content, MSG_TEXT, false, &id, &location);
+        }
+    }
+    fprintf(stderr, "Stored %d messages in %.1f s\n", HISTORY_MESSAGES, (double)(now_ns() - start) / 1e9);
+
+    SearchContext search = { &state, "w1", names[0], "" };
+    run_bench("search/common_word", bench_search, &search);
+    search.keyword = "w1 w2";
+    run_bench("search/two_words", bench_search, &search);
+    search.keyword = "w1999";
+    run_bench("search/rare_word", bench_search, &search);
+    search.keyword = "w1";
+    search.recipient = groups[0];
+    run_bench("search/common_word_in_group", bench_search, &search);
+
+    free(names);
+    free(groups);
+}
+
+// --- Request path ---
+
+#ifndef _WIN32
+typedef struct {
+    Connection* conns[2];         // Sender, then recipient
+    socket_t peers[2];            // Client ends of their sockets
+    char frame[BUFFER_SIZE];
+    int len;
+} RequestContext;
+
+// Read and discard whatever the server wrote to a client socket
+static void drain(socket_t peer) {
+    char buffer[BUFFER_SIZE];
+    while (recv(peer, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+}
+
+static void set_request(RequestContext* request, CommandType cmd, const char* recipient, const char* content) {
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.cmd = cmd;
+    strcpy(msg.sender, "bench_a");
+    strncpy(msg.recipient, recipient, MAX_USERNAME - 1);
+    strncpy(msg.content, content, MAX_CONTENT - 1);
+    char* frame = serialize_protocol_message(&msg, &request->len);
+    memcpy(request->frame, frame, (size_t)request->len + 1);
+    free(frame);
+}
+
+static void bench_request(void* ctx, long iterations) {
+    RequestContext* request = (RequestContext*)ctx;
+    char frame[BUFFER_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(frame, request->frame, (size_t)request->len + 1);
+        process_frame(request->conns[0], frame, request->len);
+        drain(request->peers[0]);
+        drain(request->peers[1]);
+    }
+}
+
+static void request_benchmarks(void) {
+    if (!selected("request/")) return;
+    if (!open_bench_storage()) return;
+
+    LogConfig log_config;
+    log_config_defaults(&log_config);
+    log_config.path = BENCH_DATA_DIR "/activity.log";
+    log_writer_start(&log_config);
+
+    /* two logged-in users who are friends and share a group */
+    ServerState state;
+    init_server_state(&state);
+    const char* names[2] = { "bench_a", "bench_b" };
+    RequestContext request;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    for (int i = 0; i < 2; i++) {
+        add_user(&state, names[i], "pw");
+        socket_t pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) return;
+        request.conns[i] = connection_create(&state, pair[0], &addr);
+        request.peers[i] = pair[1];
+        if (!request.conns[i]) return;
+
+        ProtocolMessage login;
+        memset(&login, 0, sizeof(login));
+        login.cmd = CMD_LOGIN;
+        strcpy(login.sender, names[i]);
+        strcpy(login.content, "pw");
+        int len;
+        char* frame = serialize_protocol_message(&login, &len);
+        process_frame(request.conns[i], frame, len);
+        free(frame);
+    }
+    User* a = find_user(&state, names[0]);
+    User* b = find_user(&state, names[1]);
+    add_friend(a, b);
+    char group_id[MAX_GROUP_ID];
+    Group* group = create_group(&state, "bench", a, group_id);
+    idset_add(&group->members, b->id);
+    drain(request.peers[0]);
+    drain(request.peers[1]);
+
+    const char* line = "Are we still on for the design review tomorrow at 10?";
+    set_request(&request, CMD_SEND_MESSAGE, names[1], line);
+    run_bench("request/send_message", bench_request, &request);
+    set_request(&request, CMD_GROUP_MESSAGE, group_id, line);
+    run_bench("request/group_message", bench_request, &request);
+    set_request(&request, CMD_GET_FRIENDS, "", "");
+    run_bench("request/get_friends", bench_request, &request);
+
+    log_writer_stop();
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--filter=", 9) == 0) {
+            name_filter = argv[i] + 9;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json_output = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--filter=SUBSTRING] [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (json_output) {
+        printf("[\n");
+    } else {
+        printf("%-32s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+    }
+
+    if (codec_benchmarks() < 0) return 1;
+    scan_benchmarks();
+    lookup_benchmarks();
+    search_benchmarks();
+    #ifndef _WIN32
+    request_benchmarks();
+    #endif
+
+    if (json_output) {
+        printf("\n]\n");
+    }
+    return 0;
+}
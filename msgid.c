@@ -0,0 +1,120 @@
+#include "common.h"
+#include "msgid.h"
+
+#define NODE_SHIFT MSGID_SEQUENCE_BITS
+#define TIME_SHIFT (MSGID_SEQUENCE_BITS + MSGID_NODE_BITS)
+
+static uint64_t wall_clock_ms(void) {
+    #ifdef _WIN32
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    // 100 ns ticks since 1601-01-01
+    uint64_t ticks = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+    return ticks / 10000 - 11644473600000ULL;
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+    #endif
+}
+
+void msgid_generator_init(MsgIdGenerator* gen, uint32_t node, uint64_t last) {
+    gen->last = last;
+    gen->node = node & MSGID_MAX_NODE;
+}
+
+uint64_t msgid_next(MsgIdGenerator* gen) {
+    uint64_t now = wall_clock_ms();
+    uint64_t ms = now > MSGID_EPOCH_MS ? now - MSGID_EPOCH_MS : 0;
+    uint64_t node = (uint64_t)gen->node << NODE_SHIFT;
+
+    uint64_t id = (ms << TIME_SHIFT) | node;
+    if (id <= gen->last) {
+        // Same millisecond as the last id, or the clock stepped back
+        id = gen->last + 1;
+        if (((id >> NODE_SHIFT) & MSGID_MAX_NODE) != gen->node) {
+            /* the sequence ran out, or the last id came from another node:
+               borrow the next millisecond */
+            id = (((gen->last >> TIME_SHIFT) + 1) << TIME_SHIFT) | node;
+        }
+    }
+    gen->last = id;
+    return id;
+}
+
+uint64_t msgid_time_ms(uint64_t id) {
+    return (id >> TIME_SHIFT) + MSGID_EPOCH_MS;
+}
+
+// Ids from one node differ mostly in their low bits; fold them all in
+static uint32_t slot_of(uint64_t id, uint32_t mask) {
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return (uint32_t)id & mask;
+}
+
+int msgid_index_init(MsgIdIndex* index, uint32_t entries) {
+    // Keep the table at most half full
+    uint32_t capacity = 4;
+    while (capacity < entries * 2) capacity *= 2;
+    index->ids = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    index->values = (int32_t*)malloc(capacity * sizeof(int32_t));
+    if (!index->ids || !index->values) {
+        free(index->ids);
+        free(index->values);
+        index->ids = NULL;
+        index->values = NULL;
+        return -1;
+    }
+    index->mask = capacity - 1;
+    return 0;
+}
+
+void msgid_index_free(MsgIdIndex* index) {
+    free(index->ids);
+    free(index->values);
+    index->ids = NULL;
+    index->values = NULL;
+    index->mask = 0;
+}
+
+// Slot holding id, or the free slot where it would go
+static uint32_t find_slot(const MsgIdIndex* index, uint64_t id) {
+    uint32_t i = slot_of(id, index->mask);
+    while (index->ids[i] != id && index->ids[i] != 0) {
+        i = (i + 1) & index->mask;
+    }
+    return i;
+}
+
+int32_t msgid_index_find(const MsgIdIndex* index, uint64_t id) {
+    if (!index->ids || id == 0) return -1;
+    uint32_t i = find_slot(index, id);
+    return index->ids[i] == id ? index->values[i] : -1;
+}
+
+void msgid_index_put(MsgIdIndex* index, uint64_t id, int32_t value) {
+    if (!index->ids || id == 0) return;
+    uint32_t i = find_slot(index, id);
+    index->ids[i] = id;
+    index->values[i] = value;
+}
+
+void msgid_index_remove(MsgIdIndex* index, uint64_t id) {
+    if (!index->ids || id == 0) return;
+    uint32_t mask = index->mask;
+    uint32_t hole = find_slot(index, id);
+    if (index->ids[hole] != id) return;
+
+    // Backward-shift deletion, as in idset.c
+    for (uint32_t i = (hole + 1) & mask; index->ids[i] != 0; i = (i + 1) & mask) {
+        uint32_t home = slot_of(index->ids[i], mask);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            index->ids[hole] = index->ids[i];
+            index->values[hole] = index->values[i];
+            hole = i;
+        }
+    }
+    index->ids[hole] = 0;
+}
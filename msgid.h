@@ -0,0 +1,50 @@
+#ifndef MSGID_H
+#define MSGID_H
+
+#include <stdint.h>
+
+// Message ids are 64-bit and snowflake-style: milliseconds since
+// MSGID_EPOCH_MS in the top 42 bits, the node that assigned the id in the
+// next MSGID_NODE_BITS and a per-millisecond sequence in the low
+// MSGID_SEQUENCE_BITS. One generator's ids only ever increase, even if the
+// clock steps back, so they sort in the order messages were stored and
+// serve as paging cursors. 0 is never an id.
+
+#define MSGID_EPOCH_MS 1704067200000ULL   // 2024-01-01 00:00:00 UTC
+#define MSGID_NODE_BITS 10
+#define MSGID_SEQUENCE_BITS 12
+#define MSGID_MAX_NODE ((1u << MSGID_NODE_BITS) - 1)
+
+typedef struct {
+    uint64_t last;       // Last id handed out, or the largest id already stored
+    uint32_t node;
+} MsgIdGenerator;
+
+void msgid_generator_init(MsgIdGenerator* gen, uint32_t node, uint64_t last);
+
+// Next id. Calls must be serialized by the caller.
+uint64_t msgid_next(MsgIdGenerator* gen);
+
+// Milliseconds since the Unix epoch when id was assigned
+uint64_t msgid_time_ms(uint64_t id);
+
+// MsgIdIndex: fixed-size open-addressing map from message id to a small
+// integer, such as the slot a message occupies in a ring. It holds up to
+// the number of entries it was created for and never grows.
+typedef struct {
+    uint64_t* ids;       // 0 marks a free slot
+    int32_t* values;
+    uint32_t mask;
+} MsgIdIndex;
+
+int msgid_index_init(MsgIdIndex* index, uint32_t entries);
+void msgid_index_free(MsgIdIndex* index);
+
+// Value stored for id, or -1
+int32_t msgid_index_find(const MsgIdIndex* index, uint64_t id);
+
+// Insert id or update its value
+void msgid_index_put(MsgIdIndex* index, uint64_t id, int32_t value);
+void msgid_index_remove(MsgIdIndex* index, uint64_t id);
+
+#endif // MSGID_H
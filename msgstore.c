@@ -0,0 +1,545 @@
+#include "msgstore.h"
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#endif
+
+#define MSGSTORE_MAGIC 0x4753434Du  // "MCSG" on disk
+#define MSGSTORE_STAGING_BYTES (256 * 1024)
+// Larger content lengths can only come from a damaged header
+#define MSGSTORE_MAX_CONTENT (1 << 20)
+
+static void segment_path(const MsgStore* store, uint32_t segment, char* path, size_t size) {
+    snprintf(path, size, "%s/%08u.wal", store->dir, segment);
+}
+
+static bool segment_exists(const MsgStore* store, uint32_t segment) {
+    char path[300];
+    struct stat st;
+    segment_path(store, segment, path, sizeof(path));
+    return stat(path, &st) == 0;
+}
+
+static int open_segment(const MsgStore* store, uint32_t segment) {
+    char path[300];
+    segment_path(store, segment, path, sizeof(path));
+    #ifdef _WIN32
+    return _open(path, _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+    #else
+    return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    #endif
+}
+
+static void close_fd(int fd) {
+    #ifdef _WIN32
+    _close(fd);
+    #else
+    close(fd);
+    #endif
+}
+
+static int write_fd(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        #ifdef _WIN32
+        int n = _write(fd, data, (unsigned int)len);
+        #else
+        ssize_t n = write(fd, data, len);
+        #endif
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int sync_fd(int fd) {
+    #if defined(_WIN32)
+    return _commit(fd);
+    #elif defined(__linux__)
+    return fdatasync(fd);
+    #else
+    return fsync(fd);
+    #endif
+}
+
+static int truncate_segment(const MsgStore* store, uint32_t segment, long size) {
+    char path[300];
+    segment_path(store, segment, path, sizeof(path));
+    #ifdef _WIN32
+    int fd = _open(path, _O_WRONLY | _O_BINARY);
+    if (fd < 0) return -1;
+    int rc = _chsize(fd, size);
+    _close(fd);
+    return rc;
+    #else
+    return truncate(path, size);
+    #endif
+}
+
+// Hand the staged records to the segment file. Caller holds lock.
+static void write_staged_locked(MsgStore* store) {
+    if (store->staged_len == 0) return;
+    mutex_lock(&store->io_lock);
+    if (write_fd(store->fd, store->staged, store->staged_len) < 0) {
+        printf("Message store write failed: %s\n", strerror(errno));
+    }
+    mutex_unlock(&store->io_lock);
+    store->staged_len = 0;
+    store->written_size = store->segment_size;
+}
+
+// Write out and sync everything staged so far. Called with lock held; the
+// lock is dropped during I/O so appends can keep staging into the other
+// buffer. io_lock is taken before lock is released, which keeps batches in
+// order with writes made by appenders.
+static void commit_locked(MsgStore* store) {
+    if (store->durable_seq == store->appended_seq || !store->spare) return;
+
+    char* batch = store->staged;
+    size_t batch_len = store->staged_len;
+    uint64_t batch_seq = store->appended_seq;
+    uint32_t batch_segment = store->segment;
+    long batch_end = store->segment_size;
+    store->staged = store->spare;
+    store->spare = NULL;
+    store->staged_len = 0;
+
+    mutex_lock(&store->io_lock);
+    mutex_unlock(&store->lock);
+    if (batch_len > 0 && write_fd(store->fd, batch, batch_len) < 0) {
+        printf("Message store write failed: %s\n", strerror(errno));
+    }
+    if (store->config.durability != MSGSTORE_DURABILITY_NONE && sync_fd(store->fd) < 0) {
+        printf("Message store sync failed: %s\n", strerror(errno));
+    }
+    mutex_unlock(&store->io_lock);
+    mutex_lock(&store->lock);
+
+    store->spare = batch;
+    if (batch_segment == store->segment && batch_end > store->written_size) {
+        store->written_size = batch_end;
+    }
+    if (batch_seq > store->durable_seq) {
+        store->durable_seq = batch_seq;
+    }
+    cond_broadcast(&store->committed);
+}
+
+// Close the current segment and start the next one. Caller holds lock.
+static int roll_segment_locked(MsgStore* store) {
+    mutex_lock(&store->io_lock);
+    if (store->staged_len > 0 && write_fd(store->fd, store->staged, store->staged_len) < 0) {
+        printf("Message store write failed: %s\n", strerror(errno));
+    }
+    store->staged_len = 0;
+    if (store->config.durability != MSGSTORE_DURABILITY_NONE) {
+        sync_fd(store->fd);
+    }
+    close_fd(store->fd);
+
+    store->segment++;
+    store->segment_size = 0;
+    store->written_size = 0;
+    store->fd = open_segment(store, store->segment);
+    mutex_unlock(&store->io_lock);
+
+    if (store->fd < 0) {
+        printf("Failed to open message segment %u: %s\n", store->segment, strerror(errno));
+        return -1;
+    }
+
+    store->durable_seq = store->appended_seq;
+    cond_broadcast(&store->committed);
+    return 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI commit_main(LPVOID arg) {
+#else
+static void* commit_main(void* arg) {
+#endif
+    MsgStore* store = (MsgStore*)arg;
+
+    mutex_lock(&store->lock);
+    while (!store->stopping) {
+        /* synchronous appenders that arrived during the last sync are
+           committed right away; everything else waits for the interval */
+        if (!(store->sync_waiters > 0 && store->durable_seq < store->appended_seq)) {
+            cond_timedwait_ms(&store->commit_wanted, &store->lock, store->config.commit_interval_ms);
+        }
+        commit_locked(store);
+    }
+    commit_locked(store);
+    mutex_unlock(&store->lock);
+    return 0;
+}
+
+// Read and verify the record at the file position, which has at most
+// available bytes left to read. payload grows as needed and content points
+// into it. Returns the record size, or -1 for a damaged or incomplete record.
+static long read_record(FILE* file, long available, char** payload, size_t* capacity,
+                        StoredMessage* msg) {
+    unsigned char header[MSGSTORE_HEADER_SIZE];
+    if (available < MSGSTORE_HEADER_SIZE ||
+        fread(header, 1, MSGSTORE_HEADER_SIZE, file) != MSGSTORE_HEADER_SIZE ||
+        get_le32(header) != MSGSTORE_MAGIC) {
+        return -1;
+    }
+
+    size_t sender_len = header[26];
+    size_t recipient_len = header[27];
+    uint32_t content_len = get_le32(header + 28);
+    if (content_len > MSGSTORE_MAX_CONTENT || sender_len >= MAX_USERNAME ||
+        recipient_len >= MAX_USERNAME) {
+        return -1;
+    }
+
+    size_t payload_len = sender_len + recipient_len + content_len;
+    if (MSGSTORE_HEADER_SIZE + (long)payload_len > available) return -1;
+    if (payload_len + 1 > *capacity) {
+        char* grown = (char*)realloc(*payload, payload_len + 1);
+        if (!grown) return -1;
+        *payload = grown;
+        *capacity = payload_len + 1;
+    }
+    char* data = *payload;
+    if (fread(data, 1, payload_len, file) != payload_len) return -1;
+
+    uint32_t crc = crc32_update(0, header + 8, MSGSTORE_HEADER_SIZE - 8);
+    crc = crc32_update(crc, data, payload_len);
+    if (crc != get_le32(header + 4)) return -1;
+
+    msg->id = get_le64(header + 8);
+    msg->timestamp = (time_t)(int64_t)get_le64(header + 16);
+    msg->flags = header[24];
+    msg->type = (MessageType)header[25];
+    memcpy(msg->sender, data, sender_len);
+    msg->sender[sender_len] = '\0';
+    memcpy(msg->recipient, data + sender_len, recipient_len);
+    msg->recipient[recipient_len] = '\0';
+    data[payload_len] = '\0';
+    msg->content = data + sender_len + recipient_len;
+    msg->content_len = (int)content_len;
+    return MSGSTORE_HEADER_SIZE + (long)payload_len;
+}
+
+// Read records from one segment up to limit bytes, calling visitor for
+// each valid one. Stops at the first damaged or incomplete record and
+// stores the offset just past the last good record in valid_end.
+// Returns 1 if the visitor stopped the scan, 0 otherwise.
+static int scan_segment(MsgStore* store, uint32_t segment, long limit,
+                        MsgStoreVisitor visitor, void* ctx, long* valid_end) {
+    char path[300];
+    segment_path(store, segment, path, sizeof(path));
+    *valid_end = 0;
+
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+
+    char* payload = NULL;
+    size_t payload_capacity = 0;
+    long offset = 0;
+    int stopped = 0;
+    StoredMessage msg;
+    long size;
+
+    while ((size = read_record(file, limit - offset, &payload, &payload_capacity, &msg)) > 0) {
+        MsgLocation location = { segment, (uint32_t)offset };
+        offset += size;
+        if (visitor && !visitor(ctx, &msg, location)) {
+            stopped = 1;
+            break;
+        }
+    }
+
+    *valid_end = offset;
+    free(payload);
+    fclose(file);
+    return stopped;
+}
+
+static bool track_max_id(void* ctx, const StoredMessage* msg, MsgLocation location) {
+    (void)location;
+    uint64_t* max_id = (uint64_t*)ctx;
+    if (msg->id > *max_id) {
+        *max_id = msg->id;
+    }
+    return true;
+}
+
+static long file_size(const MsgStore* store, uint32_t segment) {
+    char path[300];
+    struct stat st;
+    segment_path(store, segment, path, sizeof(path));
+    return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+// Verify every segment, cut a torn record off the end of the last one and
+// pick up the id sequence where it left off
+static int recover(MsgStore* store, uint64_t* max_id, uint32_t* last_segment, long* last_size) {
+    uint32_t segment = 1;
+    *max_id = 0;
+    *last_segment = 1;
+    *last_size = 0;
+
+    while (segment_exists(store, segment)) {
+        long valid_end;
+        long size = file_size(store, segment);
+        scan_segment(store, segment, size, track_max_id, max_id, &valid_end);
+
+        if (valid_end < size) {
+            if (segment_exists(store, segment + 1)) {
+                printf("Message segment %u is damaged at offset %ld; skipping the rest of it\n",
+                       segment, valid_end);
+            } else {
+                printf("Truncating %ld torn bytes from message segment %u\n",
+                       size - valid_end, segment);
+                if (truncate_segment(store, segment, valid_end) < 0) {
+                    printf("Failed to truncate message segment %u: %s\n", segment, strerror(errno));
+                    return -1;
+                }
+            }
+        }
+
+        *last_segment = segment;
+        *last_size = valid_end;
+        segment++;
+    }
+    return 0;
+}
+
+void msgstore_config_defaults(MsgStoreConfig* config) {
+    config->dir = "messages";
+    config->segment_bytes = 64L * 1024 * 1024;
+    config->commit_interval_ms = 10;
+    config->durability = MSGSTORE_DURABILITY_BATCH;
+    config->node_id = 0;
+}
+
+int msgstore_open(MsgStore* store, const MsgStoreConfig* config) {
+    memset(store, 0, sizeof(MsgStore));
+    store->config = *config;
+    if (store->config.commit_interval_ms <= 0) {
+        store->config.commit_interval_ms = 1;
+    }
+    snprintf(store->dir, sizeof(store->dir), "%s", config->dir);
+
+    #ifdef _WIN32
+    _mkdir(store->dir);
+    #else
+    mkdir(store->dir, 0755);
+    #endif
+
+    uint64_t max_id;
+    if (recover(store, &max_id, &store->segment, &store->segment_size) < 0) {
+        return -1;
+    }
+    msgid_generator_init(&store->ids, store->config.node_id, max_id);
+    store->written_size = store->segment_size;
+
+    store->fd = open_segment(store, store->segment);
+    if (store->fd < 0) {
+        printf("Failed to open message segment %u: %s\n", store->segment, strerror(errno));
+        return -1;
+    }
+
+    store->staged_capacity = MSGSTORE_STAGING_BYTES;
+    store->staged = (char*)malloc(store->staged_capacity);
+    store->spare = (char*)malloc(store->staged_capacity);
+    if (!store->staged || !store->spare) {
+        free(store->staged);
+        free(store->spare);
+        close_fd(store->fd);
+        return -1;
+    }
+
+    mutex_init(&store->lock);
+    mutex_init(&store->io_lock);
+    cond_init(&store->commit_wanted);
+    cond_init(&store->committed);
+
+    #ifdef _WIN32
+    store->commit_thread = CreateThread(NULL, 0, commit_main, store, 0, NULL);
+    store->running = store->commit_thread != NULL;
+    #else
+    store->running = pthread_create(&store->commit_thread, NULL, commit_main, store) == 0;
+    #endif
+    if (!store->running) {
+        printf("Failed to start message commit thread\n");
+        free(store->staged);
+        free(store->spare);
+        close_fd(store->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Commit everything still staged and stop the commit thread
+void msgstore_close(MsgStore* store) {
+    if (!store->running) return;
+
+    mutex_lock(&store->lock);
+    store->stopping = true;
+    cond_signal(&store->commit_wanted);
+    mutex_unlock(&store->lock);
+
+    #ifdef _WIN32
+    WaitForSingleObject(store->commit_thread, INFINITE);
+    CloseHandle(store->commit_thread);
+    #else
+    pthread_join(store->commit_thread, NULL);
+    #endif
+    store->running = false;
+
+    sync_fd(store->fd);
+    close_fd(store->fd);
+    free(store->staged);
+    free(store->spare);
+    store->staged = store->spare = NULL;
+}
+
+// Append a message. Its id and location are stored through the optional
+// out pointers. Returns 0 once the record is accepted (and, with
+// MSGSTORE_DURABILITY_SYNC, synced), -1 on failure.
+int msgstore_append(MsgStore* store, const char* sender, const char* recipient,
+                    const char* content, MessageType type, uint8_t flags,
+                    uint64_t* id_out, MsgLocation* location_out) {
+    size_t sender_len = strnlen(sender, MAX_USERNAME - 1);
+    size_t recipient_len = strnlen(recipient, MAX_USERNAME - 1);
+    size_t content_len = strlen(content);
+    size_t record_len = MSGSTORE_HEADER_SIZE + sender_len + recipient_len + content_len;
+    if (record_len > store->staged_capacity) return -1;
+
+    mutex_lock(&store->lock);
+    if (store->stopping) {
+        mutex_unlock(&store->lock);
+        return -1;
+    }
+
+    if (store->segment_size > 0 && store->segment_size + (long)record_len > store->config.segment_bytes &&
+        roll_segment_locked(store) < 0) {
+        mutex_unlock(&store->lock);
+        return -1;
+    }
+    if (store->staged_len + record_len > store->staged_capacity) {
+        write_staged_locked(store);
+    }
+
+    uint64_t id = msgid_next(&store->ids);
+    unsigned char* record = (unsigned char*)store->staged + store->staged_len;
+    put_le32(record, MSGSTORE_MAGIC);
+    put_le64(record + 8, id);
+    put_le64(record + 16, (uint64_t)(int64_t)time(NULL));
+    record[24] = flags;
+    record[25] = (unsigned char)type;
+    record[26] = (unsigned char)sender_len;
+    record[27] = (unsigned char)recipient_len;
+    put_le32(record + 28, (uint32_t)content_len);
+    char* payload = (char*)record + MSGSTORE_HEADER_SIZE;
+    memcpy(payload, sender, sender_len);
+    memcpy(payload + sender_len, recipient, recipient_len);
+    memcpy(payload + sender_len + recipient_len, content, content_len);
+    uint32_t crc = crc32_update(0, record + 8, MSGSTORE_HEADER_SIZE - 8);
+    put_le32(record + 4, crc32_update(crc, payload, record_len - MSGSTORE_HEADER_SIZE));
+
+    if (location_out) {
+        location_out->segment = store->segment;
+        location_out->offset = (uint32_t)store->segment_size;
+    }
+    if (id_out) {
+        *id_out = id;
+    }
+    store->staged_len += record_len;
+    store->segment_size += (long)record_len;
+    uint64_t seq = ++store->appended_seq;
+
+    if (store->config.durability == MSGSTORE_DURABILITY_SYNC) {
+        store->sync_waiters++;
+        cond_signal(&store->commit_wanted);
+        while (store->durable_seq < seq) {
+            cond_wait(&store->committed, &store->lock);
+        }
+        store->sync_waiters--;
+    }
+    mutex_unlock(&store->lock);
+    return 0;
+}
+
+// Visit every record in append order. Staged records are written out first
+// so the scan sees all messages appended before the call.
+int msgstore_scan(MsgStore* store, MsgStoreVisitor visitor, void* ctx) {
+    mutex_lock(&store->lock);
+    write_staged_locked(store);
+    uint32_t last_segment = store->segment;
+    long last_size = store->segment_size;
+    mutex_unlock(&store->lock);
+
+    /* wait for a batch the commit thread may still be writing */
+    mutex_lock(&store->io_lock);
+    mutex_unlock(&store->io_lock);
+
+    for (uint32_t segment = 1; segment <= last_segment; segment++) {
+        long valid_end;
+        long limit = segment == last_segment ? last_size : file_size(store, segment);
+        if (scan_segment(store, segment, limit, visitor, ctx, &valid_end)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Read the record at location into msg. Its content is copied into
+// buffer (truncated to capacity). Returns 0 on success, -1 if there is no
+// valid record at location.
+int msgstore_read(MsgStore* store, MsgLocation location, StoredMessage* msg,
+                  char* buffer, size_t capacity) {
+    /* a recent record may still be staged or in the commit thread's batch */
+    mutex_lock(&store->lock);
+    bool pending = location.segment == store->segment && (long)location.offset >= store->written_size;
+    if (pending) {
+        write_staged_locked(store);
+    }
+    long limit = location.segment == store->segment ? store->segment_size : -1;
+    mutex_unlock(&store->lock);
+    if (pending) {
+        mutex_lock(&store->io_lock);
+        mutex_unlock(&store->io_lock);
+    }
+
+    char path[300];
+    segment_path(store, location.segment, path, sizeof(path));
+    if (limit < 0) {
+        limit = file_size(store, location.segment);
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (!file) return -1;
+    if (fseek(file, (long)location.offset, SEEK_SET) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    char* payload = NULL;
+    size_t payload_capacity = 0;
+    long size = read_record(file, limit - (long)location.offset, &payload, &payload_capacity, msg);
+    fclose(file);
+    if (size < 0) {
+        free(payload);
+        return -1;
+    }
+
+    size_t len = (size_t)msg->content_len < capacity ? (size_t)msg->content_len : capacity - 1;
+    memcpy(buffer, msg->content, len);
+    buffer[len] = '\0';
+    msg->content = buffer;
+    msg->content_len = (int)len;
+    free(payload);
+    return 0;
+}
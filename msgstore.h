@@ -0,0 +1,97 @@
+#ifndef MSGSTORE_H
+#define MSGSTORE_H
+
+#include "common.h"
+
+// Append-only message log split into numbered segment files
+// (<dir>/00000001.wal, 00000002.wal, ...). Every record is a fixed header
+// followed by the sender, recipient and content bytes:
+//
+//   u32 magic   u32 crc32   u64 id   i64 timestamp
+//   u8 flags    u8 type     u8 sender_len   u8 recipient_len   u32 content_len
+//
+// Integers are little-endian and the crc covers everything after the crc
+// field. Appends are staged in memory and a commit thread writes (and, by
+// durability level, syncs) them in batches. On open the segments are
+// verified and a torn record at the end of the last one is cut off.
+
+#define MSGSTORE_HEADER_SIZE 32
+#define MSGSTORE_FLAG_GROUP  0x01  // Recipient is a group id
+#define MSGSTORE_FLAG_PINNED 0x02
+
+typedef enum {
+    MSGSTORE_DURABILITY_NONE = 0,   // Written out by the commit thread, never synced
+    MSGSTORE_DURABILITY_BATCH = 1,  // Synced once per commit interval
+    MSGSTORE_DURABILITY_SYNC = 2    // msgstore_append() waits until its record is synced
+} MsgStoreDurability;
+
+typedef struct {
+    const char* dir;
+    long segment_bytes;         // Start a new segment once this size is reached
+    int commit_interval_ms;     // Longest a record is staged in memory
+    MsgStoreDurability durability;
+    uint32_t node_id;           // Node field of the ids this store assigns
+} MsgStoreConfig;
+
+// Where a record lives: segment number and byte offset of its header
+typedef struct {
+    uint32_t segment;
+    uint32_t offset;
+} MsgLocation;
+
+// A record as seen by msgstore_scan() or msgstore_read(). During a scan
+// content points into the scanner's buffer and is only valid during the
+// callback; msgstore_read() copies it into the caller's buffer.
+typedef struct {
+    uint64_t id;
+    time_t timestamp;
+    uint8_t flags;
+    MessageType type;
+    char sender[MAX_USERNAME];
+    char recipient[MAX_USERNAME];
+    const char* content;
+    int content_len;
+} StoredMessage;
+
+// Return false to stop the scan
+typedef bool (*MsgStoreVisitor)(void* ctx, const StoredMessage* msg, MsgLocation location);
+
+typedef struct {
+    MsgStoreConfig config;
+    char dir[256];
+    mutex_t lock;            // Staging buffer, sequence numbers, current segment
+    mutex_t io_lock;         // Writes to the segment file (taken after lock)
+    cond_t commit_wanted;    // Wakes the commit thread early
+    cond_t committed;        // Signalled when durable_seq advances
+    int fd;
+    uint32_t segment;        // Segment being appended to
+    long segment_size;       // Its size including staged bytes
+    long written_size;       // Bytes of it already handed to the file
+    char* staged;            // Records not yet handed to the file
+    size_t staged_len;
+    size_t staged_capacity;
+    char* spare;             // Second buffer swapped in by the commit thread
+    MsgIdGenerator ids;      // Assigns record ids, under lock
+    uint64_t appended_seq;   // Records accepted so far
+    uint64_t durable_seq;    // Records written (and synced, by durability)
+    int sync_waiters;        // Appends blocked in MSGSTORE_DURABILITY_SYNC
+    bool stopping;
+    bool running;
+    #ifdef _WIN32
+    HANDLE commit_thread;
+    #else
+    pthread_t commit_thread;
+    #endif
+} MsgStore;
+
+void msgstore_config_defaults(MsgStoreConfig* config);
+int msgstore_open(MsgStore* store, const MsgStoreConfig* config);
+void msgstore_close(MsgStore* store);
+int msgstore_append(MsgStore* store, const char* sender, const char* recipient,
+                    const char* content, MessageType type, uint8_t flags,
+                    uint64_t* id_out, MsgLocation* location_out);
+int msgstore_scan(MsgStore* store, MsgStoreVisitor visitor, void* ctx);
+int msgstore_read(MsgStore* store, MsgLocation location, StoredMessage* msg,
+                  char* buffer, size_t capacity);
+
+#endif // MSGSTORE_H
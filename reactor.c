@@ -0,0 +1,305 @@
+#include "reactor.h"
+#include "metrics.h"
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+
+#define MAX_EVENTS 256
+
+// Events a connection is (re)armed with. EPOLLONESHOT guarantees that only
+// one worker services a given connection at a time.
+#define CONNECTION_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+typedef struct {
+    int epoll_fd;
+    socket_t listen_socket;
+    ServerState* state;
+    // Connections with pending input, waiting for a worker
+    mutex_t lock;
+    cond_t ready;
+    Connection* head;
+    Connection* tail;
+} Reactor;
+
+static Reactor reactor;
+
+int default_worker_count(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Allow as many open descriptors as the hard limit permits
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void push_ready(Connection* conn) {
+    mutex_lock(&reactor.lock);
+    conn->next = NULL;
+    conn->ready_at = metrics_timestamp();
+    if (reactor.tail) {
+        reactor.tail->next = conn;
+    } else {
+        reactor.head = conn;
+    }
+    reactor.tail = conn;
+    cond_signal(&reactor.ready);
+    mutex_unlock(&reactor.lock);
+}
+
+// Take the oldest ready connection; *ready_at is when it was queued
+static Connection* pop_ready(uint64_t* ready_at) {
+    mutex_lock(&reactor.lock);
+    while (!reactor.head) {
+        cond_wait(&reactor.ready, &reactor.lock);
+    }
+    Connection* conn = reactor.head;
+    *ready_at = conn->ready_at;
+    reactor.head = conn->next;
+    if (!reactor.head) {
+        reactor.tail = NULL;
+    }
+    mutex_unlock(&reactor.lock);
+    return conn;
+}
+
+// Hand a serviced connection back to epoll for its next readiness event
+static int rearm(Connection* conn) {
+    struct epoll_event ev;
+    ev.events = CONNECTION_EVENTS;
+    ev.data.ptr = conn;
+    return epoll_ctl(reactor.epoll_fd, EPOLL_CTL_MOD, conn->client_socket, &ev);
+}
+
+// Read and execute commands until the socket would block. Returns false
+// once the connection should be closed. buffer holds RECV_CHUNK_SIZE + 1
+// bytes and is shared by every connection this worker services.
+static bool service_connection(Connection* conn, char* buffer) {
+    while (1) {
+        int bytes_received = recv(conn->client_socket, buffer, RECV_CHUNK_SIZE, 0);
+        if (bytes_received == 0) {
+            return false;
+        }
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        if (!process_input(conn, buffer, bytes_received)) {
+            return false;
+        }
+    }
+}
+
+static void* worker_main(void* arg) {
+    (void)arg;
+    char buffer[RECV_CHUNK_SIZE + 1];
+
+    while (1) {
+        uint64_t ready_at;
+        Connection* conn = pop_ready(&ready_at);
+        metrics_queue_wait(ready_at);
+        if (!service_connection(conn, buffer) || rearm(conn) < 0) {
+            /* the last reference closes the socket, which also removes it
+               from the epoll set */
+            connection_close(conn);
+        }
+    }
+    return NULL;
+}
+
+// Accept every pending connection on the (nonblocking) listening socket
+static void accept_connections(void) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        socket_t client_socket = accept4(reactor.listen_socket, (struct sockaddr*)&client_addr,
+                                         &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == INVALID_SOCKET) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        Connection* conn = connection_create(reactor.state, client_socket, &client_addr);
+        if (!conn) {
+            close_socket(client_socket);
+            continue;
+        }
+        printf("Client connected\n");
+
+        struct epoll_event ev;
+        ev.events = CONNECTION_EVENTS;
+        ev.data.ptr = conn;
+        if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            printf("epoll_ctl failed: %s\n", strerror(errno));
+            connection_close(conn);
+        }
+    }
+}
+
+// Sockets with queued output are watched by a second epoll set, armed
+// one-shot whenever a connection's queue is left non-empty
+static int writer_epoll_fd = -1;
+
+int outbound_writer_watch(Connection* conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(writer_epoll_fd, EPOLL_CTL_MOD, conn->client_socket, &ev) == 0) {
+        return 0;
+    }
+    /* first time this socket is watched */
+    if (errno == ENOENT && epoll_ctl(writer_epoll_fd, EPOLL_CTL_ADD, conn->client_socket, &ev) == 0) {
+        return 0;
+    }
+    printf("Failed to watch connection for output: %s\n", strerror(errno));
+    return -1;
+}
+
+static void* writer_main(void* arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int count = epoll_wait(writer_epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno != EINTR) {
+                printf("epoll_wait failed: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            Connection* conn = (Connection*)events[i].data.ptr;
+            if (!connection_flush(conn)) {
+                connection_release(conn);  // reference taken when watched
+            }
+        }
+    }
+    return NULL;
+}
+
+int outbound_writer_start(void) {
+    writer_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (writer_epoll_fd < 0) {
+        printf("epoll_create1 failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_main, NULL) != 0) {
+        close(writer_epoll_fd);
+        writer_epoll_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int run_reactor(socket_t server_socket, ServerState* state, int worker_count) {
+    raise_fd_limit();
+
+    if (set_nonblocking(server_socket) < 0) {
+        printf("Failed to make listening socket nonblocking: %s\n", strerror(errno));
+        return -1;
+    }
+
+    reactor.listen_socket = server_socket;
+    reactor.state = state;
+    reactor.head = reactor.tail = NULL;
+    mutex_init(&reactor.lock);
+    cond_init(&reactor.ready);
+
+    reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epoll_fd < 0) {
+        printf("epoll_create1 failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* the listening socket is tagged with a NULL connection pointer */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        printf("epoll_ctl failed: %s\n", strerror(errno));
+        close(reactor.epoll_fd);
+        return -1;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0) {
+            printf("Failed to start worker %d\n", i);
+            if (i == 0) {
+                close(reactor.epoll_fd);
+                return -1;
+            }
+            break;
+        }
+        pthread_detach(thread);
+    }
+
+    printf("Waiting for clients...\n");
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int count = epoll_wait(reactor.epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            printf("epoll_wait failed: %s\n", strerror(errno));
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            Connection* conn = (Connection*)events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections();
+            } else {
+                push_ready(conn);
+            }
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+int default_worker_count(void) {
+    return 1;
+}
+
+int outbound_writer_start(void) {
+    return 0;
+}
+
+int outbound_writer_watch(Connection* conn) {
+    (void)conn;
+    return -1;
+}
+
+int run_reactor(socket_t server_socket, ServerState* state, int worker_count) {
+    (void)server_socket;
+    (void)state;
+    (void)worker_count;
+    printf("epoll mode is only supported on Linux\n");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "server.h"
+
+// Epoll-based event loop: one thread waits for socket readiness and hands
+// ready connections to a fixed pool of worker threads that run commands.
+
+// Number of workers to use when none is configured (one per online core)
+int default_worker_count(void);
+
+// Serve connections on server_socket until the process exits. Only returns
+// (with -1) if the event loop cannot be started, e.g. on non-Linux builds.
+int run_reactor(socket_t server_socket, ServerState* state, int worker_count);
+
+// Outbound writer, used in both server modes: one thread waits until
+// sockets with queued output turn writable and drains them with
+// connection_flush(). Returns -1 if the thread cannot be started.
+int outbound_writer_start(void);
+
+// Wake the outbound writer when conn's socket is writable again. Called
+// with conn->send_lock held and a reference owned by the writer. Returns
+// -1 where there is no writer (Windows sockets are written blocking).
+int outbound_writer_watch(Connection* conn);
+
+#endif // REACTOR_H
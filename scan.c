@@ -0,0 +1,167 @@
+#include "scan.h"
+#include <stdatomic.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static atomic_int current_level = -1;
+
+static ScanLevel detect_level(void) {
+    #ifdef SCAN_X86
+    __builtin_cpu_init();
+    // Also false when the OS does not save the AVX registers
+    if (__builtin_cpu_supports("avx2")) return SCAN_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SCAN_SSE2;
+    #endif
+    return SCAN_SCALAR;
+}
+
+ScanLevel scan_level(void) {
+    int level = atomic_load_explicit(&current_level, memory_order_relaxed);
+    if (level < 0) {
+        /* racing threads detect the same answer */
+        level = (int)detect_level();
+        atomic_store_explicit(&current_level, level, memory_order_relaxed);
+    }
+    return (ScanLevel)level;
+}
+
+ScanLevel scan_set_level(ScanLevel level) {
+    ScanLevel best = detect_level();
+    if (level > best) level = best;
+    atomic_store_explicit(&current_level, (int)level, memory_order_relaxed);
+    return level;
+}
+
+const char* scan_level_name(ScanLevel level) {
+    switch (level) {
+        case SCAN_SSE2: return "sse2";
+        case SCAN_AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+// --- Portable versions, which also finish off the vector ones ---
+
+static int split_scalar(const char* data, int len, char c, int* positions, int max, int count, int i) {
+    for (; i < len && count < max; i++) {
+        if (data[i] == c) positions[count++] = i;
+    }
+    return count;
+}
+
+static int find_scalar(const char* data, int len, const char* needle, int needle_len, int i) {
+    for (; i + needle_len <= len; i++) {
+        if (data[i] == needle[0] && memcmp(data + i + 1, needle + 1, (size_t)needle_len - 1) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef SCAN_X86
+// Each set bit of mask is a match at offset base + bit
+static int take_matches(unsigned mask, int base, int* positions, int max, int count) {
+    while (mask && count < max) {
+        positions[count++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+TARGET_SSE2 static int split_sse2(const char* data, int len, char c, int* positions, int max) {
+    __m128i target = _mm_set1_epi8(c);
+    int count = 0;
+    int i = 0;
+    for (; i + 16 <= len && count < max; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, target));
+        count = take_matches(mask, i, positions, max, count);
+    }
+    return split_scalar(data, len, c, positions, max, count, i);
+}
+
+TARGET_AVX2 static int split_avx2(const char* data, int len, char c, int* positions, int max) {
+    __m256i target = _mm256_set1_epi8(c);
+    int count = 0;
+    int i = 0;
+    for (; i + 32 <= len && count < max; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(data + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, target));
+        count = take_matches(mask, i, positions, max, count);
+    }
+    return split_scalar(data, len, c, positions, max, count, i);
+}
+
+/* Substring search compares the first and the last byte of the needle at
+   every offset of a block at once; only offsets where both match are
+   checked in full. */
+
+// First offset in mask whose remaining needle bytes match, or -1
+static int verify_candidates(unsigned mask, const char* block, const char* needle, int needle_len) {
+    while (mask) {
+        int bit = __builtin_ctz(mask);
+        if (memcmp(block + bit + 1, needle + 1, (size_t)needle_len - 1) == 0) return bit;
+        mask &= mask - 1;
+    }
+    return -1;
+}
+
+TARGET_SSE2 static int find_sse2(const char* data, int len, const char* needle, int needle_len) {
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    int i = 0;
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i*)(data + i + needle_len - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        int bit = verify_candidates(mask, data + i, needle, needle_len);
+        if (bit >= 0) return i + bit;
+    }
+    return find_scalar(data, len, needle, needle_len, i);
+}
+
+TARGET_AVX2 static int find_avx2(const char* data, int len, const char* needle, int needle_len) {
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    int i = 0;
+    for (; i + needle_len - 1 + 32 <= len; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i*)(data + i + needle_len - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        int bit = verify_candidates(mask, data + i, needle, needle_len);
+        if (bit >= 0) return i + bit;
+    }
+    return find_scalar(data, len, needle, needle_len, i);
+}
+#endif
+
+int scan_split(const char* data, int len, char c, int* positions, int max) {
+    #ifdef SCAN_X86
+    switch (scan_level()) {
+        case SCAN_AVX2: return split_avx2(data, len, c, positions, max);
+        case SCAN_SSE2: return split_sse2(data, len, c, positions, max);
+        default: break;
+    }
+    #endif
+    return split_scalar(data, len, c, positions, max, 0, 0);
+}
+
+int scan_find(const char* data, int len, const char* needle, int needle_len) {
+    if (needle_len <= 0) return 0;
+    #ifdef SCAN_X86
+    switch (scan_level()) {
+        case SCAN_AVX2: return find_avx2(data, len, needle, needle_len);
+        case SCAN_SSE2: return find_sse2(data, len, needle, needle_len);
+        default: break;
+    }
+    #endif
+    return find_scalar(data, len, needle, needle_len, 0);
+}
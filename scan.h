@@ -0,0 +1,32 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// Byte scanning for the text protocol: splitting a frame at its '|'
+// delimiters and finding where a frame ends. On x86 the scanners compare
+// 16 (SSE2) or 32 (AVX2) bytes per step, using the widest the CPU supports;
+// the choice is made once, at the first scan. Other targets and compilers
+// use a portable byte-at-a-time version. All versions give the same results.
+
+typedef enum {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+} ScanLevel;
+
+// Level in use
+ScanLevel scan_level(void);
+
+// Use level, or the best the CPU supports if that is lower. Returns the
+// level now in use. For benchmarks; the server never calls it.
+ScanLevel scan_set_level(ScanLevel level);
+
+const char* scan_level_name(ScanLevel level);
+
+// Store the offsets of the first max occurrences of c in data[0..len) in
+// positions, in order. Returns how many were stored.
+int scan_split(const char* data, int len, char c, int* positions, int max);
+
+// Offset of the first occurrence of needle in data[0..len), or -1
+int scan_find(const char* data, int len, const char* needle, int needle_len);
+
+#endif // SCAN_H
@@ -0,0 +1,412 @@
+#include "search_index.h"
+
+// Distinct terms indexed per message; the rest of a very long message is
+// still stored, just not searchable
+#define MAX_DOC_TERMS 256
+#define TERM_STRINGS_CHUNK 65536
+
+// Conversation keys: a group id, or two usernames joined by a separator
+// that cannot appear in a protocol field
+#define GROUP_KEY_PREFIX '\x1e'
+#define PAIR_KEY_SEPARATOR '\x1f'
+
+static bool is_term_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Split text into distinct lowercase terms, each cut to SEARCH_MAX_TERM
+// bytes. Returns how many were stored (at most max).
+static int tokenize(const char* text, char terms[][SEARCH_MAX_TERM + 1], int max) {
+    int count = 0;
+    const unsigned char* p = (const unsigned char*)text;
+
+    while (*p && count < max) {
+        while (*p && !is_term_char(*p)) p++;
+        if (!*p) break;
+
+        char* term = terms[count];
+        int len = 0;
+        while (*p && is_term_char(*p)) {
+            if (len < SEARCH_MAX_TERM) {
+                term[len++] = (char)((*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p);
+            }
+            p++;
+        }
+        term[len] = '\0';
+
+        bool duplicate = false;
+        for (int i = 0; i < count && !duplicate; i++) {
+            duplicate = strcmp(terms[i], term) == 0;
+        }
+        if (!duplicate) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void pair_key(char* key, size_t size, const char* a, const char* b) {
+    if (strcmp(a, b) > 0) {
+        const char* t = a;
+        a = b;
+        b = t;
+    }
+    snprintf(key, size, "%s%c%s", a, PAIR_KEY_SEPARATOR, b);
+}
+
+static void group_key(char* key, size_t size, const char* group_id) {
+    snprintf(key, size, "%c%s", GROUP_KEY_PREFIX, group_id);
+}
+
+static const char* conv_key_of(void* ctx, int32_t id) {
+    SearchIndex* index = (SearchIndex*)ctx;
+    return ((SearchConv*)slab_get(&index->convs, (uint32_t)id))->key;
+}
+
+static const char* term_key_of(void* ctx, int32_t id) {
+    SearchIndex* index = (SearchIndex*)ctx;
+    return ((SearchTerm*)slab_get(&index->terms, (uint32_t)id))->text;
+}
+
+int search_index_init(SearchIndex* index) {
+    rwlock_init(&index->lock);
+    slab_init(&index->docs, sizeof(SearchDoc));
+    slab_init(&index->convs, sizeof(SearchConv));
+    slab_init(&index->terms, sizeof(SearchTerm));
+    arena_init(&index->strings, TERM_STRINGS_CHUNK);
+    if (hash_index_init(&index->conv_index, 1024, conv_key_of, index) < 0) {
+        return -1;
+    }
+    if (hash_index_init(&index->term_index, 16384, term_key_of, index) < 0) {
+        hash_index_free(&index->conv_index);
+        return -1;
+    }
+    return 0;
+}
+
+void search_index_free(SearchIndex* index) {
+    for (uint32_t i = 0; i < index->terms.count; i++) {
+        free(((SearchTerm*)slab_get(&index->terms, i))->postings.docs);
+    }
+    for (uint32_t i = 0; i < index->convs.count; i++) {
+        SearchConv* conv = (SearchConv*)slab_get(&index->convs, i);
+        free(conv->postings.docs);
+        free(conv->by_id.docs);
+    }
+    hash_index_free(&index->conv_index);
+    hash_index_free(&index->term_index);
+    slab_free(&index->docs);
+    slab_free(&index->convs);
+    slab_free(&index->terms);
+    arena_free(&index->strings);
+}
+
+// Caller holds the write lock. Returns the conversation id or -1.
+static int32_t find_or_add_conv(SearchIndex* index, const char* sender, const char* recipient, bool is_group) {
+    char key[sizeof(((SearchConv*)0)->key)];
+    if (is_group) {
+        group_key(key, sizeof(key), recipient);
+    } else {
+        pair_key(key, sizeof(key), sender, recipient);
+    }
+
+    int32_t id = hash_index_find(&index->conv_index, key);
+    if (id != INDEX_EMPTY) return id;
+
+    uint32_t new_id;
+    SearchConv* conv = (SearchConv*)slab_append(&index->convs, &new_id);
+    if (!conv) return -1;
+    strcpy(conv->key, key);
+    conv->is_group = is_group;
+    if (!is_group) {
+        bool ordered = strcmp(sender, recipient) <= 0;
+        strncpy(conv->user_a, ordered ? sender : recipient, MAX_USERNAME - 1);
+        strncpy(conv->user_b, ordered ? recipient : sender, MAX_USERNAME - 1);
+    }
+    if (hash_index_insert(&index->conv_index, conv->key, (int32_t)new_id) < 0) return -1;
+    return (int32_t)new_id;
+}
+
+static int posting_append(PostingList* list, uint32_t doc) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 4;
+        uint32_t* docs = (uint32_t*)realloc(list->docs, capacity * sizeof(uint32_t));
+        if (!docs) return -1;
+        list->docs = docs;
+        list->capacity = capacity;
+    }
+    list->docs[list->count++] = doc;
+    return 0;
+}
+
+static uint64_t doc_msg_id(const SearchIndex* index, uint32_t doc) {
+    return ((const SearchDoc*)slab_get(&index->docs, doc))->msg_id;
+}
+
+// Add doc to a list ordered by message id. Messages are indexed about in
+// id order, so the insertion point is found walking back from the end.
+static int by_id_insert(SearchIndex* index, PostingList* list, uint32_t doc) {
+    if (posting_append(list, doc) < 0) return -1;
+    uint64_t msg_id = doc_msg_id(index, doc);
+    uint32_t i = list->count - 1;
+    while (i > 0 && doc_msg_id(index, list->docs[i - 1]) > msg_id) {
+        list->docs[i] = list->docs[i - 1];
+        i--;
+    }
+    list->docs[i] = doc;
+    return 0;
+}
+
+// Caller holds the write lock
+static int add_posting(SearchIndex* index, const char* text, uint32_t doc) {
+    int32_t id = hash_index_find(&index->term_index, text);
+    SearchTerm* term;
+
+    if (id == INDEX_EMPTY) {
+        uint32_t new_id;
+        term = (SearchTerm*)slab_append(&index->terms, &new_id);
+        if (!term) return -1;
+        term->text = arena_strndup(&index->strings, text, strlen(text));
+        if (!term->text || hash_index_insert(&index->term_index, term->text, (int32_t)new_id) < 0) {
+            return -1;
+        }
+    } else {
+        term = (SearchTerm*)slab_get(&index->terms, (uint32_t)id);
+    }
+
+    return posting_append(&term->postings, doc);
+}
+
+// Index one stored message. Returns -1 if memory runs out.
+int search_index_add(SearchIndex* index, const char* sender, const char* recipient, bool is_group,
+                     const char* content, uint64_t msg_id, MsgLocation location) {
+    char terms[MAX_DOC_TERMS][SEARCH_MAX_TERM + 1];
+    int term_count = tokenize(content, terms, MAX_DOC_TERMS);
+    int rc = 0;
+
+    rwlock_wrlock(&index->lock);
+    int32_t conv = find_or_add_conv(index, sender, recipient, is_group);
+    uint32_t doc_number;
+    SearchDoc* doc = conv < 0 ? NULL : (SearchDoc*)slab_append(&index->docs, &doc_number);
+    if (doc) {
+        doc->msg_id = msg_id;
+        doc->location = location;
+        doc->conv = (uint32_t)conv;
+        SearchConv* search_conv = (SearchConv*)slab_get(&index->convs, (uint32_t)conv);
+        rc = posting_append(&search_conv->postings, doc_number);
+        if (rc == 0 && is_group) {
+            rc = by_id_insert(index, &search_conv->by_id, doc_number);
+        }
+        for (int i = 0; i < term_count && rc == 0; i++) {
+            rc = add_posting(index, terms[i], doc_number);
+        }
+    } else {
+        rc = -1;
+    }
+    rwlock_wrunlock(&index->lock);
+    return rc;
+}
+
+// Index of the first posting >= doc
+static uint32_t lower_bound(const PostingList* list, uint32_t doc) {
+    uint32_t lo = 0, hi = list->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (list->docs[mid] < doc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool posting_contains(const PostingList* list, uint32_t doc) {
+    uint32_t i = lower_bound(list, doc);
+    return i < list->count && list->docs[i] == doc;
+}
+
+// Find up to query->limit messages containing every term of text, newest
+// first, in conversations the user can see. Stores a cursor for the next
+// page in next_cursor (0 when there are no more). Returns the hit count.
+int search_index_query(SearchIndex* index, const char* text, const SearchQuery* query,
+                       SearchDoc* hits, uint32_t* next_cursor) {
+    char words[SEARCH_MAX_QUERY_TERMS][SEARCH_MAX_TERM + 1];
+    int word_count = tokenize(text, words, SEARCH_MAX_QUERY_TERMS);
+    *next_cursor = 0;
+    if (word_count == 0 || query->limit <= 0) return 0;
+
+    rwlock_rdlock(&index->lock);
+
+    // Resolve every term; a term that was never seen means no matches
+    const PostingList* lists[SEARCH_MAX_QUERY_TERMS + 1];
+    int list_count = 0;
+    for (int i = 0; i < word_count; i++) {
+        int32_t id = hash_index_find(&index->term_index, words[i]);
+        if (id == INDEX_EMPTY) {
+            rwlock_rdunlock(&index->lock);
+            return 0;
+        }
+        lists[list_count++] = &((SearchTerm*)slab_get(&index->terms, (uint32_t)id))->postings;
+    }
+
+    // Narrow to the conversation with a peer (a user or a group) if given
+    int32_t allowed[2];
+    int allowed_count = -1;
+    if (query->peer && query->peer[0] != '\0') {
+        char key[sizeof(((SearchConv*)0)->key)];
+        allowed_count = 0;
+        pair_key(key, sizeof(key), query->username, query->peer);
+        allowed[allowed_count] = hash_index_find(&index->conv_index, key);
+        if (allowed[allowed_count] != INDEX_EMPTY) allowed_count++;
+        group_key(key, sizeof(key), query->peer);
+        allowed[allowed_count] = hash_index_find(&index->conv_index, key);
+        if (allowed[allowed_count] != INDEX_EMPTY) allowed_count++;
+
+        /* a single conversation intersects like one more term */
+        if (allowed_count == 1) {
+            lists[list_count++] = &((SearchConv*)slab_get(&index->convs, (uint32_t)allowed[0]))->postings;
+        }
+    }
+
+    // Walk the shortest posting list and probe the others
+    for (int i = 1; i < list_count; i++) {
+        for (int j = i; j > 0 && lists[j]->count < lists[j - 1]->count; j--) {
+            const PostingList* t = lists[j];
+            lists[j] = lists[j - 1];
+            lists[j - 1] = t;
+        }
+    }
+
+    // Group visibility asked of the caller, remembered for this query
+    struct { uint32_t conv; bool visible; } seen[32];
+    int seen_count = 0;
+
+    const PostingList* rarest = lists[0];
+    uint32_t end = query->before ? lower_bound(rarest, query->before) : rarest->count;
+    uint32_t last_hit = 0;
+    int found = 0;
+
+    for (uint32_t i = end; i-- > 0 && allowed_count != 0; ) {
+        uint32_t doc_number = rarest->docs[i];
+        bool match = true;
+        for (int t = 1; t < list_count && match; t++) {
+            match = posting_contains(lists[t], doc_number);
+        }
+        if (!match) continue;
+
+        const SearchDoc* doc = (const SearchDoc*)slab_get(&index->docs, doc_number);
+        if (allowed_count > 1) {
+            bool in_scope = false;
+            for (int a = 0; a < allowed_count; a++) {
+                in_scope = in_scope || (uint32_t)allowed[a] == doc->conv;
+            }
+            if (!in_scope) continue;
+        }
+
+        const SearchConv* conv = (const SearchConv*)slab_get(&index->convs, doc->conv);
+        bool visible;
+        if (!conv->is_group) {
+            visible = strcmp(conv->user_a, query->username) == 0 || strcmp(conv->user_b, query->username) == 0;
+        } else {
+            int s = 0;
+            while (s < seen_count && seen[s].conv != doc->conv) s++;
+            if (s < seen_count) {
+                visible = seen[s].visible;
+            } else {
+                visible = query->group_visible && query->group_visible(query->ctx, conv->key + 1);
+                if (seen_count < (int)(sizeof(seen) / sizeof(seen[0]))) {
+                    seen[seen_count].conv = doc->conv;
+                    seen[seen_count].visible = visible;
+                    seen_count++;
+                }
+            }
+        }
+        if (!visible) continue;
+
+        if (found == query->limit) {
+            /* one more match exists: the next page starts below the last hit */
+            *next_cursor = last_hit;
+            break;
+        }
+        hits[found++] = *doc;
+        last_hit = doc_number;
+    }
+
+    rwlock_rdunlock(&index->lock);
+    return found;
+}
+
+// Index of the first entry of a by_id list with a message id >= msg_id
+static uint32_t id_lower_bound(const SearchIndex* index, const PostingList* list, uint64_t msg_id) {
+    uint32_t lo = 0, hi = list->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (doc_msg_id(index, list->docs[mid]) < msg_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// A group's by_id list, or NULL. Caller holds the lock.
+static const PostingList* group_by_id(SearchIndex* index, const char* group_id) {
+    char key[sizeof(((SearchConv*)0)->key)];
+    group_key(key, sizeof(key), group_id);
+    int32_t conv = hash_index_find(&index->conv_index, key);
+    if (conv == INDEX_EMPTY) return NULL;
+    return &((SearchConv*)slab_get(&index->convs, (uint32_t)conv))->by_id;
+}
+
+// Up to limit documents of a group's conversation, oldest first: the
+// newest ones with a message id below cursor, or with newer set, the
+// oldest ones above it. *more is set if the conversation has documents
+// beyond the page. Returns the count.
+int search_index_group_history(SearchIndex* index, const char* group_id, uint64_t cursor, bool newer, int limit,
+                               SearchDoc* docs, bool* more) {
+    *more = false;
+    if (limit <= 0) return 0;
+
+    rwlock_rdlock(&index->lock);
+    const PostingList* list = group_by_id(index, group_id);
+    if (!list) {
+        rwlock_rdunlock(&index->lock);
+        return 0;
+    }
+
+    uint32_t first, last;
+    if (newer) {
+        first = cursor == UINT64_MAX ? list->count : id_lower_bound(index, list, cursor + 1);
+        last = list->count - first > (uint32_t)limit ? first + (uint32_t)limit : list->count;
+        *more = last < list->count;
+    } else {
+        last = id_lower_bound(index, list, cursor);
+        first = last > (uint32_t)limit ? last - (uint32_t)limit : 0;
+        *more = first > 0;
+    }
+
+    int count = 0;
+    for (uint32_t i = first; i < last; i++) {
+        docs[count++] = *(const SearchDoc*)slab_get(&index->docs, list->docs[i]);
+    }
+    rwlock_rdunlock(&index->lock);
+    return count;
+}
+
+// Find a group message by id. Returns false if the group has no such message.
+bool search_index_find_group_message(SearchIndex* index, const char* group_id, uint64_t msg_id, SearchDoc* doc) {
+    bool found = false;
+    rwlock_rdlock(&index->lock);
+    const PostingList* list = group_by_id(index, group_id);
+    if (list) {
+        uint32_t i = id_lower_bound(index, list, msg_id);
+        if (i < list->count && doc_msg_id(index, list->docs[i]) == msg_id) {
+            *doc = *(const SearchDoc*)slab_get(&index->docs, list->docs[i]);
+            found = true;
+        }
+    }
+    rwlock_rdunlock(&index->lock);
+    return found;
+}
@@ -0,0 +1,80 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include "common.h"
+#include "hash_index.h"
+#include "msgstore.h"
+
+// In-memory inverted index over stored messages. Message content is split
+// into lowercase alphanumeric terms, and each term keeps a posting list of
+// document numbers. A document is one stored message: its id, its location
+// in the message store and its conversation. Conversations are either a
+// 1-1 pair of users or a group. Documents are numbered in the order they
+// are added, so posting lists stay sorted and newest-first paging is a
+// backwards walk. Group conversations also list their documents by message
+// id, which is how group history is paged and messages are found by id.
+// The index is rebuilt from the message store at startup.
+
+#define SEARCH_MAX_TERM 32
+#define SEARCH_MAX_QUERY_TERMS 8
+
+typedef struct {
+    uint64_t msg_id;
+    MsgLocation location;
+    uint32_t conv;
+} SearchDoc;
+
+// Document numbers, ascending unless noted
+typedef struct {
+    uint32_t* docs;
+    uint32_t count;
+    uint32_t capacity;
+} PostingList;
+
+typedef struct {
+    char key[2 * MAX_USERNAME + 2];  // Group id, or both usernames in order
+    bool is_group;
+    char user_a[MAX_USERNAME];       // 1-1 participants (user_a < user_b)
+    char user_b[MAX_USERNAME];
+    PostingList postings;            // Every document in the conversation
+    PostingList by_id;               // Groups only: the same documents by message id
+} SearchConv;
+
+typedef struct {
+    char* text;                      // In SearchIndex.strings
+    PostingList postings;
+} SearchTerm;
+
+typedef struct {
+    rwlock_t lock;
+    SlabTable docs;                  // SearchDoc by document number
+    SlabTable convs;                 // SearchConv by conversation id
+    SlabTable terms;                 // SearchTerm by term id
+    HashIndex conv_index;
+    HashIndex term_index;
+    Arena strings;
+} SearchIndex;
+
+// Asked once per group conversation met during a query
+typedef bool (*SearchGroupVisibleFn)(void* ctx, const char* group_id);
+
+typedef struct {
+    const char* username;            // Only conversations this user is part of
+    const char* peer;                // Optional user or group id to narrow to
+    uint32_t before;                 // Page cursor: only documents below it (0 = newest)
+    int limit;
+    SearchGroupVisibleFn group_visible;
+    void* ctx;
+} SearchQuery;
+
+int search_index_init(SearchIndex* index);
+void search_index_free(SearchIndex* index);
+int search_index_add(SearchIndex* index, const char* sender, const char* recipient, bool is_group,
+                     const char* content, uint64_t msg_id, MsgLocation location);
+int search_index_query(SearchIndex* index, const char* text, const SearchQuery* query,
+                       SearchDoc* hits, uint32_t* next_cursor);
+int search_index_group_history(SearchIndex* index, const char* group_id, uint64_t cursor, bool newer, int limit,
+                               SearchDoc* docs, bool* more);
+bool search_index_find_group_message(SearchIndex* index, const char* group_id, uint64_t msg_id, SearchDoc* doc);
+
+#endif // SEARCH_INDEX_H
@@ -1,6 +1,16 @@
 #include "server.h"  // Includes common.h which has socket libraries
 #include <ctype.h>
+#include <signal.h>
 #include "common.h"
+#include "reactor.h"
+#include "logger.h"
+#include "msgstore.h"
+#include "search_index.h"
+#include "inbox.h"
+#include "statestore.h"
+#include "dirmap.h"
+#include "metrics.h"
+#include "lock_profile.h"
 
 // Socket libraries are included via common.h:
 // Windows: winsock2.h, ws2tcpip.h, windows.h
@@ -8,21 +18,61 @@
 
 ServerState server_state;
 
+// Accounts of servers that predate the state store, imported once
 #define ACCOUNT_FILE "account.txt"
-int account_count = 0;
+
+// Chunk size of the arena holding names of users outside the directory image
+#define USER_NAMES_ARENA_CHUNK (64 * 1024)
+
+// Chunk size of each group's pinned content arena
+#define PINNED_ARENA_CHUNK 4096
+
+// Recent messages each group keeps in memory (--group-history=)
+#define GROUP_HISTORY_DEFAULT 256
+
+// Messages returned per CMD_GET_HISTORY request unless asked for fewer
+#define HISTORY_PAGE_DEFAULT 20
+#define HISTORY_PAGE_MAX 50
+
+// Durable log of every 1-1 and group message, its search index and the
+// queues of messages waiting for offline recipients
+static MsgStore message_store;
+static SearchIndex search_index;
+static Inbox offline_inbox;
+
+// Durable copy of users, friendships, blocks and groups (state.* files
+// next to the message store)
+static StateStore state_store;
+
+// Accounts mapped from the directory image at startup. User names point
+// into it, so it stays mapped until the process exits.
+static DirMap directory_image;
+
+// Records of directory image users are filled in a block at a time, when
+// one of the block is first looked up, so startup touches none of them.
+// image_fill_lock is a leaf, taken under any state lock.
+#define IMAGE_BLOCK_USERS 1024
+static atomic_uchar* image_blocks_filled;
+static mutex_t image_fill_lock;
+
+// Users the snapshot expects in the directory image
+static uint32_t directory_users_expected;
+
+// Offline messages sent to a client per write on login
+#define OFFLINE_BATCH 64
+
+// Search results returned per CMD_SEARCH_HISTORY request
+#define SEARCH_PAGE_SIZE 10
+
+// Set by --slow-consumer=
+static SlowConsumerPolicy slow_consumer_policy = SLOW_CONSUMER_DISCONNECT;
+
+// Set by --group-history=
+static int group_history_size = GROUP_HISTORY_DEFAULT;
 
 int load_accounts(const char *filename){
     FILE *file = fopen(filename, "r");
-    if (!file) {
-        /* If account file doesn't exist yet, create it so later append works */
-        FILE *f = fopen(filename, "a");
-        if (!f) {
-            perror("Could not create account file");
-            return -1;
-        }
-        fclose(f);
-        return 0; /* nothing to load */
-    }
+    if (!file) return 0; /* nothing to import */
 
     char username[MAX_USERNAME];
     char password[MAX_USERNAME];
@@ -30,37 +80,46 @@ int load_accounts(const char *filename){
 
     /* Expect lines in the form: username password\n */
     while (fscanf(file, "%49s %49s", username, password) == 2) {
-        if (server_state.user_count >= (int)(sizeof(server_state.users) / sizeof(server_state.users[0]))) {
-            /* no more space */
-            break;
-        }
-
-        /* add_user will avoid duplicates and initialize fields */
-        add_user(&server_state, username, password);
-        loaded++;
+        /* add_user skips duplicates and logs each new user */
+        if (add_user(&server_state, username, password)) loaded++;
     }
 
     fclose(file);
     return loaded;
 }
 
-int save_account(const char *filename, const char *username, const char *password) {
-    FILE *file = fopen(filename, "a");
-    if (!file) {
-        perror("Could not open account file for appending");
-        return -1;
-    }
+// Keys of the directory hash indexes
+static const char* user_key(void* ctx, int32_t id) {
+    /* probing an image user's name leaves its record alone */
+    if ((uint32_t)id < directory_image.count) return directory_image.accounts[id].username;
+    return ((User*)slab_get(&((ServerState*)ctx)->users, id))->username;
+}
+
+static const char* group_key(void* ctx, int32_t id) {
+    return ((Group*)slab_get(&((ServerState*)ctx)->groups, id))->group_id;
+}
 
-    /* Append a single record as "username password" */
-    if (fprintf(file, "%s %s\n", username, password) < 0) {
-        fclose(file);
+// Set up empty user and group directories and their locks
+int init_server_state(ServerState* state) {
+    memset(state, 0, sizeof(ServerState));
+    slab_init(&state->users, sizeof(User));
+    slab_init(&state->groups, sizeof(Group));
+    arena_init(&state->user_names, USER_NAMES_ARENA_CHUNK);
+    mutex_init(&state->account_lock);
+    rwlock_init(&state->directory_lock);
+    for (int i = 0; i < USER_LOCK_STRIPES; i++) {
+        mutex_init(&state->user_locks[i]);
+    }
+    for (int i = 0; i < GROUP_LOCK_STRIPES; i++) {
+        mutex_init(&state->group_locks[i]);
+    }
+    if (hash_index_init(&state->user_index, 2048, user_key, state) < 0 ||
+        hash_index_init(&state->group_index, 256, group_key, state) < 0) {
         return -1;
     }
-
-    fflush(file);
-    fclose(file);
     return 0;
 }
+
 // Initialize server socket
 int init_server(socket_t* server_socket) {
     #ifdef _WIN32
@@ -111,7 +170,7 @@ int init_server(socket_t* server_socket) {
         return -1;
     }
 
-    if (listen(*server_socket, 10) == SOCKET_ERROR) {
+    if (listen(*server_socket, SOMAXCONN) == SOCKET_ERROR) {
         #ifdef _WIN32
         printf("Listen failed: %d\n", WSAGetLastError());
         #else
@@ -124,788 +183,2360 @@ int init_server(socket_t* server_socket) {
         return -1;
     }
 
-    // Initialize server state
-    memset(&server_state, 0, sizeof(ServerState));
-    #ifdef _WIN32
-    InitializeCriticalSection(&server_state.mutex);
-    #else
-    pthread_mutex_init(&server_state.mutex, NULL);
-    #endif
-
-    // Load accounts into server_state from persistence file
-    int loaded = load_accounts(ACCOUNT_FILE);
-    if (loaded < 0) {
-        printf("Warning: failed to load accounts from %s\n", ACCOUNT_FILE);
-    } else if (loaded > 0) {
-        printf("Loaded %d accounts from %s\n", loaded, ACCOUNT_FILE);
+    if (init_server_state(&server_state) < 0) {
+        printf("Failed to allocate directory indexes\n");
+        close_socket(*server_socket);
+        return -1;
     }
 
     printf("Server started on port %d\n", PORT);
     return 0;
 }
 
+// State locks are taken through these so each command's lock hold time
+// can be measured (see metrics.h), and profiled per lock in LOCK_PROFILE
+// builds (see lock_profile.h)
+static void state_lock(mutex_t* lock, LockClass lock_class) {
+    #ifdef LOCK_PROFILE
+    PROFILE_LOCK(lock, lock_class, mutex_trylock(lock), mutex_lock(lock));
+    #else
+    (void)lock_class;
+    mutex_lock(lock);
+    #endif
+    metrics_lock_acquired();
+}
+
+static void state_unlock(mutex_t* lock) {
+    metrics_lock_released();
+    #ifdef LOCK_PROFILE
+    PROFILE_UNLOCK(lock);
+    #endif
+    mutex_unlock(lock);
+}
+
+static void directory_read_lock(ServerState* state) {
+    #ifdef LOCK_PROFILE
+    PROFILE_LOCK(&state->directory_lock, LOCK_DIRECTORY_READ, rwlock_tryrdlock(&state->directory_lock),
+                 rwlock_rdlock(&state->directory_lock));
+    #else
+    rwlock_rdlock(&state->directory_lock);
+    #endif
+    metrics_lock_acquired();
+}
+
+static void directory_read_unlock(ServerState* state) {
+    metrics_lock_released();
+    #ifdef LOCK_PROFILE
+    PROFILE_UNLOCK(&state->directory_lock);
+    #endif
+    rwlock_rdunlock(&state->directory_lock);
+}
+
+static void directory_write_lock(ServerState* state) {
+    #ifdef LOCK_PROFILE
+    PROFILE_LOCK(&state->directory_lock, LOCK_DIRECTORY_WRITE, rwlock_trywrlock(&state->directory_lock),
+                 rwlock_wrlock(&state->directory_lock));
+    #else
+    rwlock_wrlock(&state->directory_lock);
+    #endif
+    metrics_lock_acquired();
+}
+
+static void directory_write_unlock(ServerState* state) {
+    metrics_lock_released();
+    #ifdef LOCK_PROFILE
+    PROFILE_UNLOCK(&state->directory_lock);
+    #endif
+    rwlock_wrunlock(&state->directory_lock);
+}
+
+// Find user by username (caller holds directory_lock)
+static User* lookup_user(ServerState* state, const char* username) {
+    int32_t id = hash_index_find(&state->user_index, username);
+    return id == INDEX_EMPTY ? NULL : user_by_id(state, (UserId)id);
+}
+
+// Find group by group_id (caller holds directory_lock)
+static Group* lookup_group(ServerState* state, const char* group_id) {
+    int32_t id = hash_index_find(&state->group_index, group_id);
+    return id == INDEX_EMPTY ? NULL : (Group*)slab_get(&state->groups, id);
+}
+
 // Find user by username
 User* find_user(ServerState* state, const char* username) {
-    for (int i = 0; i < state->user_count; i++) {
-        if (strcmp(state->users[i].username, username) == 0) {
-            return &state->users[i];
+    directory_read_lock(state);
+    User* user = lookup_user(state, username);
+    directory_read_unlock(state);
+    return user;
+}
+
+// True for a directory image user whose record is not filled in yet: it
+// has never been looked up, so it has no friends, blocks or connection
+static bool image_user_untouched(UserId id) {
+    return id < directory_image.count &&
+           !atomic_load_explicit(&image_blocks_filled[id / IMAGE_BLOCK_USERS], memory_order_acquire);
+}
+
+static void fill_image_block(ServerState* state, uint32_t block) {
+    mutex_lock(&image_fill_lock);
+    if (!atomic_load_explicit(&image_blocks_filled[block], memory_order_relaxed)) {
+        uint32_t end = (block + 1) * IMAGE_BLOCK_USERS;
+        if (end > directory_image.count) end = directory_image.count;
+        for (uint32_t id = block * IMAGE_BLOCK_USERS; id < end; id++) {
+            /* the rest of the record is zero: offline, with empty sets */
+            User* user = (User*)slab_get(&state->users, id);
+            user->id = id;
+            user->username = directory_image.accounts[id].username;
+            user->password = directory_image.accounts[id].password;
         }
+        atomic_store_explicit(&image_blocks_filled[block], 1, memory_order_release);
     }
-    return NULL;
+    mutex_unlock(&image_fill_lock);
+}
+
+// Find user by id. Ids come from records that were published under a
+// lock, and records never move, so no lock is needed.
+User* user_by_id(ServerState* state, UserId id) {
+    if (image_user_untouched(id)) {
+        fill_image_block(state, id / IMAGE_BLOCK_USERS);
+    }
+    return (User*)slab_get(&state->users, id);
 }
 
 // Find group by group_id
 Group* find_group(ServerState* state, const char* group_id) {
-    for (int i = 0; i < state->group_count; i++) {
-        if (strcmp(state->groups[i].group_id, group_id) == 0) {
-            return &state->groups[i];
+    directory_read_lock(state);
+    Group* group = lookup_group(state, group_id);
+    directory_read_unlock(state);
+    return group;
+}
+
+// Append a user record and index it. Caller holds directory_lock for
+// writing, or is loading saved state before serving.
+static User* insert_user(ServerState* state, const char* username, const char* password) {
+    uint32_t id;
+    User* new_user = (User*)slab_append(&state->users, &id);
+    if (!new_user) return NULL;  // Out of memory
+    size_t username_len = strlen(username);
+    size_t password_len = strlen(password);
+    new_user->id = id;
+    new_user->username = arena_strndup(&state->user_names, username,
+                                       username_len < MAX_USERNAME ? username_len : MAX_USERNAME - 1);
+    new_user->password = arena_strndup(&state->user_names, password,
+                                       password_len < MAX_USERNAME ? password_len : MAX_USERNAME - 1);
+    if (!new_user->username || !new_user->password) {
+        state->users.count--;
+        return NULL;
+    }
+    new_user->is_online = false;
+    new_user->conn = NULL;
+    idset_init(&new_user->blocked);
+    idset_init(&new_user->friends);
+    if (hash_index_insert(&state->user_index, new_user->username, (int32_t)new_user->id) < 0) {
+        state->users.count--;  // Drop the unindexed record again
+        return NULL;
+    }
+    return new_user;
+}
+
+// Log a change naming a user or group and one other user
+static void log_state_change(StateRecordKind kind, uint32_t subject, UserId other) {
+    StateRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = kind;
+    record.subject = subject;
+    record.ids = &other;
+    record.id_count = 1;
+    statestore_log(&state_store, &record);
+}
+
+// Add new user. Returns NULL if the name is taken or memory runs out.
+User* add_user(ServerState* state, const char* username, const char* password) {
+    directory_write_lock(state);
+    User* new_user = NULL;
+    if (lookup_user(state, username) == NULL) {
+        new_user = insert_user(state, username, password);
+    }
+    if (new_user) {
+        StateRecord record;
+        memset(&record, 0, sizeof(record));
+        record.kind = STATE_USER;
+        record.subject = new_user->id;
+        record.text = new_user->username;
+        record.text_len = (int)strlen(new_user->username);
+        record.text2 = new_user->password;
+        record.text2_len = (int)strlen(new_user->password);
+        statestore_log(&state_store, &record);
+    }
+    directory_write_unlock(state);
+    return new_user;
+}
+
+// Append a group record with creator as its only member and admin, and
+// index it. Caller holds directory_lock for writing, or is loading saved
+// state before serving.
+static Group* insert_group(ServerState* state, const char* group_id, const char* name,
+                           UserId creator, time_t created_at) {
+    uint32_t id;
+    Group* new_group = (Group*)slab_append(&state->groups, &id);
+    if (!new_group) return NULL;
+    new_group->id = (int)id;
+    strncpy(new_group->group_id, group_id, MAX_GROUP_ID - 1);
+    strncpy(new_group->name, name, MAX_GROUP_NAME - 1);
+    new_group->creator = creator;
+    idset_init(&new_group->members);
+    idset_init(&new_group->admins);
+    memset(&new_group->history, 0, sizeof(MessageHistory));
+    new_group->history.capacity = group_history_size;
+    new_group->history.complete = true;
+    new_group->pinned = NULL;
+    new_group->pinned_count = 0;
+    new_group->pinned_capacity = 0;
+    arena_init(&new_group->pinned_arena, PINNED_ARENA_CHUNK);
+    new_group->created_at = created_at;
+    if (idset_add(&new_group->members, creator) < 0 || idset_add(&new_group->admins, creator) < 0 ||
+        hash_index_insert(&state->group_index, new_group->group_id, new_group->id) < 0) {
+        idset_free(&new_group->members);
+        idset_free(&new_group->admins);
+        state->groups.count--;  // Drop the unindexed record again
+        return NULL;
+    }
+    return new_group;
+}
+
+// Create a group owned by creator and write its new id to group_id.
+// Returns NULL when memory runs out.
+Group* create_group(ServerState* state, const char* name, const User* creator, char* group_id) {
+    directory_write_lock(state);
+
+    /* ids are "GROUP_<creator>_<time>", suffixed if one already exists */
+    long long now = (long long)time(NULL);
+    snprintf(group_id, MAX_GROUP_ID, "GROUP_%.*s_%lld", MAX_GROUP_ID - 27, creator->username, now);
+    for (int n = 2; lookup_group(state, group_id) != NULL; n++) {
+        snprintf(group_id, MAX_GROUP_ID, "GROUP_%.*s_%lld_%d", MAX_GROUP_ID - 38, creator->username, now, n);
+    }
+
+    Group* new_group = insert_group(state, group_id, name, creator->id, time(NULL));
+    if (new_group) {
+        StateRecord record;
+        memset(&record, 0, sizeof(record));
+        record.kind = STATE_GROUP;
+        record.subject = (uint32_t)new_group->id;
+        record.value = (uint64_t)new_group->created_at;
+        record.text = new_group->group_id;
+        record.text_len = (int)strlen(new_group->group_id);
+        record.text2 = new_group->name;
+        record.text2_len = (int)strlen(new_group->name);
+        record.ids = &new_group->creator;
+        record.id_count = 1;
+        statestore_log(&state_store, &record);
+    }
+    directory_write_unlock(state);
+    return new_group;
+}
+
+// Ring position of the i-th oldest message in a history ring
+static int history_position(const MessageHistory* history, int i) {
+    return (history->start + i) % history->capacity;
+}
+
+static HistorySlot* history_slot(const MessageHistory* history, int i) {
+    return &history->slots[history_position(history, i)];
+}
+
+// Number of messages in the ring with an id below id
+static int history_lower_bound(const MessageHistory* history, uint64_t id) {
+    int lo = 0, hi = history->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (history_slot(history, mid)->message.id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
-    return NULL;
+    return lo;
+}
+
+// Swap the i-th and j-th oldest slots, keeping the id index in step for
+// the message that lands at i. The one at j is re-indexed by the caller.
+static void history_swap(MessageHistory* history, int i, int j) {
+    HistorySlot t = *history_slot(history, i);
+    *history_slot(history, i) = *history_slot(history, j);
+    *history_slot(history, j) = t;
+    msgid_index_put(&history->index, history_slot(history, i)->message.id, history_position(history, i));
 }
 
-// Add new user
-void add_user(ServerState* state, const char* username, const char* password) {
-    if (find_user(state, username) != NULL) {
-        return;  // User already exists
+// Add a message to a group's history ring, dropping the oldest one if the
+// ring is full, and copy content into the slot it takes. The caller fills
+// in the rest of the message. Caller holds the group lock. Returns NULL
+// if the message is not kept: the ring is disabled, the message is older
+// than all it holds, or memory runs out.
+static Message* history_push(MessageHistory* history, uint64_t id, const char* content) {
+    if (history->capacity <= 0) {
+        history->complete = false;
+        return NULL;
+    }
+    if (!history->slots) {
+        history->slots = (HistorySlot*)calloc((size_t)history->capacity, sizeof(HistorySlot));
+        if (!history->slots) return NULL;
+        if (msgid_index_init(&history->index, (uint32_t)history->capacity) < 0) {
+            free(history->slots);
+            history->slots = NULL;
+            return NULL;
+        }
+    }
+
+    /* messages saved concurrently can reach the ring slightly out of order */
+    int position = history_lower_bound(history, id);
+    if (history->count == history->capacity) {
+        history->complete = false;
+        if (position == 0) return NULL;
+        msgid_index_remove(&history->index, history_slot(history, 0)->message.id);
+        history->start = (history->start + 1) % history->capacity;
+        history->count--;
+        position--;
+    }
+
+    /* the free slot after the newest message moves down to position */
+    for (int i = history->count; i > position; i--) {
+        history_swap(history, i, i - 1);
+    }
+
+    HistorySlot* slot = history_slot(history, position);
+    size_t len = strlen(content);
+    if (len + 1 > slot->content_capacity) {
+        char* buffer = (char*)realloc(slot->message.content, len + 1);
+        if (!buffer) {
+            /* close the gap again; the slot keeps its old buffer */
+            for (int i = position; i < history->count; i++) {
+                history_swap(history, i, i + 1);
+            }
+            history->complete = false;
+            return NULL;
+        }
+        slot->message.content = buffer;
+        slot->content_capacity = len + 1;
+    }
+    char* buffer = slot->message.content;
+    memset(&slot->message, 0, sizeof(Message));
+    memcpy(buffer, content, len + 1);
+    slot->message.content = buffer;
+    slot->message.id = id;
+    msgid_index_put(&history->index, id, history_position(history, position));
+    history->count++;
+    return &slot->message;
+}
+
+// Message with the given id, if it is still in the ring
+static Message* history_find(const MessageHistory* history, uint64_t id) {
+    int32_t position = msgid_index_find(&history->index, id);
+    return position >= 0 ? &history->slots[position].message : NULL;
+}
+
+// Add a message to a group's pinned messages unless it is already there.
+// Caller holds the group lock. Returns 1 if it was added, 0 if it was
+// already pinned and -1 if memory runs out.
+static int pin_insert(Group* group, uint64_t id, const char* content) {
+    for (int i = 0; i < group->pinned_count; i++) {
+        if (group->pinned[i].id == id) return 0;
+    }
+    if (group->pinned_count == group->pinned_capacity) {
+        int capacity = group->pinned_capacity > 0 ? group->pinned_capacity * 2 : 8;
+        PinnedMessage* pinned = (PinnedMessage*)realloc(group->pinned, capacity * sizeof(PinnedMessage));
+        if (!pinned) return -1;
+        group->pinned = pinned;
+        group->pinned_capacity = capacity;
+    }
+    char* copy = arena_strndup(&group->pinned_arena, content, strlen(content));
+    if (!copy) return -1;
+    group->pinned[group->pinned_count].id = id;
+    group->pinned[group->pinned_count].content = copy;
+    group->pinned_count++;
+    return 1;
+}
+
+// Pin a message in a group and log the new pin. Caller holds the group
+// lock and flushes the state store after releasing it.
+static int group_pin(Group* group, uint64_t id, const char* content) {
+    int added = pin_insert(group, id, content);
+    if (added > 0) {
+        StateRecord record;
+        memset(&record, 0, sizeof(record));
+        record.kind = STATE_PIN;
+        record.subject = (uint32_t)group->id;
+        record.value = id;
+        record.text = group->pinned[group->pinned_count - 1].content;
+        record.text_len = (int)strlen(record.text);
+        statestore_log(&state_store, &record);
+    }
+    return added < 0 ? -1 : 0;
+}
+
+// Lock stripe guarding a user's mutable fields
+static mutex_t* user_lock(ServerState* state, const User* user) {
+    return &state->user_locks[user->id % USER_LOCK_STRIPES];
+}
+
+// Lock stripe guarding a group's fields
+static mutex_t* group_lock(ServerState* state, const Group* group) {
+    return &state->group_locks[group->id % GROUP_LOCK_STRIPES];
+}
+
+// Lock two users' stripes in ascending order (they may share one)
+static void lock_user_pair(ServerState* state, const User* user1, const User* user2) {
+    mutex_t* first = user_lock(state, user1);
+    mutex_t* second = user_lock(state, user2);
+    if (first > second) {
+        mutex_t* tmp = first;
+        first = second;
+        second = tmp;
+    }
+    state_lock(first, LOCK_USER_STRIPE);
+    if (second != first) {
+        state_lock(second, LOCK_USER_STRIPE);
+    }
+}
+
+static void unlock_user_pair(ServerState* state, const User* user1, const User* user2) {
+    mutex_t* first = user_lock(state, user1);
+    mutex_t* second = user_lock(state, user2);
+    if (second != first) {
+        state_unlock(second);
+    }
+    state_unlock(first);
+}
+
+// Take a reference to the user's live connection, or NULL if offline.
+// The caller must connection_release() it.
+static Connection* user_connection(ServerState* state, User* user) {
+    state_lock(user_lock(state, user), LOCK_USER_STRIPE);
+    Connection* conn = user->is_online ? user->conn : NULL;
+    if (conn) {
+        connection_retain(conn);
+    }
+    state_unlock(user_lock(state, user));
+    return conn;
+}
+
+// Like user_connection(), but queue the stored message in the user's
+// offline inbox when there is no live connection. Deciding under the
+// user's lock means a concurrent login either finds the inbox entry or
+// is already online. The caller runs inbox_flush() once unlocked.
+static Connection* user_connection_or_inbox(ServerState* state, User* user, uint64_t msg_id, MsgLocation location) {
+    state_lock(user_lock(state, user), LOCK_USER_STRIPE);
+    Connection* conn = user->is_online ? user->conn : NULL;
+    if (conn) {
+        connection_retain(conn);
+    } else if (inbox_add(&offline_inbox, user->username, msg_id, location) < 0) {
+        printf("Failed to queue offline message for %s\n", user->username);
+    }
+    state_unlock(user_lock(state, user));
+    return conn;
+}
+
+// Send the user's queued offline messages, OFFLINE_BATCH frames per write.
+// Each frame carries "OFFLINE:<seq>" in extra_data. A client that asked
+// for acknowledgements at login answers with CMD_ACK_OFFLINE and entries
+// stay queued until then; for any other client they are dropped once sent.
+static void deliver_offline_messages(Connection* conn, User* user) {
+    InboxEntry* entries;
+    int count = inbox_pending(&offline_inbox, user->username, &entries);
+    if (count == 0) return;
+
+    Frame* batch[OFFLINE_BATCH];
+    int batched = 0;
+    bool failed = false;
+    uint64_t sent_seq = 0;  // Entries up to here have been sent
+
+    for (int i = 0; i < count && !failed; i++) {
+        ProtocolMessage frame;
+        StoredMessage stored;
+        memset(&frame, 0, sizeof(ProtocolMessage));
+        if (msgstore_read(&message_store, entries[i].location, &stored, frame.content, MAX_CONTENT) < 0) {
+            printf("Offline message %llu for %s is missing from the store\n",
+                   (unsigned long long)entries[i].msg_id, user->username);
+        } else {
+            frame.cmd = CMD_RECEIVE_MESSAGE;
+            strncpy(frame.sender, stored.sender, MAX_USERNAME - 1);
+            if (stored.flags & MSGSTORE_FLAG_GROUP) {
+                strncpy(frame.recipient, stored.recipient, MAX_USERNAME - 1);
+            }
+            frame.msg_type = stored.type;
+            snprintf(frame.extra_data, sizeof(frame.extra_data), "OFFLINE:%llu",
+                     (unsigned long long)entries[i].seq);
+
+            Frame* encoded = frame_encode(&frame, conn->format);
+            if (encoded) {
+                batch[batched++] = encoded;
+            }
+        }
+
+        if (batched > 0 && (batched == OFFLINE_BATCH || i == count - 1)) {
+            failed = connection_send(conn, batch, batched) == SOCKET_ERROR;
+            for (int k = 0; k < batched; k++) {
+                frame_release(batch[k]);
+            }
+            batched = 0;
+            if (!failed) sent_seq = entries[i].seq;
+        }
+    }
+    if (!failed) sent_seq = entries[count - 1].seq;  // Including missing ones at the end
+
+    if (!conn->acks_offline && sent_seq > 0) {
+        inbox_ack(&offline_inbox, user->username, sent_seq);
+        inbox_flush(&offline_inbox);
+    }
+    free(entries);
+}
+
+// Mark the user offline if conn is still its live connection
+static void detach_connection(ServerState* state, User* user, Connection* conn) {
+    bool detached = false;
+    state_lock(user_lock(state, user), LOCK_USER_STRIPE);
+    if (user->conn == conn) {
+        user->is_online = false;
+        user->conn = NULL;
+        detached = true;
+    }
+    state_unlock(user_lock(state, user));
+    if (detached) {
+        connection_release(conn);  // reference held by user->conn
+    }
+}
+
+// A message on its way to one or more connections, encoded at most once
+// per wire format no matter how many recipients share that format. The
+// encoded frame is shared by reference with every recipient's queue.
+typedef struct {
+    MessageView msg;
+    Frame* frames[PROTO_FORMAT_COUNT];
+} OutgoingMessage;
+
+// The fields msg points to must outlive out
+static void outgoing_init_view(OutgoingMessage* out, const MessageView* msg) {
+    memset(out, 0, sizeof(OutgoingMessage));
+    out->msg = *msg;
+}
+
+static void outgoing_init(OutgoingMessage* out, const ProtocolMessage* msg) {
+    MessageView view;
+    message_view_of(msg, &view);
+    outgoing_init_view(out, &view);
+}
+
+// Send the message to conn in the format that connection speaks
+static int outgoing_send(OutgoingMessage* out, Connection* conn) {
+    ProtocolFormat format = conn->format;
+    if (!out->frames[format]) {
+        out->frames[format] = frame_encode_view(&out->msg, format);
+        if (!out->frames[format]) return SOCKET_ERROR;
+    }
+    return connection_send(conn, &out->frames[format], 1);
+}
+
+static void outgoing_free(OutgoingMessage* out) {
+    for (int i = 0; i < PROTO_FORMAT_COUNT; i++) {
+        if (out->frames[i]) {
+            frame_release(out->frames[i]);
+        }
     }
-    
-    User* new_user = &state->users[state->user_count++];
-    strncpy(new_user->username, username, MAX_USERNAME - 1);
-    strncpy(new_user->password, password, MAX_USERNAME - 1);
-    new_user->is_online = false;
-    new_user->socket = INVALID_SOCKET;
-    new_user->blocked_count = 0;
-    new_user->friend_count = 0;
 }
 
 // Send response to client
-void send_response(socket_t socket, CommandType cmd, const char* content) {
+void send_response(Connection* conn, CommandType cmd, const char* content) {
     ProtocolMessage msg;
     memset(&msg, 0, sizeof(ProtocolMessage));
     msg.cmd = cmd;
     strncpy(msg.content, content, MAX_CONTENT - 1);
-    
-    int len;
-    char* buffer = serialize_protocol_message(&msg, &len);
-    if (buffer) {
-        int sent = send(socket, buffer, len, 0);
-        if (sent == SOCKET_ERROR) {
-            #ifdef _WIN32
-            printf("Send failed: %d\n", WSAGetLastError());
-            #else
-            printf("Send failed: %s\n", strerror(errno));
-            #endif
-        }
-        free(buffer);
+
+    OutgoingMessage out;
+    outgoing_init(&out, &msg);
+    if (outgoing_send(&out, conn) == SOCKET_ERROR) {
+        #ifdef _WIN32
+        printf("Send failed: %d\n", WSAGetLastError());
+        #else
+        printf("Send failed: %s\n", strerror(errno));
+        #endif
     }
+    outgoing_free(&out);
 }
 
-// Check if user1 has blocked user2
-bool is_blocked(User* user, const char* username) {
-    for (int i = 0; i < user->blocked_count; i++) {
-        if (strcmp(user->blocked_users[i], username) == 0) {
-            return true;
+// Scratch array copy_ids() reuses on each thread; it only ever grows
+static THREAD_LOCAL UserId* id_scratch;
+static THREAD_LOCAL uint32_t id_scratch_capacity;
+
+// Copy the ids in a set so they can be used after its lock is released.
+// Caller holds the lock guarding the set. The copy is in this thread's
+// scratch array and is valid until the thread's next copy_ids() call.
+// Returns NULL with *count set to 0 if memory runs out.
+static UserId* copy_ids(const IdSet* set, uint32_t* count) {
+    if (!id_scratch || set->count > id_scratch_capacity) {
+        uint32_t capacity = id_scratch_capacity ? id_scratch_capacity : 64;
+        while (capacity < set->count) capacity *= 2;
+        UserId* ids = (UserId*)realloc(id_scratch, capacity * sizeof(UserId));
+        if (!ids) {
+            *count = 0;
+            return NULL;
         }
+        id_scratch = ids;
+        id_scratch_capacity = capacity;
     }
-    return false;
+    *count = idset_copy(set, id_scratch);
+    return id_scratch;
+}
+
+// Free the calling thread's scratch buffers before it exits
+static void release_thread_buffers(void) {
+    free(id_scratch);
+    id_scratch = NULL;
+    id_scratch_capacity = 0;
+    frame_cache_flush();
+}
+
+// Check if user has blocked other
+bool is_blocked(const User* user, const User* other) {
+    return idset_contains(&user->blocked, other->id);
 }
 
 // Check if users are friends
-bool are_friends(User* user1, User* user2) {
-    for (int i = 0; i < user1->friend_count; i++) {
-        if (strcmp(user1->friends[i], user2->username) == 0) {
-            return true;
-        }
+bool are_friends(const User* user1, const User* user2) {
+    return idset_contains(&user1->friends, user2->id);
+}
+
+// Add friend relationship (bidirectional). Returns -1 if out of memory.
+int add_friend(User* user1, User* user2) {
+    if (idset_add(&user1->friends, user2->id) < 0) return -1;
+    if (idset_add(&user2->friends, user1->id) < 0) {
+        idset_remove(&user1->friends, user2->id);
+        return -1;
     }
-    return false;
+    return 0;
 }
 
-// Add friend relationship (bidirectional)
-void add_friend(User* user1, User* user2) {
-    if (are_friends(user1, user2)) return;
-    
-    strncpy(user1->friends[user1->friend_count++], user2->username, MAX_USERNAME - 1);
-    strncpy(user2->friends[user2->friend_count++], user1->username, MAX_USERNAME - 1);
+// Text of one history page. Lines are appended when paging forward and
+// prepended when paging back, so whichever end runs out of room is the
+// far end of the page.
+typedef struct {
+    char text[MAX_CONTENT];
+    int head, tail;           // text[head..tail) is filled
+    int room;
+    bool backwards;
+    int lines;
+    uint64_t first_id, last_id;
+} HistoryPage;
+
+static void history_page_init(HistoryPage* page, bool backwards, int room) {
+    page->head = page->tail = backwards ? room : 0;
+    page->room = room;
+    page->backwards = backwards;
+    page->lines = 0;
 }
 
-// Handle client connection
-#ifdef _WIN32
-DWORD WINAPI handle_client(LPVOID arg) {
-#else
-void* handle_client(void* arg) {
-#endif
-    ClientThreadData* data = (ClientThreadData*)arg;
-    socket_t client_socket = data->client_socket;
-    ServerState* state = data->server_state;
-    char buffer[BUFFER_SIZE];
-    User* current_user = NULL;
+// Add one message to the page. Returns false if it does not fit.
+static bool history_page_add(HistoryPage* page, uint64_t id, const char* sender, time_t timestamp,
+                             const char* content) {
+    char time_str[32];
+    char line[MAX_CONTENT];
+    format_time(timestamp, time_str, sizeof(time_str));
+    int len = snprintf(line, sizeof(line), "#%llu [%s] %s: %s\n", (unsigned long long)id, time_str, sender,
+                       content);
+    if (len < 0) return false;
+    if (len >= (int)sizeof(line)) len = (int)sizeof(line) - 1;
 
-    printf("Client connected\n");
+    /* a message too long for an empty page is cut rather than skipped */
+    int free_space = page->room - (page->tail - page->head);
+    if (len > free_space) {
+        if (page->lines > 0) return false;
+        len = free_space;
+    }
 
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        
-        if (bytes_received <= 0) {
-            break;
-        }
+    if (page->backwards) {
+        page->head -= len;
+        memcpy(page->text + page->head, line, (size_t)len);
+        page->first_id = id;
+        if (page->lines == 0) page->last_id = id;
+    } else {
+        memcpy(page->text + page->tail, line, (size_t)len);
+        page->tail += len;
+        if (page->lines == 0) page->first_id = id;
+        page->last_id = id;
+    }
+    page->lines++;
+    return true;
+}
 
-        buffer[bytes_received] = '\0';
-        ProtocolMessage* msg = deserialize_protocol_message(buffer, bytes_received);
-        if (!msg) continue;
+// Format one page of a group's history into response, oldest message
+// first: up to limit messages below cursor, or above it if newer. The page
+// is served from the group's ring when that holds all of it, and from the
+// message store otherwise. extra_data gets the cursor to continue in the
+// same direction. Returns false if user is not a member.
+static bool group_history_page(ServerState* state, Group* group, const User* user, uint64_t cursor, bool newer,
+                               int limit, ProtocolMessage* response) {
+    static const char header[] = "History:\n";
+    HistoryPage page;
+    history_page_init(&page, !newer, MAX_CONTENT - 1 - (int)strlen(header));
+    bool more;
 
-        #ifdef _WIN32
-        EnterCriticalSection(&state->mutex);
-        #else
-        pthread_mutex_lock(&state->mutex);
-        #endif
+    state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+    if (!idset_contains(&group->members, user->id)) {
+        state_unlock(group_lock(state, group));
+        return false;
+    }
 
-        // Handle commands
-        switch (msg->cmd) {
-            case CMD_LOGIN: {
-                User* user = find_user(state, msg->sender);
-                if (user && strcmp(user->password, msg->content) == 0) {
-                    user->is_online = true;
-                    user->socket = client_socket;
-                    current_user = user;
-                    send_response(client_socket, CMD_SUCCESS, "Login successful");
-                    log_activity(msg->sender, "LOGIN", "User logged in");
-                    
-                    // Send offline messages
-                    // Implementation would load from file
-                } else {
-                    send_response(client_socket, CMD_ERROR, "Invalid credentials");
-                }
-                break;
-            }
-            
-            case CMD_REGISTER: {
-                if (find_user(state, msg->sender) != NULL) {
-                    send_response(client_socket, CMD_ERROR, "Username already exists");
-                } else {
-                    /* Persist account first so storage reflects the new user */
-                    if (save_account(ACCOUNT_FILE, msg->sender, msg->content) != 0) {
-                        send_response(client_socket, CMD_ERROR, "Failed to persist account");
-                        break;
-                    }
+    const MessageHistory* history = &group->history;
+    int first, last;
+    bool in_ring;
+    if (newer) {
+        first = history_lower_bound(history, cursor + 1);
+        last = history->count - first > limit ? first + limit : history->count;
+        in_ring = history->complete || (history->count > 0 && history_slot(history, 0)->message.id <= cursor);
+        more = last < history->count;
+    } else {
+        last = history_lower_bound(history, cursor);
+        first = last > limit ? last - limit : 0;
+        in_ring = first > 0 || history->complete;
+        more = first > 0;
+    }
 
-                    add_user(state, msg->sender, msg->content);
-                    send_response(client_socket, CMD_SUCCESS, "Registration successful");
-                    log_activity(msg->sender, "REGISTER", "New user registered");
-                }
-                break;
-            }
-            
-            case CMD_GET_FRIENDS: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                char friend_list[BUFFER_SIZE] = "Friends: ";
-                for (int i = 0; i < current_user->friend_count; i++) {
-                    User* friend = find_user(state, current_user->friends[i]);
-                    if (friend) {
-                        strcat(friend_list, friend->username);
-                        strcat(friend_list, friend->is_online ? "(online) " : "(offline) ");
-                    }
-                }
-                send_response(client_socket, CMD_GET_FRIENDS, friend_list);
-                log_activity(current_user->username, "GET_FRIENDS", "Retrieved friend list");
+    if (in_ring) {
+        for (int n = 0; n < last - first; n++) {
+            const Message* message = &history_slot(history, newer ? first + n : last - 1 - n)->message;
+            if (!history_page_add(&page, message->id, user_by_id(state, message->sender)->username,
+                                  message->timestamp, message->content)) {
+                more = true;
                 break;
             }
-            
-            case CMD_ADD_FRIEND: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                User* friend_user = find_user(state, msg->recipient);
-                if (!friend_user) {
-                    send_response(client_socket, CMD_ERROR, "User not found");
-                    break;
-                }
-                
-                if (strcmp(current_user->username, msg->recipient) == 0) {
-                    send_response(client_socket, CMD_ERROR, "Cannot add yourself");
-                    break;
-                }
-                
-                if (are_friends(current_user, friend_user)) {
-                    send_response(client_socket, CMD_ERROR, "Already friends");
-                    break;
-                }
-                
-                add_friend(current_user, friend_user);
-                send_response(client_socket, CMD_SUCCESS, "Friend added");
-                log_activity(current_user->username, "ADD_FRIEND", msg->recipient);
-                break;
+        }
+        state_unlock(group_lock(state, group));
+    } else {
+        state_unlock(group_lock(state, group));
+
+        SearchDoc docs[HISTORY_PAGE_MAX];
+        int count = search_index_group_history(&search_index, group->group_id, cursor, newer, limit, docs, &more);
+        for (int n = 0; n < count; n++) {
+            int i = newer ? n : count - 1 - n;
+            StoredMessage stored;
+            char content[MAX_CONTENT];
+            if (msgstore_read(&message_store, docs[i].location, &stored, content, sizeof(content)) < 0) {
+                continue;
             }
-            
-            case CMD_SEND_MESSAGE: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                User* recipient = find_user(state, msg->recipient);
-                if (!recipient) {
-                    send_response(client_socket, CMD_ERROR, "Recipient not found");
-                    break;
-                }
-                
-                if (is_blocked(current_user, msg->recipient) || is_blocked(recipient, current_user->username)) {
-                    send_response(client_socket, CMD_ERROR, "User is blocked");
-                    break;
-                }
-                
-                // Create message
-                Message message;
-                time_t now = time(NULL);
-                snprintf(message.id, sizeof(message.id), "%s_%lld", current_user->username, (long long)now);
-                strncpy(message.sender, current_user->username, MAX_USERNAME - 1);
-                strncpy(message.content, msg->content, MAX_CONTENT - 1);
-                message.type = msg->msg_type;
-                message.timestamp = time(NULL);
-                message.is_pinned = msg->is_pinned;
-                
-                // Save message
-                save_message_to_file(current_user->username, msg->recipient, msg->content, false);
-                
-                // Send to recipient if online
-                if (recipient->is_online && recipient->socket != INVALID_SOCKET) {
-                    ProtocolMessage response;
-                    memset(&response, 0, sizeof(ProtocolMessage));
-                    response.cmd = CMD_RECEIVE_MESSAGE;
-                    strncpy(response.sender, current_user->username, MAX_USERNAME - 1);
-                    strncpy(response.content, msg->content, MAX_CONTENT - 1);
-                    response.msg_type = msg->msg_type;
-                    
-                    int len;
-                    char* resp_buffer = serialize_protocol_message(&response, &len);
-                    if (send(recipient->socket, resp_buffer, len, 0) == SOCKET_ERROR) {
-                        #ifdef _WIN32
-                        printf("Failed to send message to %s: %d\n", msg->recipient, WSAGetLastError());
-                        #else
-                        printf("Failed to send message to %s: %s\n", msg->recipient, strerror(errno));
-                        #endif
-                    }
-                    free(resp_buffer);
-                }
-                
-                send_response(client_socket, CMD_SUCCESS, "Message sent");
-                log_activity(current_user->username, "SEND_MESSAGE", msg->recipient);
+            if (!history_page_add(&page, stored.id, stored.sender, stored.timestamp, stored.content)) {
+                more = true;
                 break;
             }
-            
-            case CMD_LOGOUT: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
+        }
+    }
 
-                /* mark user offline but keep connection open */
-                current_user->is_online = false;
-                current_user->socket = INVALID_SOCKET;
-                send_response(client_socket, CMD_SUCCESS, "Logged out");
-                log_activity(current_user->username, "LOGOUT", "User logged out");
+    memcpy(response->content, header, strlen(header));
+    memcpy(response->content + strlen(header), page.text + page.head, (size_t)(page.tail - page.head));
+    if (newer) {
+        uint64_t next = page.lines > 0 ? page.last_id : cursor;
+        if (next != UINT64_MAX) {
+            snprintf(response->extra_data, sizeof(response->extra_data), "AFTER:%llu", (unsigned long long)next);
+        }
+    } else if (more && page.lines > 0) {
+        snprintf(response->extra_data, sizeof(response->extra_data), "BEFORE:%llu",
+                 (unsigned long long)page.first_id);
+    }
+    return true;
+}
 
-                /* notify friends user went offline */
-                broadcast_to_friends(state, current_user->username, "User logged out");
+// Append a frame to the queue, taking a reference to it
+static int outbound_push(OutboundQueue* queue, Frame* frame) {
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 16;
+        Frame** frames = (Frame**)malloc(capacity * sizeof(Frame*));
+        if (!frames) return -1;
+        for (int i = 0; i < queue->count; i++) {
+            frames[i] = queue->frames[(queue->head + i) % queue->capacity];
+        }
+        free(queue->frames);
+        queue->frames = frames;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+    frame_retain(frame);
+    queue->frames[(queue->head + queue->count) % queue->capacity] = frame;
+    queue->count++;
+    queue->bytes += frame->len - (queue->count == 1 ? queue->offset : 0);
+    return 0;
+}
 
-                /* forget current_user for this connection so new login may happen */
-                current_user = NULL;
-                break;
-            }
+// Release every queued frame and the ring itself
+static void outbound_clear(OutboundQueue* queue) {
+    for (int i = 0; i < queue->count; i++) {
+        frame_release(queue->frames[(queue->head + i) % queue->capacity]);
+    }
+    free(queue->frames);
+    memset(queue, 0, sizeof(OutboundQueue));
+}
 
-            case CMD_DISCONNECT: {
-                if (current_user) {
-                    current_user->is_online = false;
-                    current_user->socket = INVALID_SOCKET;
-                    log_activity(current_user->username, "DISCONNECT", "User disconnected");
-                    
-                    // Notify friends
-                    broadcast_to_friends(state, current_user->username, "User went offline");
-                }
-                #ifdef _WIN32
-                LeaveCriticalSection(&state->mutex);
-                #else
-                pthread_mutex_unlock(&state->mutex);
-                #endif
-                close_socket(client_socket);
-                free(msg);
-                free(data);
-                #ifdef _WIN32
-                return 0;
-                #else
-                return NULL;
-                #endif
+// Drop written bytes from the front of the queue
+static void outbound_consume(OutboundQueue* queue, int written) {
+    queue->bytes -= written;
+    while (written > 0) {
+        Frame* head = queue->frames[queue->head];
+        int left = head->len - queue->offset;
+        if (written < left) {
+            queue->offset += written;
+            break;
+        }
+        written -= left;
+        frame_release(head);
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        queue->offset = 0;
+    }
+    if (queue->count == 0) {
+        outbound_clear(queue);
+    }
+}
+
+// Take and release Connection.send_lock (profiled in LOCK_PROFILE builds)
+static void connection_lock(Connection* conn) {
+    #ifdef LOCK_PROFILE
+    PROFILE_LOCK(&conn->send_lock, LOCK_SEND, mutex_trylock(&conn->send_lock), mutex_lock(&conn->send_lock));
+    #else
+    mutex_lock(&conn->send_lock);
+    #endif
+}
+
+static void connection_unlock(Connection* conn) {
+    #ifdef LOCK_PROFILE
+    PROFILE_UNLOCK(&conn->send_lock);
+    #endif
+    mutex_unlock(&conn->send_lock);
+}
+
+// Allocate state for a newly accepted connection
+Connection* connection_create(ServerState* state, socket_t socket, const struct sockaddr_in* addr) {
+    Connection* conn = (Connection*)calloc(1, sizeof(Connection));
+    if (!conn) return NULL;
+
+    conn->client_socket = socket;
+    /* frames are written whole, so do not hold small ones back (Nagle) */
+    int nodelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+    conn->client_addr = *addr;
+    conn->server_state = state;
+    conn->user = NULL;
+    atomic_init(&conn->refcount, 1);  // owned by the thread servicing it
+    mutex_init(&conn->send_lock);
+    metrics_connection_opened();
+    return conn;
+}
+
+void connection_retain(Connection* conn) {
+    atomic_fetch_add(&conn->refcount, 1);
+}
+
+// Drop a reference; the socket is closed once nobody can send on it
+void connection_release(Connection* conn) {
+    if (atomic_fetch_sub(&conn->refcount, 1) == 1) {
+        close_socket(conn->client_socket);
+        mutex_destroy(&conn->send_lock);
+        recv_buffer_free(&conn->pending);
+        metrics_outbound_queued(-(long)conn->outbound.bytes, 0);
+        outbound_clear(&conn->outbound);
+        free(conn);
+        metrics_connection_closed();
+    }
+}
+
+// Queue frames for the connection. The frames are written straight away
+// when nothing is queued ahead of them, gathered into one system call;
+// whatever the socket does not take stays queued by reference for the
+// outbound writer, so this never blocks on a slow receiver and never
+// copies a frame. Frames that would take the queue past OUTBOUND_LIMIT are
+// handled by the slow consumer policy. Returns SOCKET_ERROR if the frames
+// will not be delivered because the connection failed or was cut off.
+int connection_send(Connection* conn, Frame* const* frames, int count) {
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        total += frames[i]->len;
+    }
+
+    int rc = total;
+    bool overflow = false;
+    bool cut_off = false;
+    uint64_t started = metrics_timestamp();
+
+    connection_lock(conn);
+    OutboundQueue* queue = &conn->outbound;
+    int queued = queue->bytes;
+    int written = 0;
+
+    if (conn->send_failed) {
+        rc = SOCKET_ERROR;
+    } else if (queue->count == 0) {
+        written = send_frames_nonblocking(conn->client_socket, frames, count, 0);
+        if (written == SOCKET_ERROR) {
+            conn->send_failed = true;
+            rc = SOCKET_ERROR;
+        } else {
+            metrics_bytes_out(written);
+        }
+    } else if (queued + total > OUTBOUND_LIMIT) {
+        overflow = true;
+    }
+
+    if (rc != SOCKET_ERROR && !overflow && written < total) {
+        /* skip what was written; the first frame left may be partly sent */
+        int first = 0;
+        while (written >= frames[first]->len) {
+            written -= frames[first]->len;
+            first++;
+        }
+        queue->offset += written;
+        for (int i = first; i < count && !cut_off; i++) {
+            cut_off = outbound_push(queue, frames[i]) < 0;
+        }
+
+        if (!cut_off && !conn->write_watched) {
+            /* the writer's reference keeps the socket open until drained */
+            connection_retain(conn);
+            conn->write_watched = true;
+            if (outbound_writer_watch(conn) < 0) {
+                conn->write_watched = false;
+                connection_release(conn);
+                cut_off = true;
+            } else {
+                metrics_outbound_queued(0, 1);
             }
-            
-            case CMD_CREATE_GROUP: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                char group_id[MAX_GROUP_ID];
-                time_t now = time(NULL);
-                snprintf(group_id, sizeof(group_id), "GROUP_%s_%lld", current_user->username, (long long)now);
-                
-                Group* new_group = &state->groups[state->group_count++];
-                strncpy(new_group->group_id, group_id, MAX_GROUP_ID - 1);
-                strncpy(new_group->name, msg->content, MAX_GROUP_NAME - 1);
-                strncpy(new_group->creator, current_user->username, MAX_USERNAME - 1);
-                new_group->member_count = 1;
-                strncpy(new_group->members[0], current_user->username, MAX_USERNAME - 1);
-                new_group->admin_count = 1;
-                strncpy(new_group->admins[0], current_user->username, MAX_USERNAME - 1);
-                new_group->message_count = 0;
-                new_group->created_at = time(NULL);
-                
-                char response[200];
-                snprintf(response, sizeof(response), "Group created: %s", group_id);
-                send_response(client_socket, CMD_SUCCESS, response);
-                log_activity(current_user->username, "CREATE_GROUP", group_id);
-                break;
-            }
-            
-            case CMD_ADD_TO_GROUP: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                Group* group = find_group(state, msg->extra_data);
-                if (!group) {
-                    send_response(client_socket, CMD_ERROR, "Group not found");
-                    break;
-                }
-                
-                // Check if user is admin
-                bool is_admin = false;
-                for (int i = 0; i < group->admin_count; i++) {
-                    if (strcmp(group->admins[i], current_user->username) == 0) {
-                        is_admin = true;
-                        break;
-                    }
+        }
+    }
+
+    int dropped = 0;
+    if (overflow && slow_consumer_policy == SLOW_CONSUMER_DROP) {
+        dropped = ++conn->frames_dropped;
+        rc = 0;
+    } else if (overflow || cut_off) {
+        conn->send_failed = true;
+        outbound_clear(queue);
+        #ifdef _WIN32
+        shutdown(conn->client_socket, SD_BOTH);
+        #else
+        shutdown(conn->client_socket, SHUT_RDWR);
+        #endif
+        errno = ENOBUFS;
+        rc = SOCKET_ERROR;
+    }
+    metrics_outbound_queued((long)queue->bytes - queued, 0);
+    connection_unlock(conn);
+    metrics_send_done(started);
+
+    if (overflow) {
+        metrics_slow_consumer(rc == SOCKET_ERROR);
+    }
+    if (dropped == 1) {
+        printf("Dropping frames for slow consumer (%d bytes queued)\n", queued);
+    } else if (overflow && rc == SOCKET_ERROR) {
+        printf("Disconnecting slow consumer (%d bytes queued)\n", queued);
+    }
+    return rc;
+}
+
+// Write queued frames until the socket buffer fills. Called by the
+// outbound writer when the socket turns writable. Returns true if output
+// is still queued and the writer keeps watching (and its reference).
+bool connection_flush(Connection* conn) {
+    connection_lock(conn);
+    OutboundQueue* queue = &conn->outbound;
+    int queued = queue->bytes;
+    while (queue->count > 0 && !conn->send_failed) {
+        Frame* batch[64];
+        int n = 0;
+        while (n < queue->count && n < (int)(sizeof(batch) / sizeof(batch[0]))) {
+            batch[n] = queue->frames[(queue->head + n) % queue->capacity];
+            n++;
+        }
+
+        int written = send_frames_nonblocking(conn->client_socket, batch, n, queue->offset);
+        if (written == SOCKET_ERROR) {
+            conn->send_failed = true;
+        } else if (written == 0) {
+            break;
+        } else {
+            outbound_consume(queue, written);
+            metrics_bytes_out(written);
+        }
+    }
+
+    bool pending = queue->count > 0 && !conn->send_failed;
+    if (pending && outbound_writer_watch(conn) < 0) {
+        conn->send_failed = true;
+        pending = false;
+    }
+    if (!pending) {
+        outbound_clear(queue);
+        conn->write_watched = false;
+    }
+    metrics_outbound_queued((long)queue->bytes - queued, pending ? 0 : -1);
+    connection_unlock(conn);
+    return pending;
+}
+
+// Mark the connection's user offline, then drop the owner's reference
+void connection_close(Connection* conn) {
+    /* only clears the user if a newer login has not taken it over */
+    if (conn->user) {
+        detach_connection(conn->server_state, conn->user, conn);
+        conn->user = NULL;
+    }
+
+    /* wake the peer now even if a sender still holds a reference */
+    #ifdef _WIN32
+    shutdown(conn->client_socket, SD_BOTH);
+    #else
+    shutdown(conn->client_socket, SHUT_RDWR);
+    #endif
+    connection_release(conn);
+}
+
+// Handle client connection (thread-per-connection mode)
+#ifdef _WIN32
+DWORD WINAPI handle_client(LPVOID arg) {
+#else
+void* handle_client(void* arg) {
+#endif
+    Connection* conn = (Connection*)arg;
+    char buffer[RECV_CHUNK_SIZE + 1];
+
+    while (1) {
+        int bytes_received = recv(conn->client_socket, buffer, RECV_CHUNK_SIZE, 0);
+
+        if (bytes_received <= 0) {
+            break;
+        }
+
+        if (!process_input(conn, buffer, bytes_received)) break;
+    }
+
+    connection_close(conn);
+    release_thread_buffers();
+    #ifdef _WIN32
+    return 0;
+    #else
+    return NULL;
+    #endif
+}
+
+// Execute every complete frame in data, a chunk just read from the socket,
+// in order. A trailing partial frame is kept until the next read completes
+// it. data must have one writable byte past len. Returns false when the
+// connection should be closed.
+bool process_input(Connection* conn, char* data, int len) {
+    RecvBuffer* pending = &conn->pending;
+    char* buffer = data;
+    int available = len;
+    metrics_bytes_in(len);
+
+    /* frames are parsed straight from the read chunk unless an earlier
+       read left a partial frame behind */
+    if (pending->end > pending->start) {
+        if (recv_buffer_append(pending, data, len) < 0) return false;
+        buffer = pending->data + pending->start;
+        available = pending->end - pending->start;
+    }
+
+    int consumed = 0;
+    bool keep_open = true;
+    while (keep_open && consumed < available) {
+        char* frame = buffer + consumed;
+        int frame_len = find_frame_length(frame, available - consumed);
+        if (frame_len < 0) {
+            printf("Closing connection after malformed frame\n");
+            return false;
+        }
+        if (frame_len == 0) break;
+
+        char next = frame[frame_len];
+        frame[frame_len] = '\0';
+        keep_open = process_frame(conn, frame, frame_len);
+        frame[frame_len] = next;
+        consumed += frame_len;
+    }
+
+    if (buffer == data) {
+        if (keep_open && consumed < available &&
+            recv_buffer_append(pending, data + consumed, available - consumed) < 0) {
+            return false;
+        }
+    } else {
+        recv_buffer_consume(pending, consumed);
+    }
+    return keep_open;
+}
+
+// Decode and execute one frame received on a connection. Returns false
+// when the connection should be closed.
+bool process_frame(Connection* conn, char* buffer, int len) {
+    CommandTiming timing;
+    metrics_command_begin(&timing);
+
+    /* parsed in place: the fields point into buffer, nothing is copied */
+    ProtocolFormat format = detect_protocol_format(buffer, len);
+    MessageView request;
+    if (parse_message_view(buffer, len, &request) < 0) return true;
+    const MessageView* msg = &request;
+
+    /* the first frame negotiates the format used for everything sent back */
+    if (!conn->format_known) {
+        conn->format = format;
+        conn->format_known = true;
+    }
+
+    lock_profile_set_command(msg->cmd);
+    bool keep_open = process_command(conn, msg);
+    lock_profile_set_command(-1);
+    metrics_command_end(&timing, msg->cmd);
+    return keep_open;
+}
+
+// Execute one command received on a connection. Returns false when the
+// client asked to disconnect and the connection should be closed.
+//
+// Only the thread servicing conn touches conn->user, so it needs no lock.
+// Each command takes the narrowest locks it needs (see ServerState).
+bool process_command(Connection* conn, const MessageView* msg) {
+    ServerState* state = conn->server_state;
+    User* current_user = conn->user;
+    bool keep_open = true;
+
+    // Handle commands
+    switch (msg->cmd) {
+        case CMD_LOGIN: {
+            User* user = find_user(state, msg->sender.data);
+            Connection* previous = NULL;
+            bool logged_in = false;
+            if (user) {
+                state_lock(user_lock(state, user), LOCK_USER_STRIPE);
+                if (strcmp(user->password, msg->content.data) == 0) {
+                    previous = user->conn;
+                    connection_retain(conn);  // reference held by user->conn
+                    user->conn = conn;
+                    user->is_online = true;
+                    logged_in = true;
                 }
-                
-                if (!is_admin) {
-                    send_response(client_socket, CMD_ERROR, "Not an admin");
-                    break;
+                state_unlock(user_lock(state, user));
+            }
+            if (previous) {
+                connection_release(previous);
+            }
+
+            if (logged_in) {
+                if (current_user && current_user != user) {
+                    detach_connection(state, current_user, conn);
                 }
-                
-                User* new_member = find_user(state, msg->recipient);
-                if (!new_member) {
-                    send_response(client_socket, CMD_ERROR, "User not found");
+                current_user = user;
+                conn->acks_offline = strcmp(msg->extra.data, "ACK_OFFLINE") == 0;
+                send_response(conn, CMD_SUCCESS, "Login successful");
+                log_activity(msg->sender.data, "LOGIN", "User logged in");
+
+                // Send offline messages
+                deliver_offline_messages(conn, user);
+            } else {
+                send_response(conn, CMD_ERROR, "Invalid credentials");
+            }
+            break;
+        }
+
+        case CMD_REGISTER: {
+            state_lock(&state->account_lock, LOCK_ACCOUNT);
+            if (find_user(state, msg->sender.data) != NULL) {
+                state_unlock(&state->account_lock);
+                send_response(conn, CMD_ERROR, "Username already exists");
+                break;
+            }
+
+            User* new_user = add_user(state, msg->sender.data, msg->content.data);
+            state_unlock(&state->account_lock);
+            statestore_flush(&state_store);
+            if (!new_user) {
+                send_response(conn, CMD_ERROR, "Failed to register user");
+                break;
+            }
+            send_response(conn, CMD_SUCCESS, "Registration successful");
+            log_activity(msg->sender.data, "REGISTER", "New user registered");
+            break;
+        }
+
+        case CMD_GET_FRIENDS: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            uint32_t friend_count;
+            state_lock(user_lock(state, current_user), LOCK_USER_STRIPE);
+            UserId* friends = copy_ids(&current_user->friends, &friend_count);
+            state_unlock(user_lock(state, current_user));
+
+            /* as many friends as fit in one response */
+            char friend_list[MAX_CONTENT] = "Friends: ";
+            size_t len = strlen(friend_list);
+            for (uint32_t i = 0; i < friend_count; i++) {
+                User* friend = user_by_id(state, friends[i]);
+                state_lock(user_lock(state, friend), LOCK_USER_STRIPE);
+                bool online = friend->is_online;
+                state_unlock(user_lock(state, friend));
+                int written = snprintf(friend_list + len, sizeof(friend_list) - len, "%s%s", friend->username,
+                                       online ? "(online) " : "(offline) ");
+                if (written < 0 || (size_t)written >= sizeof(friend_list) - len) {
+                    friend_list[len] = '\0';
                     break;
                 }
-                
-                // Check if already member
-                bool already_member = false;
-                for (int i = 0; i < group->member_count; i++) {
-                    if (strcmp(group->members[i], msg->recipient) == 0) {
-                        already_member = true;
-                        break;
-                    }
+                len += (size_t)written;
+            }
+            send_response(conn, CMD_GET_FRIENDS, friend_list);
+            log_activity(current_user->username, "GET_FRIENDS", "Retrieved friend list");
+            break;
+        }
+
+        case CMD_ADD_FRIEND: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            User* friend_user = find_user(state, msg->recipient.data);
+            if (!friend_user) {
+                send_response(conn, CMD_ERROR, "User not found");
+                break;
+            }
+
+            if (strcmp(current_user->username, msg->recipient.data) == 0) {
+                send_response(conn, CMD_ERROR, "Cannot add yourself");
+                break;
+            }
+
+            lock_user_pair(state, current_user, friend_user);
+            const char* error = NULL;
+            if (are_friends(current_user, friend_user)) {
+                error = "Already friends";
+            } else if (add_friend(current_user, friend_user) < 0) {
+                error = "Failed to add friend";
+            } else {
+                log_state_change(STATE_FRIENDS, current_user->id, friend_user->id);
+            }
+            unlock_user_pair(state, current_user, friend_user);
+            statestore_flush(&state_store);
+
+            if (error) {
+                send_response(conn, CMD_ERROR, error);
+                break;
+            }
+            send_response(conn, CMD_SUCCESS, "Friend added");
+            log_activity(current_user->username, "ADD_FRIEND", msg->recipient.data);
+            break;
+        }
+
+        case CMD_SEND_MESSAGE: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            User* recipient = find_user(state, msg->recipient.data);
+            if (!recipient) {
+                send_response(conn, CMD_ERROR, "Recipient not found");
+                break;
+            }
+
+            lock_user_pair(state, current_user, recipient);
+            bool blocked = is_blocked(current_user, recipient) || is_blocked(recipient, current_user);
+            unlock_user_pair(state, current_user, recipient);
+            if (blocked) {
+                send_response(conn, CMD_ERROR, "User is blocked");
+                break;
+            }
+
+            // Save message
+            uint64_t message_id;
+            MsgLocation location;
+            if (save_message(current_user->username, msg->recipient.data, msg->content.data, msg->msg_type, false,
+                             &message_id, &location) < 0) {
+                send_response(conn, CMD_ERROR, "Failed to store message");
+                break;
+            }
+
+            // Send to recipient if online, otherwise queue it for their next login
+            Connection* recipient_conn = user_connection_or_inbox(state, recipient, message_id, location);
+            inbox_flush(&offline_inbox);
+            if (recipient_conn) {
+                // Relay the content straight from the request frame
+                MessageView response = { CMD_RECEIVE_MESSAGE, str_view(current_user->username), str_view(""),
+                                         msg->content, str_view(""), msg->msg_type, false };
+
+                OutgoingMessage out;
+                outgoing_init_view(&out, &response);
+                if (outgoing_send(&out, recipient_conn) == SOCKET_ERROR) {
+                    #ifdef _WIN32
+                    printf("Failed to send message to %s: %d\n", msg->recipient.data, WSAGetLastError());
+                    #else
+                    printf("Failed to send message to %s: %s\n", msg->recipient.data, strerror(errno));
+                    #endif
                 }
-                
-                if (!already_member) {
-                    strncpy(group->members[group->member_count++], msg->recipient, MAX_USERNAME - 1);
-                    send_response(client_socket, CMD_SUCCESS, "User added to group");
-                    log_activity(current_user->username, "ADD_TO_GROUP", msg->recipient);
+                outgoing_free(&out);
+                connection_release(recipient_conn);
+            }
+
+            send_response(conn, CMD_SUCCESS, "Message sent");
+            log_activity(current_user->username, "SEND_MESSAGE", msg->recipient.data);
+            break;
+        }
+
+        case CMD_LOGOUT: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            /* mark user offline but keep connection open */
+            detach_connection(state, current_user, conn);
+            send_response(conn, CMD_SUCCESS, "Logged out");
+            log_activity(current_user->username, "LOGOUT", "User logged out");
+
+            /* notify friends user went offline */
+            broadcast_to_friends(state, current_user->username, "User logged out");
+
+            /* forget current_user for this connection so new login may happen */
+            current_user = NULL;
+            break;
+        }
+
+        case CMD_DISCONNECT: {
+            if (current_user) {
+                detach_connection(state, current_user, conn);
+                log_activity(current_user->username, "DISCONNECT", "User disconnected");
+
+                // Notify friends
+                broadcast_to_friends(state, current_user->username, "User went offline");
+                current_user = NULL;
+            }
+            keep_open = false;
+            break;
+        }
+
+        case CMD_CREATE_GROUP: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            char group_id[MAX_GROUP_ID];
+            Group* new_group = create_group(state, msg->content.data, current_user, group_id);
+            statestore_flush(&state_store);
+            if (!new_group) {
+                send_response(conn, CMD_ERROR, "Group limit reached");
+                break;
+            }
+
+            char response[200];
+            snprintf(response, sizeof(response), "Group created: %s", group_id);
+            send_response(conn, CMD_SUCCESS, response);
+            log_activity(current_user->username, "CREATE_GROUP", group_id);
+            break;
+        }
+
+        case CMD_ADD_TO_GROUP: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            Group* group = find_group(state, msg->extra.data);
+            if (!group) {
+                send_response(conn, CMD_ERROR, "Group not found");
+                break;
+            }
+
+            User* new_member = find_user(state, msg->recipient.data);
+
+            state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+            const char* error = NULL;
+            // Check if user is admin
+            if (!idset_contains(&group->admins, current_user->id)) {
+                error = "Not an admin";
+            } else if (!new_member) {
+                error = "User not found";
+            } else {
+                int added = idset_add(&group->members, new_member->id);
+                if (added == 0) {
+                    error = "User already in group";
+                } else if (added < 0) {
+                    error = "Failed to add member";
                 } else {
-                    send_response(client_socket, CMD_ERROR, "User already in group");
+                    log_state_change(STATE_JOIN, (uint32_t)group->id, new_member->id);
                 }
+            }
+            state_unlock(group_lock(state, group));
+            statestore_flush(&state_store);
+
+            if (error) {
+                send_response(conn, CMD_ERROR, error);
                 break;
             }
-            
-            case CMD_REMOVE_FROM_GROUP: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                Group* group = find_group(state, msg->extra_data);
-                if (!group) {
-                    send_response(client_socket, CMD_ERROR, "Group not found");
-                    break;
-                }
-                
-                // Check if user is admin
-                bool is_admin = false;
-                for (int i = 0; i < group->admin_count; i++) {
-                    if (strcmp(group->admins[i], current_user->username) == 0) {
-                        is_admin = true;
-                        break;
-                    }
-                }
-                
-                if (!is_admin) {
-                    send_response(client_socket, CMD_ERROR, "Not an admin");
-                    break;
-                }
-                
-                // Remove member
-                for (int i = 0; i < group->member_count; i++) {
-                    if (strcmp(group->members[i], msg->recipient) == 0) {
-                        // Shift remaining members
-                        for (int j = i; j < group->member_count - 1; j++) {
-                            strcpy(group->members[j], group->members[j + 1]);
-                        }
-                        group->member_count--;
-                        send_response(client_socket, CMD_SUCCESS, "User removed from group");
-                        log_activity(current_user->username, "REMOVE_FROM_GROUP", msg->recipient);
-                        break;
-                    }
-                }
+            send_response(conn, CMD_SUCCESS, "User added to group");
+            log_activity(current_user->username, "ADD_TO_GROUP", msg->recipient.data);
+            break;
+        }
+
+        case CMD_REMOVE_FROM_GROUP: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
                 break;
             }
-            
-            case CMD_LEAVE_GROUP: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                Group* group = find_group(state, msg->extra_data);
-                if (!group) {
-                    send_response(client_socket, CMD_ERROR, "Group not found");
-                    break;
-                }
-                
-                // Remove from group
-                for (int i = 0; i < group->member_count; i++) {
-                    if (strcmp(group->members[i], current_user->username) == 0) {
-                        for (int j = i; j < group->member_count - 1; j++) {
-                            strcpy(group->members[j], group->members[j + 1]);
-                        }
-                        group->member_count--;
-                        send_response(client_socket, CMD_SUCCESS, "Left group");
-                        log_activity(current_user->username, "LEAVE_GROUP", msg->extra_data);
-                        break;
-                    }
-                }
+
+            Group* group = find_group(state, msg->extra.data);
+            if (!group) {
+                send_response(conn, CMD_ERROR, "Group not found");
                 break;
             }
-            
-            case CMD_GROUP_MESSAGE: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                Group* group = find_group(state, msg->recipient);
-                if (!group) {
-                    send_response(client_socket, CMD_ERROR, "Group not found");
-                    break;
-                }
-                
-                // Check if user is member
-                bool is_member = false;
-                for (int i = 0; i < group->member_count; i++) {
-                    if (strcmp(group->members[i], current_user->username) == 0) {
-                        is_member = true;
-                        break;
-                    }
-                }
-                
-                if (!is_member) {
-                    send_response(client_socket, CMD_ERROR, "Not a member");
-                    break;
-                }
-                
-                // Add message to group
-                Message* group_msg = &group->messages[group->message_count++];
-                time_t now = time(NULL);
-                snprintf(group_msg->id, sizeof(group_msg->id), "%s_%lld", current_user->username, (long long)now);
-                strncpy(group_msg->sender, current_user->username, MAX_USERNAME - 1);
-                strncpy(group_msg->content, msg->content, MAX_CONTENT - 1);
+
+            User* member = find_user(state, msg->recipient.data);
+
+            state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+            // Check if user is admin
+            bool is_admin = idset_contains(&group->admins, current_user->id);
+            bool removed = is_admin && member && idset_remove(&group->members, member->id);
+            if (removed) log_state_change(STATE_LEAVE, (uint32_t)group->id, member->id);
+            state_unlock(group_lock(state, group));
+            statestore_flush(&state_store);
+
+            if (!is_admin) {
+                send_response(conn, CMD_ERROR, "Not an admin");
+                break;
+            }
+
+            if (removed) {
+                send_response(conn, CMD_SUCCESS, "User removed from group");
+                log_activity(current_user->username, "REMOVE_FROM_GROUP", msg->recipient.data);
+            }
+            break;
+        }
+
+        case CMD_LEAVE_GROUP: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            Group* group = find_group(state, msg->extra.data);
+            if (!group) {
+                send_response(conn, CMD_ERROR, "Group not found");
+                break;
+            }
+
+            // Remove from group
+            state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+            bool removed = idset_remove(&group->members, current_user->id);
+            if (removed) log_state_change(STATE_LEAVE, (uint32_t)group->id, current_user->id);
+            state_unlock(group_lock(state, group));
+            statestore_flush(&state_store);
+
+            if (removed) {
+                send_response(conn, CMD_SUCCESS, "Left group");
+                log_activity(current_user->username, "LEAVE_GROUP", msg->extra.data);
+            }
+            break;
+        }
+
+        case CMD_GROUP_MESSAGE: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            Group* group = find_group(state, msg->recipient.data);
+            if (!group) {
+                send_response(conn, CMD_ERROR, "Group not found");
+                break;
+            }
+
+            /* fan out from a snapshot of the members so sends happen without the lock */
+            UserId* members = NULL;
+            uint32_t member_count = 0;
+            const char* error = NULL;
+
+            state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+            // Check if user is member
+            if (!idset_contains(&group->members, current_user->id)) {
+                error = "Not a member";
+            } else if (!(members = copy_ids(&group->members, &member_count))) {
+                error = "Failed to store message";
+            }
+            state_unlock(group_lock(state, group));
+
+            if (error) {
+                send_response(conn, CMD_ERROR, error);
+                break;
+            }
+
+            uint64_t message_id;
+            MsgLocation location;
+            if (save_message(current_user->username, msg->recipient.data, msg->content.data, msg->msg_type, true,
+                             &message_id, &location) < 0) {
+                send_response(conn, CMD_ERROR, "Failed to store message");
+                break;
+            }
+
+            // Keep it in the group's recent history
+            state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+            Message* group_msg = history_push(&group->history, message_id, msg->content.data);
+            if (group_msg) {
+                group_msg->sender = current_user->id;
                 group_msg->type = msg->msg_type;
                 group_msg->timestamp = time(NULL);
                 group_msg->is_pinned = msg->is_pinned;
-                
-                save_message_to_file(current_user->username, msg->recipient, msg->content, true);
-                
-                // Broadcast to all online members
-                ProtocolMessage response;
-                memset(&response, 0, sizeof(ProtocolMessage));
-                response.cmd = CMD_RECEIVE_MESSAGE;
-                strncpy(response.sender, current_user->username, MAX_USERNAME - 1);
-                strncpy(response.recipient, msg->recipient, MAX_USERNAME - 1);
-                strncpy(response.content, msg->content, MAX_CONTENT - 1);
-                response.msg_type = msg->msg_type;
-                
-                int len;
-                char* resp_buffer = serialize_protocol_message(&response, &len);
-                
-                for (int i = 0; i < group->member_count; i++) {
-                    User* member = find_user(state, group->members[i]);
-                    if (member && member->is_online && member->socket != INVALID_SOCKET && 
-                        strcmp(member->username, current_user->username) != 0) {
-                        if (send(member->socket, resp_buffer, len, 0) == SOCKET_ERROR) {
-                            #ifdef _WIN32
-                            printf("Failed to send group message to %s: %d\n", member->username, WSAGetLastError());
-                            #else
-                            printf("Failed to send group message to %s: %s\n", member->username, strerror(errno));
-                            #endif
-                        }
+            }
+            if (msg->is_pinned) {
+                group_pin(group, message_id, msg->content.data);
+            }
+            state_unlock(group_lock(state, group));
+            if (msg->is_pinned) statestore_flush(&state_store);
+
+            // Broadcast to all online members
+            MessageView response = { CMD_RECEIVE_MESSAGE, str_view(current_user->username), msg->recipient,
+                                     msg->content, str_view(""), msg->msg_type, false };
+
+            OutgoingMessage out;
+            outgoing_init_view(&out, &response);
+
+            for (uint32_t i = 0; i < member_count; i++) {
+                if (members[i] == current_user->id) continue;
+                User* member = user_by_id(state, members[i]);
+                Connection* member_conn = user_connection_or_inbox(state, member, message_id, location);
+                if (member_conn) {
+                    if (outgoing_send(&out, member_conn) == SOCKET_ERROR) {
+                        #ifdef _WIN32
+                        printf("Failed to send group message to %s: %d\n", member->username, WSAGetLastError());
+                        #else
+                        printf("Failed to send group message to %s: %s\n", member->username, strerror(errno));
+                        #endif
                     }
+                    connection_release(member_conn);
                 }
-                free(resp_buffer);
-                
-                send_response(client_socket, CMD_SUCCESS, "Group message sent");
-                log_activity(current_user->username, "GROUP_MESSAGE", msg->recipient);
+            }
+            outgoing_free(&out);
+            inbox_flush(&offline_inbox);
+
+            send_response(conn, CMD_SUCCESS, "Group message sent");
+            log_activity(current_user->username, "GROUP_MESSAGE", msg->recipient.data);
+            break;
+        }
+
+        case CMD_SEARCH_HISTORY: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
                 break;
             }
-            
-            case CMD_SEARCH_HISTORY: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                int result_count = 0;
-                char** results = search_messages(msg->content, current_user->username, msg->recipient, &result_count);
-                
-                char response[BUFFER_SIZE] = "Search results: ";
-                for (int i = 0; i < result_count && i < 10; i++) {
-                    strcat(response, results[i]);
-                    strcat(response, " | ");
-                    free(results[i]);
+
+            /* extra_data carries the page cursor from a previous response */
+            uint32_t cursor = (uint32_t)strtoul(msg->extra.data, NULL, 10);
+            uint32_t next_cursor = 0;
+            int result_count = 0;
+            char** results = search_messages(state, msg->content.data, current_user->username, msg->recipient.data,
+                                             cursor, &result_count, &next_cursor);
+
+            ProtocolMessage response;
+            memset(&response, 0, sizeof(ProtocolMessage));
+            response.cmd = CMD_SEARCH_HISTORY;
+            int used = snprintf(response.content, MAX_CONTENT, "Search results: ");
+            for (int i = 0; i < result_count; i++) {
+                if (used < MAX_CONTENT - 1) {
+                    int n = snprintf(response.content + used, MAX_CONTENT - used, "%s | ", results[i]);
+                    used = n < 0 ? used : used + n;
                 }
-                free(results);
-                
-                send_response(client_socket, CMD_SEARCH_HISTORY, response);
-                log_activity(current_user->username, "SEARCH_HISTORY", msg->content);
+                free(results[i]);
+            }
+            free(results);
+            if (next_cursor) {
+                snprintf(response.extra_data, sizeof(response.extra_data), "%u", next_cursor);
+            }
+
+            OutgoingMessage out;
+            outgoing_init(&out, &response);
+            outgoing_send(&out, conn);
+            outgoing_free(&out);
+            log_activity(current_user->username, "SEARCH_HISTORY", msg->content.data);
+            break;
+        }
+
+        case CMD_SET_GROUP_NAME: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
                 break;
             }
-            
-            case CMD_SET_GROUP_NAME: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                Group* group = find_group(state, msg->extra_data);
-                if (!group) {
-                    send_response(client_socket, CMD_ERROR, "Group not found");
-                    break;
-                }
-                
-                // Check if user is admin
-                bool is_admin = false;
-                for (int i = 0; i < group->admin_count; i++) {
-                    if (strcmp(group->admins[i], current_user->username) == 0) {
-                        is_admin = true;
-                        break;
-                    }
-                }
-                
-                if (is_admin) {
-                    strncpy(group->name, msg->content, MAX_GROUP_NAME - 1);
-                    send_response(client_socket, CMD_SUCCESS, "Group name updated");
-                    log_activity(current_user->username, "SET_GROUP_NAME", msg->extra_data);
-                } else {
-                    send_response(client_socket, CMD_ERROR, "Not an admin");
-                }
+
+            Group* group = find_group(state, msg->extra.data);
+            if (!group) {
+                send_response(conn, CMD_ERROR, "Group not found");
                 break;
             }
-            
-            case CMD_BLOCK_USER: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                if (strcmp(current_user->username, msg->recipient) == 0) {
-                    send_response(client_socket, CMD_ERROR, "Cannot block yourself");
-                    break;
-                }
-                
-                if (is_blocked(current_user, msg->recipient)) {
-                    send_response(client_socket, CMD_ERROR, "User already blocked");
-                    break;
-                }
-                
-                strncpy(current_user->blocked_users[current_user->blocked_count++], 
-                       msg->recipient, MAX_USERNAME - 1);
-                send_response(client_socket, CMD_SUCCESS, "User blocked");
-                log_activity(current_user->username, "BLOCK_USER", msg->recipient);
+
+            state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+            // Check if user is admin
+            bool is_admin = idset_contains(&group->admins, current_user->id);
+            if (is_admin) {
+                strncpy(group->name, msg->content.data, MAX_GROUP_NAME - 1);
+                StateRecord record;
+                memset(&record, 0, sizeof(record));
+                record.kind = STATE_RENAME;
+                record.subject = (uint32_t)group->id;
+                record.text = group->name;
+                record.text_len = (int)strlen(group->name);
+                statestore_log(&state_store, &record);
+            }
+            state_unlock(group_lock(state, group));
+            statestore_flush(&state_store);
+
+            if (is_admin) {
+                send_response(conn, CMD_SUCCESS, "Group name updated");
+                log_activity(current_user->username, "SET_GROUP_NAME", msg->extra.data);
+            } else {
+                send_response(conn, CMD_ERROR, "Not an admin");
+            }
+            break;
+        }
+
+        case CMD_BLOCK_USER: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
                 break;
             }
-            
-            case CMD_UNBLOCK_USER: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                for (int i = 0; i < current_user->blocked_count; i++) {
-                    if (strcmp(current_user->blocked_users[i], msg->recipient) == 0) {
-                        for (int j = i; j < current_user->blocked_count - 1; j++) {
-                            strcpy(current_user->blocked_users[j], current_user->blocked_users[j + 1]);
+
+            if (strcmp(current_user->username, msg->recipient.data) == 0) {
+                send_response(conn, CMD_ERROR, "Cannot block yourself");
+                break;
+            }
+
+            User* blocked_user = find_user(state, msg->recipient.data);
+            if (!blocked_user) {
+                send_response(conn, CMD_ERROR, "User not found");
+                break;
+            }
+
+            state_lock(user_lock(state, current_user), LOCK_USER_STRIPE);
+            const char* error = NULL;
+            int added = idset_add(&current_user->blocked, blocked_user->id);
+            if (added == 0) {
+                error = "User already blocked";
+            } else if (added < 0) {
+                error = "Failed to block user";
+            } else {
+                log_state_change(STATE_BLOCK, current_user->id, blocked_user->id);
+            }
+            state_unlock(user_lock(state, current_user));
+            statestore_flush(&state_store);
+
+            if (error) {
+                send_response(conn, CMD_ERROR, error);
+                break;
+            }
+            send_response(conn, CMD_SUCCESS, "User blocked");
+            log_activity(current_user->username, "BLOCK_USER", msg->recipient.data);
+            break;
+        }
+
+        case CMD_UNBLOCK_USER: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            User* blocked_user = find_user(state, msg->recipient.data);
+            bool unblocked = false;
+            if (blocked_user) {
+                state_lock(user_lock(state, current_user), LOCK_USER_STRIPE);
+                unblocked = idset_remove(&current_user->blocked, blocked_user->id);
+                if (unblocked) log_state_change(STATE_UNBLOCK, current_user->id, blocked_user->id);
+                state_unlock(user_lock(state, current_user));
+                statestore_flush(&state_store);
+            }
+
+            if (unblocked) {
+                send_response(conn, CMD_SUCCESS, "User unblocked");
+                log_activity(current_user->username, "UNBLOCK_USER", msg->recipient.data);
+            }
+            break;
+        }
+
+        case CMD_PIN_MESSAGE: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
+                break;
+            }
+
+            // Find and pin message in group or conversation
+            if (strncmp(msg->recipient.data, "GROUP_", 6) == 0) {
+                Group* group = find_group(state, msg->recipient.data);
+                /* extra_data is the id shown in the group's history */
+                char* end;
+                unsigned long long message_id = strtoull(msg->extra.data, &end, 10);
+                if (group && end != msg->extra.data && *end == '\0') {
+                    bool pinned = false;
+                    bool in_ring = false;
+                    state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+                    Message* message = history_find(&group->history, message_id);
+                    if (message) {
+                        in_ring = true;
+                        pinned = message->is_pinned || group_pin(group, message_id, message->content) == 0;
+                        message->is_pinned = pinned;
+                    }
+                    state_unlock(group_lock(state, group));
+
+                    // Older messages are looked up in the message store
+                    SearchDoc doc;
+                    if (!in_ring && search_index_find_group_message(&search_index, group->group_id, message_id, &doc)) {
+                        StoredMessage stored;
+                        char content[MAX_CONTENT];
+                        if (msgstore_read(&message_store, doc.location, &stored, content, sizeof(content)) == 0) {
+                            state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+                            pinned = group_pin(group, message_id, content) == 0;
+                            state_unlock(group_lock(state, group));
                         }
-                        current_user->blocked_count--;
-                        send_response(client_socket, CMD_SUCCESS, "User unblocked");
-                        log_activity(current_user->username, "UNBLOCK_USER", msg->recipient);
-                        break;
+                    }
+
+                    statestore_flush(&state_store);
+
+                    if (pinned) {
+                        send_response(conn, CMD_SUCCESS, "Message pinned");
+                        log_activity(current_user->username, "PIN_MESSAGE", msg->extra.data);
                     }
                 }
+            }
+            break;
+        }
+
+        case CMD_GET_PINNED: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
                 break;
             }
-            
-            case CMD_PIN_MESSAGE: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
-                    break;
-                }
-                
-                // Find and pin message in group or conversation
-                if (strncmp(msg->recipient, "GROUP_", 6) == 0) {
-                    Group* group = find_group(state, msg->recipient);
-                    if (group) {
-                        for (int i = 0; i < group->message_count; i++) {
-                            if (strcmp(group->messages[i].id, msg->extra_data) == 0) {
-                                group->messages[i].is_pinned = true;
-                                send_response(client_socket, CMD_SUCCESS, "Message pinned");
-                                log_activity(current_user->username, "PIN_MESSAGE", msg->extra_data);
-                                break;
-                            }
+
+            char pinned_list[BUFFER_SIZE] = "Pinned messages: ";
+            if (strncmp(msg->recipient.data, "GROUP_", 6) == 0) {
+                Group* group = find_group(state, msg->recipient.data);
+                if (group) {
+                    state_lock(group_lock(state, group), LOCK_GROUP_STRIPE);
+                    for (int i = 0; i < group->pinned_count; i++) {
+                        if (strlen(pinned_list) + strlen(group->pinned[i].content) + 4 < sizeof(pinned_list)) {
+                            strcat(pinned_list, group->pinned[i].content);
+                            strcat(pinned_list, " | ");
                         }
                     }
+                    state_unlock(group_lock(state, group));
                 }
+            }
+            send_response(conn, CMD_GET_PINNED, pinned_list);
+            break;
+        }
+
+        case CMD_GET_HISTORY: {
+            if (!current_user) {
+                send_response(conn, CMD_ERROR, "Not logged in");
                 break;
             }
-            
-            case CMD_GET_PINNED: {
-                if (!current_user) {
-                    send_response(client_socket, CMD_ERROR, "Not logged in");
+
+            Group* group = find_group(state, msg->recipient.data);
+            if (!group) {
+                send_response(conn, CMD_ERROR, "Group not found");
+                break;
+            }
+
+            /* extra_data is empty for the newest page, or BEFORE:<id> / AFTER:<id> */
+            uint64_t cursor = UINT64_MAX;
+            bool newer = false;
+            if (msg->extra.data[0] != '\0') {
+                newer = strncmp(msg->extra.data, "AFTER:", 6) == 0;
+                const char* id_text = msg->extra.data + (newer ? 6 : 7);
+                char* end;
+                errno = 0;
+                unsigned long long value = strtoull(id_text, &end, 10);
+                if ((!newer && strncmp(msg->extra.data, "BEFORE:", 7) != 0) || end == id_text ||
+                    *end != '\0' || errno == ERANGE || value == UINT64_MAX) {
+                    send_response(conn, CMD_ERROR, "Invalid history cursor");
                     break;
                 }
-                
-                char pinned_list[BUFFER_SIZE] = "Pinned messages: ";
-                if (strncmp(msg->recipient, "GROUP_", 6) == 0) {
-                    Group* group = find_group(state, msg->recipient);
-                    if (group) {
-                        for (int i = 0; i < group->message_count; i++) {
-                            if (group->messages[i].is_pinned) {
-                                strcat(pinned_list, group->messages[i].content);
-                                strcat(pinned_list, " | ");
-                            }
-                        }
-                    }
-                }
-                send_response(client_socket, CMD_GET_PINNED, pinned_list);
-                break;
+                cursor = value;
             }
-            
-            default:
-                send_response(client_socket, CMD_ERROR, "Unknown command");
+            int limit = msg->content.data[0] != '\0' ? atoi(msg->content.data) : HISTORY_PAGE_DEFAULT;
+            if (limit < 1) limit = 1;
+            if (limit > HISTORY_PAGE_MAX) limit = HISTORY_PAGE_MAX;
+
+            ProtocolMessage response;
+            memset(&response, 0, sizeof(ProtocolMessage));
+            response.cmd = CMD_GET_HISTORY;
+            strncpy(response.recipient, msg->recipient.data, MAX_USERNAME - 1);
+            if (!group_history_page(state, group, current_user, cursor, newer, limit, &response)) {
+                send_response(conn, CMD_ERROR, "Not a member");
                 break;
+            }
+
+            OutgoingMessage out;
+            outgoing_init(&out, &response);
+            outgoing_send(&out, conn);
+            outgoing_free(&out);
+            log_activity(current_user->username, "GET_HISTORY", msg->recipient.data);
+            break;
         }
 
-        #ifdef _WIN32
-        LeaveCriticalSection(&state->mutex);
-        #else
-        pthread_mutex_unlock(&state->mutex);
-        #endif
+        case CMD_ACK_OFFLINE: {
+            // Client has shown offline messages up to a sequence number;
+            // no response, so acknowledging never interleaves with replies
+            if (!current_user) {
+                break;
+            }
 
-        free(msg);
-    }
+            const char* seq_text = msg->extra.data;
+            if (strncmp(seq_text, "OFFLINE:", 8) == 0) {
+                seq_text += 8;
+            }
+            char* end;
+            unsigned long long seq = strtoull(seq_text, &end, 10);
+            if (end != seq_text && seq > 0) {
+                inbox_ack(&offline_inbox, current_user->username, (uint64_t)seq);
+                inbox_flush(&offline_inbox);
+            }
+            break;
+        }
 
-    if (current_user) {
-        current_user->is_online = false;
-        current_user->socket = INVALID_SOCKET;
+        default:
+            send_response(conn, CMD_ERROR, "Unknown command");
+            break;
     }
-    
-    close_socket(client_socket);
-    free(data);
-    #ifdef _WIN32
-    return 0;
-    #else
-    return NULL;
-    #endif
+
+    conn->user = current_user;
+    return keep_open;
 }
 
 // Broadcast message to all friends
 void broadcast_to_friends(ServerState* state, const char* username, const char* message) {
     User* user = find_user(state, username);
     if (!user) return;
-    
+
+    uint32_t friend_count;
+    state_lock(user_lock(state, user), LOCK_USER_STRIPE);
+    UserId* friends = copy_ids(&user->friends, &friend_count);
+    state_unlock(user_lock(state, user));
+
     ProtocolMessage msg;
     memset(&msg, 0, sizeof(ProtocolMessage));
     msg.cmd = CMD_RECEIVE_MESSAGE;
     strncpy(msg.sender, username, MAX_USERNAME - 1);
     strncpy(msg.content, message, MAX_CONTENT - 1);
     msg.msg_type = MSG_SYSTEM;
-    
-    int len;
-    char* buffer = serialize_protocol_message(&msg, &len);
-    
-    for (int i = 0; i < user->friend_count; i++) {
-        User* friend = find_user(state, user->friends[i]);
-        if (friend && friend->is_online && friend->socket != INVALID_SOCKET) {
-            if (send(friend->socket, buffer, len, 0) == SOCKET_ERROR) {
+
+    OutgoingMessage out;
+    outgoing_init(&out, &msg);
+
+    for (uint32_t i = 0; i < friend_count; i++) {
+        User* friend = user_by_id(state, friends[i]);
+        Connection* friend_conn = user_connection(state, friend);
+        if (friend_conn) {
+            if (outgoing_send(&out, friend_conn) == SOCKET_ERROR) {
                 #ifdef _WIN32
                 printf("Failed to broadcast to %s: %d\n", friend->username, WSAGetLastError());
                 #else
                 printf("Failed to broadcast to %s: %s\n", friend->username, strerror(errno));
                 #endif
             }
+            connection_release(friend_conn);
         }
     }
-    
-    free(buffer);
+
+    outgoing_free(&out);
+}
+
+// Append a message to the message store and make it searchable. Its id
+// and location are stored through id_out and location_out.
+int save_message(const char* sender, const char* recipient, const char* content, MessageType type, bool is_group,
+                 uint64_t* id_out, MsgLocation* location_out) {
+    if (msgstore_append(&message_store, sender, recipient, content, type,
+                        is_group ? MSGSTORE_FLAG_GROUP : 0, id_out, location_out) < 0) {
+        printf("Failed to store message from %s to %s\n", sender, recipient);
+        return -1;
+    }
+    if (search_index_add(&search_index, sender, recipient, is_group, content, *id_out, *location_out) < 0) {
+        printf("Failed to index message %llu\n", (unsigned long long)*id_out);
+    }
+    return 0;
 }
 
-// Save message to file
-void save_message_to_file(const char* sender, const char* recipient, const char* content, bool is_group) {
-    FILE* file = fopen("messages.txt", "a");
-    if (file) {
-        time_t now = time(NULL);
-        char* time_str = get_timestamp_string(now);
-        fprintf(file, "[%s] %s -> %s (%s): %s\n", 
-                time_str, sender, recipient, is_group ? "GROUP" : "1-1", content);
-        fclose(file);
-        free(time_str);
+static bool index_stored_message(void* ctx, const StoredMessage* msg, MsgLocation location) {
+    long* count = (long*)ctx;
+    if (search_index_add(&search_index, msg->sender, msg->recipient, (msg->flags & MSGSTORE_FLAG_GROUP) != 0,
+                         msg->content, msg->id, location) < 0) {
+        return false;
     }
+    (*count)++;
+    return true;
+}
+
+typedef struct {
+    ServerState* state;
+    const User* user;             // NULL if the searcher is unknown
+} SearchVisibility;
+
+// Group history is searchable by the group's current members
+static bool group_visible_to(void* ctx, const char* group_id) {
+    SearchVisibility* visibility = (SearchVisibility*)ctx;
+    Group* group = visibility->user ? find_group(visibility->state, group_id) : NULL;
+    if (!group) return false;
+
+    state_lock(group_lock(visibility->state, group), LOCK_GROUP_STRIPE);
+    bool member = idset_contains(&group->members, visibility->user->id);
+    state_unlock(group_lock(visibility->state, group));
+    return member;
 }
 
-// Search messages
-char** search_messages(const char* keyword, const char* username, const char* recipient, int* result_count) {
-    char** results = (char**)malloc(100 * sizeof(char*));
+// Search messages: one page of up to SEARCH_PAGE_SIZE formatted results,
+// newest first. cursor is 0 for the first page; the cursor for the next
+// page is stored in next_cursor (0 when there are no more results).
+char** search_messages(ServerState* state, const char* keyword, const char* username, const char* recipient,
+                       uint32_t cursor, int* result_count, uint32_t* next_cursor) {
     *result_count = 0;
-    
-    FILE* file = fopen("messages.txt", "r");
-    if (!file) return results;
-    
-    char line[BUFFER_SIZE];
-    while (fgets(line, sizeof(line), file) && *result_count < 100) {
-        if (strstr(line, keyword) != NULL) {
-            // Check if message is relevant to this user
-            if (strstr(line, username) != NULL && (strlen(recipient) == 0 || strstr(line, recipient) != NULL)) {
-                results[*result_count] = (char*)malloc(strlen(line) + 1);
-                strcpy(results[*result_count], line);
-                (*result_count)++;
-            }
-        }
-    }
-    
-    fclose(file);
+    *next_cursor = 0;
+    char** results = (char**)malloc(SEARCH_PAGE_SIZE * sizeof(char*));
+    if (!results) return NULL;
+
+    SearchVisibility visibility = { state, find_user(state, username) };
+    SearchQuery query = { username, recipient, cursor, SEARCH_PAGE_SIZE, group_visible_to, &visibility };
+    SearchDoc hits[SEARCH_PAGE_SIZE];
+    int hit_count = search_index_query(&search_index, keyword, &query, hits, next_cursor);
+
+    for (int i = 0; i < hit_count; i++) {
+        StoredMessage msg;
+        char content[MAX_CONTENT];
+        if (msgstore_read(&message_store, hits[i].location, &msg, content, sizeof(content)) < 0) {
+            continue;
+        }
+
+        char time_str[32];
+        format_time(msg.timestamp, time_str, sizeof(time_str));
+
+        const char* kind = (msg.flags & MSGSTORE_FLAG_GROUP) ? "GROUP" : "1-1";
+        int len = snprintf(NULL, 0, "[%s] %s -> %s (%s): %s\n", time_str, msg.sender, msg.recipient, kind, msg.content);
+        char* line = (char*)malloc(len + 1);
+        if (!line) break;
+        snprintf(line, len + 1, "[%s] %s -> %s (%s): %s\n", time_str, msg.sender, msg.recipient, kind, msg.content);
+        results[(*result_count)++] = line;
+    }
     return results;
 }
 
-// Main server function
-int main() {
+// Open the message store and the offline inbox in config->dir and rebuild
+// the search index from the store
+int open_storage(const MsgStoreConfig* config) {
+    if (msgstore_open(&message_store, config) < 0) {
+        printf("Failed to open message store in %s\n", config->dir);
+        return -1;
+    }
+
+    char inbox_path[300];
+    snprintf(inbox_path, sizeof(inbox_path), "%s/inbox.log", config->dir);
+    if (inbox_open(&offline_inbox, inbox_path) < 0) {
+        printf("Failed to open offline inbox %s\n", inbox_path);
+        return -1;
+    }
+
+    long indexed = 0;
+    if (search_index_init(&search_index) < 0 ||
+        msgstore_scan(&message_store, index_stored_message, &indexed) < 0) {
+        printf("Failed to build the search index\n");
+        return -1;
+    }
+    if (indexed > 0) {
+        printf("Indexed %ld stored messages\n", indexed);
+    }
+    return 0;
+}
+
+// Rebuild one saved change. Runs before any connection is served, so no
+// locks are taken. Records naming unknown users or groups are skipped.
+static int apply_state_record(void* ctx, const StateRecord* record) {
+    ServerState* state = (ServerState*)ctx;
+    uint32_t user_count = state->users.count;
+    switch (record->kind) {
+        case STATE_USER:
+            if (record->subject < user_count) return 0;  // Also in the snapshot
+            if (record->subject != user_count || !insert_user(state, record->text, record->text2)) return -1;
+            return 0;
+        case STATE_DIRECTORY:
+            /* load_state() refuses to start on a short image */
+            directory_users_expected = record->subject;
+            return record->subject <= user_count ? 0 : -1;
+        case STATE_GROUP:
+            if (record->subject < state->groups.count) return 0;
+            if (record->subject != state->groups.count || record->id_count != 1 || record->ids[0] >= user_count) {
+                return -1;
+            }
+            Group* new_group = insert_group(state, record->text, record->text2, record->ids[0], (time_t)record->value);
+            if (!new_group) return -1;
+            /* its messages are in the message store, not the ring */
+            new_group->history.complete = false;
+            return 0;
+        case STATE_FRIENDS:
+        case STATE_BLOCK:
+        case STATE_UNBLOCK: {
+            if (record->subject >= user_count) return -1;
+            User* user = user_by_id(state, record->subject);
+            int result = 0;
+            for (uint32_t i = 0; i < record->id_count; i++) {
+                UserId other = record->ids[i];
+                if (other >= user_count || other == user->id) {
+                    result = -1;
+                } else if (record->kind == STATE_FRIENDS) {
+                    if (idset_add(&user->friends, other) < 0 ||
+                        idset_add(&user_by_id(state, other)->friends, user->id) < 0) result = -1;
+                } else if (record->kind == STATE_BLOCK) {
+                    if (idset_add(&user->blocked, other) < 0) result = -1;
+                } else {
+                    idset_remove(&user->blocked, other);
+                }
+            }
+            return result;
+        }
+        case STATE_JOIN:
+        case STATE_LEAVE:
+        case STATE_ADMINS:
+        case STATE_RENAME:
+        case STATE_PIN: {
+            if (record->subject >= state->groups.count) return -1;
+            Group* group = (Group*)slab_get(&state->groups, record->subject);
+            if (record->kind == STATE_RENAME) {
+                memset(group->name, 0, sizeof(group->name));
+                strncpy(group->name, record->text, MAX_GROUP_NAME - 1);
+                return 0;
+            }
+            if (record->kind == STATE_PIN) {
+                return pin_insert(group, record->value, record->text) < 0 ? -1 : 0;
+            }
+            IdSet* set = record->kind == STATE_ADMINS ? &group->admins : &group->members;
+            int result = 0;
+            for (uint32_t i = 0; i < record->id_count; i++) {
+                if (record->ids[i] >= user_count) {
+                    result = -1;
+                } else if (record->kind == STATE_LEAVE) {
+                    idset_remove(set, record->ids[i]);
+                } else if (idset_add(set, record->ids[i]) < 0) {
+                    result = -1;
+                }
+            }
+            return result;
+        }
+        default:
+            return -1;  // Written by a newer server
+    }
+}
+
+// Add a record listing the members of set in [low, high), copied under lock
+static int snapshot_ids(StateStore* store, StateRecordKind kind, uint32_t subject, mutex_t* lock,
+                        LockClass lock_class, const IdSet* set, UserId low, UserId high) {
+    uint32_t count;
+    state_lock(lock, lock_class);
+    UserId* ids = copy_ids(set, &count);
+    state_unlock(lock);
+    if (!ids) return -1;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (ids[i] >= low && ids[i] < high) ids[kept++] = ids[i];
+    }
+    if (kept == 0) return 0;
+
+    StateRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = kind;
+    record.subject = subject;
+    record.ids = ids;
+    record.id_count = kept;
+    return statestore_snapshot_add(store, &record);
+}
+
+// Names and passwords never change, so they are read without a lock
+static void directory_account(void* ctx, uint32_t id, const char** username, const char** password) {
+    if (id < directory_image.count) {
+        *username = directory_image.accounts[id].username;
+        *password = directory_image.accounts[id].password;
+        return;
+    }
+    User* user = user_by_id((ServerState*)ctx, id);
+    *username = user->username;
+    *password = user->password;
+}
+
+// Write every user and group to a snapshot. Runs on the compactor thread
+// while clients are served; each user's and group's fields are copied
+// under their lock and written after it is released. Users and groups
+// created after the snapshot starts, and changes that name them, are
+// left to the log that starts with it.
+static int write_state_snapshot(void* ctx, StateStore* store) {
+    ServerState* state = (ServerState*)ctx;
+    directory_read_lock(state);
+    uint32_t user_count = state->users.count;
+    uint32_t group_count = state->groups.count;
+    directory_read_unlock(state);
+
+    // The accounts go to a new directory image, which is in place before
+    // the snapshot that counts on it
+    char path[300];
+    snprintf(path, sizeof(path), "%s/%s", store->dir, DIRMAP_FILE);
+    if (dirmap_write(path, user_count, directory_account, state) < 0) {
+        printf("Failed to write directory image %s\n", path);
+        return -1;
+    }
+    StateRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = STATE_DIRECTORY;
+    record.subject = user_count;
+    if (statestore_snapshot_add(store, &record) < 0) return -1;
+
+    for (uint32_t id = 0; id < user_count; id++) {
+        if (image_user_untouched(id)) continue;
+        User* user = user_by_id(state, id);
+        mutex_t* lock = user_lock(state, user);
+        /* each friendship once, from the lower id */
+        if (snapshot_ids(store, STATE_FRIENDS, id, lock, LOCK_USER_STRIPE, &user->friends, id + 1, user_count) < 0 ||
+            snapshot_ids(store, STATE_BLOCK, id, lock, LOCK_USER_STRIPE, &user->blocked, 0, user_count) < 0) {
+            return -1;
+        }
+    }
+
+    for (uint32_t id = 0; id < group_count; id++) {
+        Group* group = (Group*)slab_get(&state->groups, id);
+        mutex_t* lock = group_lock(state, group);
+        char name[MAX_GROUP_NAME];
+        state_lock(lock, LOCK_GROUP_STRIPE);
+        memcpy(name, group->name, sizeof(name));
+        state_unlock(lock);
+
+        memset(&record, 0, sizeof(record));
+        record.kind = STATE_GROUP;
+        record.subject = id;
+        record.value = (uint64_t)group->created_at;
+        record.text = group->group_id;
+        record.text_len = (int)strlen(group->group_id);
+        record.text2 = name;
+        record.text2_len = (int)strlen(name);
+        record.ids = &group->creator;
+        record.id_count = 1;
+        if (statestore_snapshot_add(store, &record) < 0 ||
+            snapshot_ids(store, STATE_JOIN, id, lock, LOCK_GROUP_STRIPE, &group->members, 0, user_count) < 0 ||
+            snapshot_ids(store, STATE_ADMINS, id, lock, LOCK_GROUP_STRIPE, &group->admins, 0, user_count) < 0) {
+            return -1;
+        }
+
+        /* pinned content lives in the group's arena and never moves */
+        for (int i = 0; ; i++) {
+            state_lock(lock, LOCK_GROUP_STRIPE);
+            bool more = i < group->pinned_count;
+            PinnedMessage pin;
+            if (more) pin = group->pinned[i];
+            state_unlock(lock);
+            if (!more) break;
+
+            memset(&record, 0, sizeof(record));
+            record.kind = STATE_PIN;
+            record.subject = id;
+            record.value = pin.id;
+            record.text = pin.content;
+            record.text_len = (int)strlen(pin.content);
+            if (statestore_snapshot_add(store, &record) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Make the accounts of a mapped directory image the first users. Their
+// records are filled in on first use and the user index takes over the
+// image's slot table, so this touches no account.
+static int install_directory_image(ServerState* state, const DirMap* map) {
+    if (map->count == 0) return 0;
+    uint32_t blocks = (map->count + IMAGE_BLOCK_USERS - 1) / IMAGE_BLOCK_USERS;
+    image_blocks_filled = (atomic_uchar*)calloc(blocks, sizeof(atomic_uchar));
+    if (!image_blocks_filled || slab_extend(&state->users, map->count) < 0) return -1;
+    mutex_init(&image_fill_lock);
+    if (map->slots) {
+        hash_index_adopt(&state->user_index, map->slots, map->capacity, map->count);
+        return 0;
+    }
+    /* written with another byte order: index the names again */
+    for (uint32_t id = 0; id < map->count; id++) {
+        if (hash_index_insert(&state->user_index, map->accounts[id].username, (int32_t)id) < 0) return -1;
+    }
+    return 0;
+}
+
+// Load the users and groups saved in dir, importing account.txt into a
+// new store, and start compacting the state log in the background. Call
+// after open_storage(), before serving clients.
+int load_state(const char* dir) {
+    // Accounts in the directory image come first; the snapshot and the
+    // logs add the rest
+    char path[300];
+    snprintf(path, sizeof(path), "%s/%s", dir, DIRMAP_FILE);
+    if (dirmap_open(&directory_image, path) == 0 && install_directory_image(&server_state, &directory_image) < 0) {
+        printf("Failed to load directory image %s\n", path);
+        return -1;
+    }
+
+    long applied = 0;
+    long skipped = 0;
+    if (statestore_open(&state_store, dir, apply_state_record, &server_state, &applied, &skipped) < 0) {
+        printf("Failed to load saved state from %s\n", dir);
+        return -1;
+    }
+    if (directory_users_expected > directory_image.count) {
+        /* the snapshot holds no other copy of these accounts */
+        printf("Directory image %s holds %u of %u users\n", path, directory_image.count, directory_users_expected);
+        return -1;
+    }
+    if (statestore_is_empty(&state_store)) {
+        int imported = load_accounts(ACCOUNT_FILE);
+        statestore_flush(&state_store);
+        if (imported > 0) {
+            printf("Imported %d accounts from %s\n", imported, ACCOUNT_FILE);
+        }
+    } else {
+        printf("Loaded %u users and %u groups from %s\n", server_state.users.count,
+               server_state.groups.count, dir);
+    }
+    if (skipped > 0) {
+        printf("Warning: skipped %ld of %ld saved state changes\n", skipped, applied + skipped);
+    }
+    if (statestore_start_compactor(&state_store, write_state_snapshot, &server_state) < 0) {
+        printf("Failed to start the state compactor\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Main server function, left out of builds that link server.c into
+// another program (-DCHAT_NO_MAIN)
+#ifndef CHAT_NO_MAIN
+#ifndef _WIN32
+// SIGINT and SIGTERM are blocked in every thread and taken here instead,
+// so queued activity log records are written out before the process exits
+static sigset_t shutdown_signals;
+
+static void* shutdown_main(void* arg) {
+    (void)arg;
+    int sig;
+    while (sigwait(&shutdown_signals, &sig) == 0) {
+        if (sig == SIGUSR1) {
+            lock_profile_dump();
+            continue;
+        }
+        printf("Shutting down\n");
+        msgstore_close(&message_store);
+        inbox_close(&offline_inbox);
+        statestore_close(&state_store);
+        log_writer_stop();
+        exit(0);
+    }
+    return NULL;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    ServerMode mode = SERVER_MODE_THREADS;
+    int workers = 0;
+    int metrics_port = 0;
+    MsgStoreConfig store_config;
+    msgstore_config_defaults(&store_config);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            mode = SERVER_MODE_THREADS;
+        } else if (strcmp(argv[i], "--epoll") == 0) {
+            mode = SERVER_MODE_EPOLL;
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            workers = atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--durability=none") == 0) {
+            store_config.durability = MSGSTORE_DURABILITY_NONE;
+        } else if (strcmp(argv[i], "--durability=batch") == 0) {
+            store_config.durability = MSGSTORE_DURABILITY_BATCH;
+        } else if (strcmp(argv[i], "--durability=sync") == 0) {
+            store_config.durability = MSGSTORE_DURABILITY_SYNC;
+        } else if (strcmp(argv[i], "--slow-consumer=disconnect") == 0) {
+            slow_consumer_policy = SLOW_CONSUMER_DISCONNECT;
+        } else if (strcmp(argv[i], "--slow-consumer=drop") == 0) {
+            slow_consumer_policy = SLOW_CONSUMER_DROP;
+        } else if (strncmp(argv[i], "--metrics-port=", 15) == 0) {
+            metrics_port = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--group-history=", 16) == 0) {
+            group_history_size = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--node-id=", 10) == 0 && atoi(argv[i] + 10) >= 0 &&
+                   atoi(argv[i] + 10) <= (int)MSGID_MAX_NODE) {
+            store_config.node_id = (uint32_t)atoi(argv[i] + 10);
+        } else {
+            printf("Usage: %s [--threads | --epoll] [--workers=N] [--durability=none|batch|sync]"
+                   " [--slow-consumer=disconnect|drop] [--metrics-port=PORT] [--group-history=N]"
+                   " [--node-id=0-1023]\n", argv[0]);
+            return 1;
+        }
+    }
+
     socket_t server_socket;
     if (init_server(&server_socket) < 0) {
         return 1;
     }
 
+    #ifndef _WIN32
+    /* block before any thread starts so every thread inherits the mask */
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    #ifdef LOCK_PROFILE
+    sigaddset(&shutdown_signals, SIGUSR1);
+    #endif
+    bool signals_blocked = pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL) == 0;
+    #endif
+
+    LogConfig log_config;
+    log_config_defaults(&log_config);
+    log_writer_start(&log_config);
+
+    if (open_storage(&store_config) < 0 || load_state(store_config.dir) < 0) {
+        return 1;
+    }
+
+    #ifndef _WIN32
+    pthread_t shutdown_thread;
+    if (signals_blocked && pthread_create(&shutdown_thread, NULL, shutdown_main, NULL) == 0) {
+        pthread_detach(shutdown_thread);
+    } else {
+        pthread_sigmask(SIG_UNBLOCK, &shutdown_signals, NULL);
+    }
+    #endif
+
+    #ifndef _WIN32
+    /* a peer closing mid-send must not kill the whole server */
+    signal(SIGPIPE, SIG_IGN);
+    #endif
+
+    if (metrics_port > 0 && metrics_server_start(metrics_port) < 0) {
+        return 1;
+    }
+
+    if (outbound_writer_start() < 0) {
+        printf("Failed to start the outbound writer\n");
+        return 1;
+    }
+
+    if (mode == SERVER_MODE_EPOLL) {
+        if (workers <= 0) {
+            workers = default_worker_count();
+        }
+        printf("Running epoll event loop with %d workers\n", workers);
+        run_reactor(server_socket, &server_state, workers);
+        /* only returns if the event loop could not be started */
+        printf("Falling back to thread-per-connection mode\n");
+    }
+
     printf("Waiting for clients...\n");
 
     while (1) {
@@ -921,25 +2552,27 @@ int main() {
             continue;
         }
 
-        ClientThreadData* data = (ClientThreadData*)malloc(sizeof(ClientThreadData));
-        data->client_socket = client_socket;
-        data->client_addr = client_addr;
-        data->server_state = &server_state;
-        data->user = NULL;
+        Connection* conn = connection_create(&server_state, client_socket, &client_addr);
+        if (!conn) {
+            close_socket(client_socket);
+            continue;
+        }
+        printf("Client connected\n");
 
         #ifdef _WIN32
-        HANDLE thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)handle_client, data, 0, NULL);
+        HANDLE thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)handle_client, conn, 0, NULL);
         if (thread == NULL) {
-            close_socket(client_socket);
-            free(data);
+            connection_close(conn);  // Also closes the socket
+        } else {
+            CloseHandle(thread);
         }
         #else
         pthread_t thread;
-        if (pthread_create(&thread, NULL, handle_client, data) != 0) {
-            close_socket(client_socket);
-            free(data);
+        if (pthread_create(&thread, NULL, handle_client, conn) != 0) {
+            connection_close(conn);  // Also closes the socket
+        } else {
+            pthread_detach(thread);
         }
-        pthread_detach(thread);
         #endif
     }
 
@@ -949,5 +2582,4 @@ int main() {
     #endif
     return 0;
 }
-
-
+#endif // CHAT_NO_MAIN
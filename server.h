@@ -2,47 +2,137 @@
 #define SERVER_H
 
 #include "common.h"  // Includes socket libraries (winsock2.h for Windows, sys/socket.h for Linux)
+#include <stdatomic.h>
+#include "hash_index.h"
+#include "msgstore.h"
+
+#define USER_LOCK_STRIPES 64
+#define GROUP_LOCK_STRIPES 16
 
 // Server state
+//
+// Locking: there is no global lock. Each lock guards one slice of state:
+//   account_lock      - serializes registrations
+//   directory_lock    - appends to the users and groups tables, their
+//                       hash indexes and user_names; records never move,
+//                       so pointers stay valid after unlocking
+//   group_locks[i]    - all fields of groups whose index maps to stripe i
+//   user_locks[i]     - online state, conn, friends and blocks of users whose
+//                       index maps to stripe i
+//   Connection.send_lock - a connection's outbound queue and socket writes
+//
+// Locks are always taken in this order, and two user stripes in ascending
+// index order (see lock_user_pair()):
+//   account_lock -> directory_lock -> group stripe -> user stripes -> send_lock
+// State locks are taken through wrappers that time how long each command
+// holds them (see metrics.h); send_lock is not a state lock.
+// Sends, file I/O and log_activity() run after state locks are released,
+// except send_lock which only covers a nonblocking write and a queue
+// append, so a slow receiver never holds up the sender. The message
+// store's own locks are leaves and are never taken with state locks held.
+// The offline inbox lock is a leaf taken under a user stripe, so queueing
+// a message and logging in cannot miss each other; its log is written by
+// inbox_flush() once state locks are released. The state store's staging
+// lock is a leaf too: changes are logged under the lock guarding them and
+// written by statestore_flush() once state locks are released.
+// The search index lock is never taken with state locks held either; a
+// search holds it while checking group membership, so it comes first:
+//   search index lock -> directory_lock -> group stripe
 typedef struct {
-    User users[1000];
-    int user_count;
-    Group groups[100];
-    int group_count;
-    Message conversations[5000];  // Store all 1-1 messages
-    int conversation_count;
-    #ifdef _WIN32
-    CRITICAL_SECTION mutex;
-    #else
-    pthread_mutex_t mutex;
-    #endif
+    SlabTable users;              // User records by User.id
+    SlabTable groups;             // Group records by Group.id
+    HashIndex user_index;         // username -> User.id
+    HashIndex group_index;        // group_id -> Group.id
+    Arena user_names;             // Names and passwords of users added since
+                                  // the directory image (dirmap.h) was mapped
+    mutex_t account_lock;
+    rwlock_t directory_lock;
+    mutex_t user_locks[USER_LOCK_STRIPES];
+    mutex_t group_locks[GROUP_LOCK_STRIPES];
 } ServerState;
 
-// Client handler thread data
+// How connections are serviced, chosen at startup
+typedef enum {
+    SERVER_MODE_THREADS = 0,  // One blocking thread per connection
+    SERVER_MODE_EPOLL = 1     // Event loop plus fixed worker pool (Linux)
+} ServerMode;
+
+// Bytes a connection may have queued for sending before it is treated as
+// a slow consumer
+#define OUTBOUND_LIMIT (1 << 20)
+
+// What happens to a frame that would overflow a slow consumer's queue
+typedef enum {
+    SLOW_CONSUMER_DISCONNECT = 0,  // Drop the queue and close the connection
+    SLOW_CONSUMER_DROP = 1         // Drop the frame and keep the connection
+} SlowConsumerPolicy;
+
+// Frames waiting for a connection's socket, oldest first. Each entry holds
+// a reference to a frame that may be queued for other connections too.
 typedef struct {
+    Frame** frames;              // Ring buffer, allocated only while non-empty
+    int head;
+    int count;
+    int capacity;
+    int offset;                  // Bytes of the head frame already written
+    int bytes;                   // Bytes still to be written
+} OutboundQueue;
+
+// Per-connection state, shared by both server modes
+typedef struct Connection {
     socket_t client_socket;
     struct sockaddr_in client_addr;
     ServerState* server_state;
-    User* user;
-} ClientThreadData;
+    User* user;                  // Logged-in user, NULL until CMD_LOGIN
+    ProtocolFormat format;       // Reply format, fixed by the first frame
+    bool format_known;
+    bool acks_offline;           // Client acknowledges offline messages
+    RecvBuffer pending;          // Partial frame carried between reads
+    struct Connection* next;     // Link in the reactor's ready queue
+    uint64_t ready_at;           // When it joined the ready queue (metrics)
+    atomic_int refcount;         // Owner plus User.conn plus in-flight senders
+    mutex_t send_lock;           // Outbound queue and socket writes
+    OutboundQueue outbound;      // Frames the socket has not taken yet
+    bool write_watched;          // Outbound writer holds a reference
+    bool send_failed;            // Write failed or the consumer was cut off
+    int frames_dropped;          // Frames lost to SLOW_CONSUMER_DROP
+} Connection;
 
 // Function declarations
+int init_server_state(ServerState* state);
 int init_server(socket_t* server_socket);
+int open_storage(const MsgStoreConfig* config);
+int load_state(const char* dir);
 #ifdef _WIN32
 DWORD WINAPI handle_client(LPVOID arg);
 #else
 void* handle_client(void* arg);
 #endif
+Connection* connection_create(ServerState* state, socket_t socket, const struct sockaddr_in* addr);
+void connection_retain(Connection* conn);
+void connection_release(Connection* conn);
+int connection_send(Connection* conn, Frame* const* frames, int count);
+bool connection_flush(Connection* conn);
+void connection_close(Connection* conn);
+bool process_input(Connection* conn, char* data, int len);
+bool process_frame(Connection* conn, char* buffer, int len);
+bool process_command(Connection* conn, const MessageView* msg);
 User* find_user(ServerState* state, const char* username);
+User* user_by_id(ServerState* state, UserId id);
 Group* find_group(ServerState* state, const char* group_id);
-void add_user(ServerState* state, const char* username, const char* password);
-void send_response(socket_t socket, CommandType cmd, const char* content);
+User* add_user(ServerState* state, const char* username, const char* password);
+Group* create_group(ServerState* state, const char* name, const User* creator, char* group_id);
+bool is_blocked(const User* user, const User* other);
+bool are_friends(const User* user1, const User* user2);
+int add_friend(User* user1, User* user2);
+void send_response(Connection* conn, CommandType cmd, const char* content);
 void broadcast_to_friends(ServerState* state, const char* username, const char* message);
-void save_message_to_file(const char* sender, const char* recipient, const char* content, bool is_group);
-char** search_messages(const char* keyword, const char* username, const char* recipient, int* result_count);
-// Account persistence
+int save_message(const char* sender, const char* recipient, const char* content, MessageType type, bool is_group,
+                 uint64_t* id_out, MsgLocation* location_out);
+char** search_messages(ServerState* state, const char* keyword, const char* username, const char* recipient,
+                       uint32_t cursor, int* result_count, uint32_t* next_cursor);
+// Import of account.txt into an empty state store
 int load_accounts(const char* filename);
-int save_account(const char* filename, const char* username, const char* password);
 
 #endif // SERVER_H
 
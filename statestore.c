@@ -0,0 +1,433 @@
+#include "statestore.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define STATE_MAGIC 0x54415453u  // "STAT" on disk
+#define STATE_HEADER_SIZE 32
+#define STATE_MAX_IDS (1u << 24)
+
+// Record layout (little-endian):
+//   u32 magic  u32 crc32 (of the rest)  u8 kind  u8 unused
+//   u16 text_len  u16 text2_len  u16 unused  u32 subject  u64 value
+//   u32 id_count  text bytes  text2 bytes  u32 ids...
+
+static void sleep_ms(int ms) {
+    #ifdef _WIN32
+    Sleep(ms);
+    #else
+    usleep(ms * 1000);
+    #endif
+}
+
+static void snapshot_path(const StateStore* store, char* path, size_t size) {
+    snprintf(path, size, "%s/state.snapshot", store->dir);
+}
+
+static void log_path(const StateStore* store, uint32_t number, char* path, size_t size) {
+    snprintf(path, size, "%s/state.%u.log", store->dir, number);
+}
+
+static bool file_exists(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    fclose(file);
+    return true;
+}
+
+static size_t record_size(const StateRecord* record) {
+    return STATE_HEADER_SIZE + (size_t)record->text_len + (size_t)record->text2_len +
+           (size_t)record->id_count * 4;
+}
+
+// out must have room for record_size(record) bytes
+static size_t encode_record(unsigned char* out, const StateRecord* record) {
+    memset(out, 0, STATE_HEADER_SIZE);
+    put_le32(out, STATE_MAGIC);
+    out[8] = (unsigned char)record->kind;
+    out[10] = (unsigned char)(record->text_len & 0xFF);
+    out[11] = (unsigned char)(record->text_len >> 8);
+    out[12] = (unsigned char)(record->text2_len & 0xFF);
+    out[13] = (unsigned char)(record->text2_len >> 8);
+    put_le32(out + 16, record->subject);
+    put_le64(out + 20, record->value);
+    put_le32(out + 28, record->id_count);
+
+    size_t len = STATE_HEADER_SIZE;
+    if (record->text_len > 0) memcpy(out + len, record->text, (size_t)record->text_len);
+    len += (size_t)record->text_len;
+    if (record->text2_len > 0) memcpy(out + len, record->text2, (size_t)record->text2_len);
+    len += (size_t)record->text2_len;
+    for (uint32_t i = 0; i < record->id_count; i++) {
+        put_le32(out + len, record->ids[i]);
+        len += 4;
+    }
+    put_le32(out + 4, crc32_update(0, out + 8, len - 8));
+    return len;
+}
+
+// Grow the compactor's record buffer to at least size bytes
+static int reserve_record_buffer(StateStore* store, size_t size) {
+    if (size <= store->record_capacity) return 0;
+    size_t capacity = store->record_capacity ? store->record_capacity : 4096;
+    while (capacity < size) capacity *= 2;
+    unsigned char* buffer = (unsigned char*)realloc(store->record_buffer, capacity);
+    if (!buffer) return -1;
+    store->record_buffer = buffer;
+    store->record_capacity = capacity;
+    return 0;
+}
+
+// Read the next record of file. The record's strings and ids point into
+// buffers owned by the store. Returns 1 for a record, 0 at the end of the
+// file and -1 at a damaged or partial record.
+static int read_record(StateStore* store, FILE* file, StateRecord* record, uint32_t** ids,
+                       uint32_t* ids_capacity) {
+    if (reserve_record_buffer(store, STATE_HEADER_SIZE) < 0) return -1;
+    unsigned char* header = store->record_buffer;
+    size_t n = fread(header, 1, STATE_HEADER_SIZE, file);
+    if (n == 0) return 0;
+    if (n < STATE_HEADER_SIZE || get_le32(header) != STATE_MAGIC) return -1;
+
+    int text_len = header[10] | (header[11] << 8);
+    int text2_len = header[12] | (header[13] << 8);
+    uint32_t id_count = get_le32(header + 28);
+    if (id_count > STATE_MAX_IDS) return -1;
+    size_t len = STATE_HEADER_SIZE + (size_t)text_len + (size_t)text2_len + (size_t)id_count * 4;
+    /* the strings get NUL-terminated copies after the record */
+    if (reserve_record_buffer(store, len + (size_t)text_len + (size_t)text2_len + 2) < 0) return -1;
+    unsigned char* data = store->record_buffer;
+    if (fread(data + STATE_HEADER_SIZE, 1, len - STATE_HEADER_SIZE, file) != len - STATE_HEADER_SIZE ||
+        crc32_update(0, data + 8, len - 8) != get_le32(data + 4)) {
+        return -1;
+    }
+
+    if (id_count > *ids_capacity) {
+        uint32_t* grown = (uint32_t*)realloc(*ids, id_count * sizeof(uint32_t));
+        if (!grown) return -1;
+        *ids = grown;
+        *ids_capacity = id_count;
+    }
+    const unsigned char* id_bytes = data + STATE_HEADER_SIZE + text_len + text2_len;
+    for (uint32_t i = 0; i < id_count; i++) {
+        (*ids)[i] = get_le32(id_bytes + 4 * i);
+    }
+
+    char* text = (char*)data + len;
+    memcpy(text, data + STATE_HEADER_SIZE, (size_t)text_len);
+    text[text_len] = '\0';
+    char* text2 = text + text_len + 1;
+    memcpy(text2, data + STATE_HEADER_SIZE + text_len, (size_t)text2_len);
+    text2[text2_len] = '\0';
+
+    record->kind = (StateRecordKind)data[8];
+    record->subject = get_le32(data + 16);
+    record->value = get_le64(data + 20);
+    record->text = text;
+    record->text_len = text_len;
+    record->text2 = text2;
+    record->text2_len = text2_len;
+    record->ids = *ids;
+    record->id_count = id_count;
+    return 1;
+}
+
+// Apply every record of one file and return how many there were. Sets
+// *damaged if the file ends in a damaged or partial record, and
+// *valid_bytes to the length of its intact prefix. A snapshot's first log
+// is stored in *first_log.
+static long replay_file(StateStore* store, const char* path, StateApplyFn apply, void* ctx,
+                        long* skipped, bool* damaged, long* valid_bytes, uint32_t* first_log) {
+    *damaged = false;
+    *valid_bytes = 0;
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+
+    uint32_t* ids = NULL;
+    uint32_t ids_capacity = 0;
+    StateRecord record;
+    long records = 0;
+    int rc;
+    while ((rc = read_record(store, file, &record, &ids, &ids_capacity)) > 0) {
+        if (record.kind == STATE_SNAPSHOT) {
+            if (first_log) *first_log = (uint32_t)record.value;
+        } else if (apply(ctx, &record) < 0) {
+            (*skipped)++;
+        }
+        if (record.kind == STATE_DIRECTORY) records += record.subject;
+        records++;
+        *valid_bytes = ftell(file);
+    }
+    free(ids);
+    fclose(file);
+    *damaged = rc < 0;
+    return records;
+}
+
+// Cut a damaged log back to its intact records
+static int truncate_log(const char* path, long size) {
+    #ifdef _WIN32
+    FILE* file = fopen(path, "r+b");
+    if (!file) return -1;
+    int rc = _chsize(_fileno(file), size);
+    fclose(file);
+    return rc;
+    #else
+    return truncate(path, (off_t)size);
+    #endif
+}
+
+int statestore_open(StateStore* store, const char* dir, StateApplyFn apply, void* ctx,
+                    long* applied_out, long* skipped_out) {
+    memset(store, 0, sizeof(StateStore));
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    mutex_init(&store->lock);
+    mutex_init(&store->io_lock);
+
+    char path[300];
+    long skipped = 0;
+    long valid_bytes;
+    bool damaged;
+    uint32_t first_log = 0;
+    snapshot_path(store, path, sizeof(path));
+    long records = replay_file(store, path, apply, ctx, &skipped, &damaged, &valid_bytes, &first_log);
+    if (damaged) {
+        /* the logs it replaced are gone, so starting would lose state */
+        printf("State snapshot %s is damaged\n", path);
+        return -1;
+    }
+    store->snapshot_records = records;
+
+    // Logs from before the snapshot are left over from a compaction that
+    // stopped before deleting them
+    for (uint32_t n = first_log; n-- > 0; ) {
+        log_path(store, n, path, sizeof(path));
+        if (remove(path) != 0) break;
+    }
+
+    uint32_t number = first_log;
+    for (;; number++) {
+        log_path(store, number, path, sizeof(path));
+        if (!file_exists(path)) break;
+        store->log_records += replay_file(store, path, apply, ctx, &skipped, &damaged, &valid_bytes, NULL);
+        store->log_number = number;
+        if (damaged) {
+            /* only the tail of the newest log can be torn, by a crash mid-write */
+            char next[300];
+            log_path(store, number + 1, next, sizeof(next));
+            if (file_exists(next) || truncate_log(path, valid_bytes) < 0) {
+                printf("State log %s is damaged\n", path);
+                return -1;
+            }
+            printf("Dropped a partial record at the end of %s\n", path);
+        }
+    }
+    if (number == first_log) {
+        store->log_number = first_log;
+    }
+
+    log_path(store, store->log_number, path, sizeof(path));
+    store->log = fopen(path, "ab");
+    if (!store->log) {
+        printf("Failed to open state log %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    store->open = true;
+
+    if (applied_out) *applied_out = store->snapshot_records + store->log_records - skipped;
+    if (skipped_out) *skipped_out = skipped;
+    return 0;
+}
+
+void statestore_close(StateStore* store) {
+    statestore_flush(store);
+    mutex_lock(&store->io_lock);
+    if (store->log) {
+        fclose(store->log);
+        store->log = NULL;
+    }
+    store->open = false;
+    mutex_unlock(&store->io_lock);
+}
+
+bool statestore_is_empty(const StateStore* store) {
+    return store->snapshot_records == 0 && store->log_records == 0;
+}
+
+int statestore_log(StateStore* store, const StateRecord* record) {
+    if (!store->open) return 0;
+
+    int rc = 0;
+    size_t size = record_size(record);
+    mutex_lock(&store->lock);
+    if (store->staged_len + size > store->staged_capacity) {
+        size_t capacity = store->staged_capacity ? store->staged_capacity * 2 : 4096;
+        while (capacity < store->staged_len + size) capacity *= 2;
+        char* staged = (char*)realloc(store->staged, capacity);
+        if (staged) {
+            store->staged = staged;
+            store->staged_capacity = capacity;
+        } else {
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        store->staged_len += encode_record((unsigned char*)store->staged + store->staged_len, record);
+        store->staged_records++;
+    }
+    mutex_unlock(&store->lock);
+    return rc;
+}
+
+void statestore_flush(StateStore* store) {
+    mutex_lock(&store->io_lock);
+
+    mutex_lock(&store->lock);
+    char* batch = store->staged;
+    size_t batch_len = store->staged_len;
+    size_t batch_capacity = store->staged_capacity;
+    long batch_records = store->staged_records;
+    store->staged = store->spare;
+    store->staged_capacity = store->spare_capacity;
+    store->staged_len = 0;
+    store->staged_records = 0;
+    mutex_unlock(&store->lock);
+
+    if (batch_len > 0 && store->log) {
+        if (fwrite(batch, 1, batch_len, store->log) != batch_len || fflush(store->log) != 0) {
+            printf("Failed to write state log: %s\n", strerror(errno));
+        }
+        store->log_records += batch_records;
+    }
+    store->spare = batch;
+    store->spare_capacity = batch_capacity;
+
+    mutex_unlock(&store->io_lock);
+}
+
+int statestore_snapshot_add(StateStore* store, const StateRecord* record) {
+    if (reserve_record_buffer(store, record_size(record)) < 0) return -1;
+    size_t len = encode_record(store->record_buffer, record);
+    if (fwrite(store->record_buffer, 1, len, store->snapshot_file) != len) return -1;
+    if (record->kind == STATE_DIRECTORY) store->snapshot_records += record->subject;
+    store->snapshot_records++;
+    return 0;
+}
+
+static int sync_file(FILE* file) {
+    if (fflush(file) != 0) return -1;
+    #ifdef _WIN32
+    return _commit(_fileno(file));
+    #else
+    return fsync(fileno(file));
+    #endif
+}
+
+// A failed compaction leaves the older logs in place; count them again
+static void restore_log_records(StateStore* store, long records) {
+    mutex_lock(&store->io_lock);
+    store->log_records += records;
+    mutex_unlock(&store->io_lock);
+}
+
+int statestore_compact(StateStore* store) {
+    char path[300];
+    char tmp_path[320];
+
+    // Send changes to a new log from here on. Everything in the older logs
+    // is already in the state the snapshot is about to read.
+    statestore_flush(store);
+    mutex_lock(&store->io_lock);
+    uint32_t old_log = store->log_number;
+    log_path(store, old_log + 1, path, sizeof(path));
+    FILE* log = fopen(path, "ab");
+    if (log) {
+        fclose(store->log);
+        store->log = log;
+        store->log_number = old_log + 1;
+    }
+    long carried = store->log_records;
+    store->log_records = 0;
+    mutex_unlock(&store->io_lock);
+    if (!log) {
+        printf("Failed to open state log %s: %s\n", path, strerror(errno));
+        restore_log_records(store, carried);
+        return -1;
+    }
+
+    snapshot_path(store, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    store->snapshot_file = fopen(tmp_path, "wb");
+    if (!store->snapshot_file) {
+        printf("Failed to write state snapshot %s: %s\n", tmp_path, strerror(errno));
+        restore_log_records(store, carried);
+        return -1;
+    }
+
+    long previous_records = store->snapshot_records;
+    store->snapshot_records = 0;
+    StateRecord header;
+    memset(&header, 0, sizeof(header));
+    header.kind = STATE_SNAPSHOT;
+    header.value = old_log + 1;
+    bool ok = statestore_snapshot_add(store, &header) == 0 &&
+              store->snapshot(store->snapshot_ctx, store) == 0;
+    ok = sync_file(store->snapshot_file) == 0 && ok;
+    ok = fclose(store->snapshot_file) == 0 && ok;
+    store->snapshot_file = NULL;
+    if (ok) {
+        #ifdef _WIN32
+        remove(path);
+        #endif
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        printf("Failed to write state snapshot %s\n", path);
+        remove(tmp_path);
+        store->snapshot_records = previous_records;
+        restore_log_records(store, carried);
+        return -1;
+    }
+
+    for (uint32_t n = old_log + 1; n-- > 0; ) {
+        log_path(store, n, path, sizeof(path));
+        if (remove(path) != 0) break;
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI compactor_main(LPVOID arg) {
+#else
+static void* compactor_main(void* arg) {
+#endif
+    StateStore* store = (StateStore*)arg;
+    while (1) {
+        mutex_lock(&store->io_lock);
+        bool due = store->log_records >= STATE_COMPACT_MIN_RECORDS &&
+                   store->log_records > store->snapshot_records;
+        mutex_unlock(&store->io_lock);
+        if (due) {
+            statestore_compact(store);
+        }
+        sleep_ms(STATE_COMPACT_CHECK_MS);
+    }
+    return 0;
+}
+
+int statestore_start_compactor(StateStore* store, StateSnapshotFn snapshot, void* ctx) {
+    store->snapshot = snapshot;
+    store->snapshot_ctx = ctx;
+    #ifdef _WIN32
+    HANDLE thread = CreateThread(NULL, 0, compactor_main, store, 0, NULL);
+    if (thread == NULL) return -1;
+    CloseHandle(thread);
+    #else
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compactor_main, store) != 0) return -1;
+    pthread_detach(thread);
+    #endif
+    return 0;
+}
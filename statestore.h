@@ -0,0 +1,113 @@
+#ifndef STATESTORE_H
+#define STATESTORE_H
+
+#include "common.h"
+
+// State store: durable copy of the user directory, friendships, blocks and
+// groups. A snapshot file holds the whole state as of its last compaction
+// and numbered log files (state.<n>.log) hold every change made since, each
+// record with a CRC-32 like the inbox log. Startup loads the snapshot and
+// replays the logs it names.
+//
+// A background thread compacts once the logs outgrow the snapshot: it
+// starts a new log, writes a fresh snapshot while changes continue, and
+// then deletes the older logs. Every record is idempotent (sets an
+// attribute, or adds or removes set members), so replaying the new log
+// over a snapshot taken while it was being written gives the state at the
+// end of that log.
+
+// Log records written before a compaction is considered
+#define STATE_COMPACT_MIN_RECORDS 10000
+#define STATE_COMPACT_CHECK_MS 1000
+
+typedef enum {
+    STATE_SNAPSHOT = 1,   // First record of a snapshot; value is its first log
+    STATE_USER,           // subject: user id; text: username, text2: password
+    STATE_FRIENDS,        // subject befriends each of ids, both ways
+    STATE_BLOCK,          // subject blocks each of ids
+    STATE_UNBLOCK,
+    STATE_GROUP,          // subject: group id; text: group_id, text2: name,
+                          // ids: creator; value: creation time
+    STATE_JOIN,           // ids join group subject
+    STATE_LEAVE,
+    STATE_ADMINS,         // ids administer group subject
+    STATE_RENAME,         // text: group subject's new name
+    STATE_PIN,            // value: message id pinned in group subject;
+                          // text: its content
+    STATE_DIRECTORY       // Users 0 to subject - 1 are in the directory
+                          // image written with the snapshot (dirmap.h);
+                          // counts as subject records
+} StateRecordKind;
+
+typedef struct {
+    StateRecordKind kind;
+    uint32_t subject;         // User or group id the record is about
+    uint64_t value;
+    const char* text;
+    int text_len;
+    const char* text2;
+    int text2_len;
+    const uint32_t* ids;
+    uint32_t id_count;
+} StateRecord;
+
+// Applies a record at startup. Returns -1 if the record does not fit the
+// state built so far; it is skipped and counted.
+typedef int (*StateApplyFn)(void* ctx, const StateRecord* record);
+
+struct StateStore;
+
+// Writes the current state with statestore_snapshot_add(). It runs while
+// the server is live and must take the usual state locks.
+typedef int (*StateSnapshotFn)(void* ctx, struct StateStore* store);
+
+typedef struct StateStore {
+    mutex_t lock;             // Staged log records (a leaf)
+    mutex_t io_lock;          // Log file writes and log switches; taken before lock
+    char dir[256];
+    FILE* log;
+    uint32_t log_number;      // Number of the log being appended to
+    long log_records;         // Records in the logs since the snapshot
+    long snapshot_records;
+    char* staged;             // Log records not yet written
+    size_t staged_len;
+    size_t staged_capacity;
+    long staged_records;
+    char* spare;              // Buffer being written by statestore_flush()
+    size_t spare_capacity;
+    FILE* snapshot_file;      // Snapshot being written by a compaction
+    unsigned char* record_buffer;  // Encode and read buffer of the compactor
+    size_t record_capacity;
+    StateSnapshotFn snapshot;
+    void* snapshot_ctx;
+    bool open;
+} StateStore;
+
+// Load the state in dir through apply, then open the log for appending.
+// Stores the number of records applied and skipped in the optional out
+// pointers.
+int statestore_open(StateStore* store, const char* dir, StateApplyFn apply, void* ctx,
+                    long* applied_out, long* skipped_out);
+void statestore_close(StateStore* store);
+
+// True if dir holds no saved state yet
+bool statestore_is_empty(const StateStore* store);
+
+// Stage a change for the log. Call under the lock that guards the changed
+// state, so records reach the log in the order the changes were made.
+// Does nothing unless the store is open.
+int statestore_log(StateStore* store, const StateRecord* record);
+
+// Write staged log records. Call after state locks are released.
+void statestore_flush(StateStore* store);
+
+// Write a new snapshot now, through the snapshot function
+int statestore_compact(StateStore* store);
+
+// Start the background compactor
+int statestore_start_compactor(StateStore* store, StateSnapshotFn snapshot, void* ctx);
+
+// Add a record to the snapshot being written; for StateSnapshotFn only
+int statestore_snapshot_add(StateStore* store, const StateRecord* record);
+
+#endif // STATESTORE_H